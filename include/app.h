@@ -14,6 +14,9 @@ class EmbeddingClient;
 class CompletionClient;
 class SimpleTokenizer;
 class InstanceRegistry;
+class EmbeddingDispatcher;
+class HttpClientPool;
+struct ApiConfig;
 
 class App {
   struct Impl;
@@ -33,10 +36,13 @@ public:
   void chat();
   void serve(int port, bool watch = false, int interval = 60, const std::string &infoFile = {});
   void providers(const std::string &testProvider);
+  void bench(size_t iterations);
 
   const Settings &settings() const;
   Settings &refSettings();
   const SimpleTokenizer &tokenizer() const;
+  // Tokenizer of the model behind api (its "tokenizer_path"), the default one if it has none.
+  const SimpleTokenizer &tokenizer(const ApiConfig &api) const;
   const SourceProcessor &sourceProcessor() const;
   const Chunker &chunker() const;
   const VectorDatabase &db() const;
@@ -44,6 +50,8 @@ public:
   const AdminAuth &auth() const;
   AdminAuth &auth();
   const InstanceRegistry &registry() const;
+  const EmbeddingDispatcher &embedder() const;
+  HttpClientPool &httpPool() const;
 
   bool isValidPrivateAppKey(const std::string &appKey);
   void requestShutdownAsync();
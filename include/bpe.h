@@ -0,0 +1,65 @@
+#ifndef _BPE_H_
+#define _BPE_H_
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "json_shim.h"
+
+// Byte pair encoding model of a Hugging Face tokenizer.json ("model": {"type": "BPE"}), as used
+// by Qwen, Llama 3, Gemma and most other generation models. Only counting is supported: a piece
+// is split into its initial symbols, which are then merged in merge-rank order.
+//
+// Byte-level models (GPT-2 style) start from one symbol per byte. The others start from one
+// symbol per UTF-8 character, with spaces shown as U+2581 (SentencePiece style) and characters
+// missing from the vocab split into byte tokens or counted as one unknown token.
+class BpeModel {
+public:
+  // Throws std::runtime_error if the json holds no BPE model.
+  explicit BpeModel(const nlohmann::json &tokenizerJson);
+
+  size_t size() const { return vocab_.size(); }
+  // Longest run of digits the pre-tokenizer keeps together, 0 for no limit.
+  size_t digitGroup() const { return digitGroup_; }
+  // SentencePiece style: spaces are shown as U+2581 and go with the word after them. With
+  // splitSpaces every space starts a piece, else a run of them does.
+  bool metaspace() const { return metaspace_; }
+  bool splitSpaces() const { return splitSpaces_; }
+
+  // Number of tokens piece encodes to. Pieces are what the pre-tokenizer yields, e.g. " foo".
+  size_t countPieces(std::string_view piece) const;
+  // Same for the piece a text starts with, which some SentencePiece style models prefix with a space.
+  size_t countFirstPiece(std::string_view piece) const;
+
+private:
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  struct Merge {
+    uint32_t rank;
+    uint32_t id;
+  };
+  // Lets the vocab be probed with a string_view.
+  struct TokenHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+  };
+
+  std::unordered_map<std::string, uint32_t, TokenHash, std::equal_to<>> vocab_;
+  std::unordered_map<uint64_t, Merge> merges_; // (left id << 32 | right id)
+  std::array<uint32_t, 256> byteSymbol_{}; // byte-level: id of each byte's symbol
+  bool byteLevel_ = false;
+  bool metaspace_ = false;
+  bool splitSpaces_ = false;
+  bool prependSpace_ = false;
+  bool byteFallback_ = false;
+  bool ignoreMerges_ = false;
+  size_t digitGroup_ = 0;
+
+  uint32_t idOf(std::string_view token) const;
+  std::string mapped(std::string_view piece) const;
+};
+
+#endif // _BPE_H_
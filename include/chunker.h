@@ -1,25 +1,29 @@
 #ifndef _CHUNKER_H_
 #define _CHUNKER_H_
 
+#include <cstdint>
 #include <vector>
 #include <string>
-#include <regex>
-#include <mutex>
+#include <string_view>
+#include <memory_resource>
 #include <unordered_map>
+#include "tokencache.h"
 #include "tokenizer.h"
 
 
 struct Chunk {
+  enum class Unit : uint8_t { Char, Line }; // what metadata.start/end count
+  enum class ContentType : uint8_t { Code, Text, Binary };
+
   std::string docUri;
   std::string chunkId;
   std::string text;
-  std::string raw;
   struct {
     size_t tokenCount;
     size_t start;
     size_t end;
-    std::string unit;
-    std::string type; // e.g. code or text
+    Unit unit;
+    ContentType type;
   } metadata;
 };
 
@@ -31,37 +35,44 @@ private:
   size_t minTokens_;
   size_t overlapTokens_;
 
-  std::vector<std::regex> functionPatterns_;
-  std::vector<std::regex> sectionPatterns_;
+  mutable TokenCountCache tokenCache_; // unit text -> tokens
 
-  struct CodeBlock {
-    size_t startLine;
-    size_t endLine;
-    size_t startPos;
-    size_t endPos;
-    std::string type;
+  // A file is laid out as pieces (units of text, or lines of code) viewing the source or the
+  // per-file arena, and drafts: runs of pieces that make a chunk. Text is copied out only
+  // when the chunks are materialized.
+  struct Piece {
+    std::string_view text;
+    size_t tokens;
   };
-
-  mutable std::mutex cacheMutex_;
-  mutable std::unordered_map<std::string, size_t> tokenCache_;
+  struct Draft {
+    size_t first; // pieces [first, last)
+    size_t last;
+    size_t tokens;
+    size_t start;
+    size_t end;
+  };
+  using Pieces = std::pmr::vector<Piece>;
+  using Drafts = std::pmr::vector<Draft>;
 
 public:
-  enum class ContentType { Code, Text, Binary };
+  using ContentType = Chunk::ContentType;
 
   Chunker(const SimpleTokenizer &tok, size_t minTok = 50, size_t maxTok = 500, float overlap = 0.1f);
 
   std::vector<Chunk> chunkText(const std::string &text, const std::string &uri = "", bool semantic = true) const;
 
 private:
-  std::vector<Chunk> postProcessChunks(const std::vector<Chunk> &chunks, ContentType chunkType) const;
-  size_t tokenCount(const std::string &text) const;
-  std::vector<Chunk> splitIntoTextChunks(std::string text, const std::string &docId) const;
-  std::vector<Chunk> splitIntoLineChunks(const std::string &text, const std::string &docId) const;
+  std::vector<Chunk> materialize(const Pieces &pieces, const Drafts &drafts, const std::string &uri, Chunk::Unit unit, ContentType type) const;
+  size_t tokenCount(std::string_view text) const;
+  void splitIntoTextChunks(std::string_view text, Pieces &pieces, Drafts &drafts) const;
+  void splitIntoLineChunks(std::string_view text, std::pmr::memory_resource &arena, Pieces &pieces, Drafts &drafts) const;
   std::vector<Chunk> splitIntoSemanticChunks(const std::string &text, const std::string &docId) const;
-  std::vector<std::string> splitIntoLines(const std::string &text) const;
+  void splitIntoLines(std::string_view line, bool hasNewline, std::pmr::memory_resource &arena, Pieces &pieces) const;
 
 public:
-  static std::string contentTypeToStr(Chunker::ContentType t);
+  static const char *contentTypeToStr(Chunker::ContentType t);
+  static const char *unitToStr(Chunk::Unit u);
+  TokenCountCache::Stats cacheStats() const { return tokenCache_.stats(); }
   static Chunker::ContentType detectContentType(const std::string &text, const std::string &uri);
   static std::string normalizeWhitespaces(const std::string &str);
 };
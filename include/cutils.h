@@ -28,6 +28,9 @@ namespace utils {
   time_t getFileModificationTime(const std::string &path);
   int safeStoI(const std::string &s, int def = 0);
   std::string trimmed(std::string_view sv);
+  // In place: trims spaces and line breaks, turns every run of other whitespace into one space
+  // and drops the empty lines. Lines keep a space where their whitespace was cut.
+  void normalizeWhitespaces(std::string &s);
   std::string addLineComments(std::string_view code, std::string_view filename);
   std::string stripMarkdownFromCodeBlock(std::string_view code);
 
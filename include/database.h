@@ -20,6 +20,8 @@ struct SearchResult {
   size_t end = 0;
   float similarityScore = 0;
   float distance = 0;
+  size_t tokenCount = std::string::npos; // as counted at ingest, npos when not known
+  const SimpleTokenizer *countedBy = nullptr; // tokenizer of tokenCount, null for the one used at ingest
 };
 
 
@@ -28,6 +30,7 @@ struct FileMetadata {
   time_t lastModified = 0;
   size_t fileSize = 0;
   size_t nofLines = 0;
+  size_t tokenCount = 0; // of the whole file, 0 when not known
   std::string hash; // Optional: content hash for change detection
 };
 
@@ -52,6 +55,9 @@ public:
 
   virtual size_t addDocument(const Chunk &chunk, const std::vector<float> &embedding) = 0;
   virtual std::vector<size_t> addDocuments(const std::vector<Chunk> &chunks, const std::vector<std::vector<float>> &embeddings) = 0;
+  // Swaps all chunks of a source for the given ones in one short write. Embeddings must be computed beforehand.
+  // sourceTokens is the token count of the whole source, kept with its file metadata.
+  virtual std::vector<size_t> replaceDocuments(const std::string &sourceId, const std::vector<Chunk> &chunks, const std::vector<std::vector<float>> &embeddings, size_t sourceTokens) = 0;
 
   virtual std::vector<SearchResult> search(const std::vector<float> &query, size_t top_k = 10) const = 0;
   virtual std::vector<SearchResult> searchWithFilter(const std::vector<float> &query,
@@ -66,6 +72,7 @@ public:
   virtual bool fileExistsInMetadata(const std::string &path) const = 0;
 
   virtual std::vector<FileMetadata> getTrackedFiles() const = 0;
+  virtual std::optional<FileMetadata> getFileMetadata(const std::string &path) const = 0;
   virtual std::unordered_map<std::string, size_t> getChunkCountsBySources() const = 0;
   virtual std::optional<SearchResult> getChunkData(size_t chunkId) const = 0;
   virtual std::vector<size_t> getChunkIdsBySource(const std::string &sourceId) const = 0;
@@ -79,7 +86,7 @@ public:
   virtual void commit() = 0;
   virtual void rollback() = 0;
 protected:
-  virtual void upsertFileMetadata(const std::string &path, std::time_t mtime, size_t size, size_t lines) = 0;
+  virtual void upsertFileMetadata(const std::string &path, std::time_t mtime, size_t size, size_t lines, size_t tokens) = 0;
 };
 
 
@@ -95,6 +102,7 @@ public:
 
   size_t addDocument(const Chunk &chunk, const std::vector<float> &embedding) override;
   std::vector<size_t> addDocuments(const std::vector<Chunk> &chunks, const std::vector<std::vector<float>> &embeddings) override;
+  std::vector<size_t> replaceDocuments(const std::string &sourceId, const std::vector<Chunk> &chunks, const std::vector<std::vector<float>> &embeddings, size_t sourceTokens) override;
   std::vector<SearchResult> search(const std::vector<float> &queryEmbedding, size_t topK = 10) const override;
   std::vector<SearchResult> searchWithFilter(const std::vector<float> &queryEmbedding,
     const std::string &sourceFilter = "",
@@ -108,6 +116,7 @@ public:
   bool fileExistsInMetadata(const std::string &path) const override;
 
   std::vector<FileMetadata> getTrackedFiles() const override;
+  std::optional<FileMetadata> getFileMetadata(const std::string &path) const override;
   std::unordered_map<std::string, size_t> getChunkCountsBySources() const override;
   std::vector<float> getEmbeddingVector(size_t chunkId) const override;
 
@@ -119,7 +128,7 @@ public:
   //void compact() override { compactIndex(); }
 
 protected:
-  void upsertFileMetadata(const std::string &sourceId, std::time_t mtime, size_t size, size_t lines) override;
+  void upsertFileMetadata(const std::string &sourceId, std::time_t mtime, size_t size, size_t lines, size_t tokens) override;
 
 private:
   std::string dbPath() const;
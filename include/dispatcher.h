@@ -0,0 +1,72 @@
+#ifndef _DISPATCHER_H_
+#define _DISPATCHER_H_
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include "inference.h"
+
+class Settings;
+class HttpClientPool;
+
+// Splits embedding work into token-budgeted batches and keeps several requests in flight.
+// Batch budget and concurrency adapt AIMD-style to observed latency and errors.
+// Requests are spread over the current API's endpoint and its replicas by least outstanding
+// requests; failing endpoints are benched for a while. Query embeddings take precedence over documents.
+// Query texts from concurrent callers arriving within a short window are coalesced into one request.
+class EmbeddingDispatcher {
+public:
+  struct EndpointStats {
+    std::string url;
+    size_t outstanding = 0;
+    size_t requests = 0;
+    size_t errors = 0;
+    bool healthy = true;
+  };
+
+  struct Stats {
+    size_t batchTokens = 0;
+    size_t concurrency = 0;
+    size_t inFlight = 0;
+    size_t requests = 0;
+    size_t errors = 0;
+    size_t retries = 0;
+    double avgLatencyMs = 0;
+    size_t queryBatches = 0;
+    size_t queryTexts = 0;
+    std::vector<EndpointStats> endpoints;
+  };
+
+  EmbeddingDispatcher(const Settings &s, HttpClientPool &pool);
+  ~EmbeddingDispatcher();
+
+  // tokenCounts may be empty, in which case counts are estimated from text length.
+  void embed(
+    const std::vector<std::string> &texts,
+    const std::vector<size_t> &tokenCounts,
+    std::vector<std::vector<float>> &embeddings,
+    EmbeddingClient::EncodeType et,
+    std::function<void(size_t, size_t)> onProgress = nullptr) const;
+
+  void embed(const std::string &text, std::vector<float> &embedding, EmbeddingClient::EncodeType et) const;
+
+  Stats stats() const;
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> imp;
+
+  void embedNow(
+    const std::vector<std::string> &texts,
+    const std::vector<size_t> &tokenCounts,
+    std::vector<std::vector<float>> &embeddings,
+    EmbeddingClient::EncodeType et,
+    std::function<void(size_t, size_t)> onProgress) const;
+  void embedQueries(const std::vector<std::string> &texts, std::vector<std::vector<float>> &embeddings) const;
+
+  EmbeddingDispatcher(const EmbeddingDispatcher &) = delete;
+  EmbeddingDispatcher &operator =(const EmbeddingDispatcher &) = delete;
+};
+
+#endif // _DISPATCHER_H_
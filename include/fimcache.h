@@ -0,0 +1,39 @@
+#ifndef _FIMCACHE_H_
+#define _FIMCACHE_H_
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Remembers recent FIM completions so that typing along a shown completion is answered without
+// calling the model. Entries are keyed by (scope, suffix hash, prefix-tail hash); when a new
+// prefix is an old one extended by the first characters of its completion, the rest of that
+// completion is returned. Least recently used entries are evicted.
+class FimCache {
+public:
+  struct Stats {
+    size_t entries = 0;
+    size_t hits = 0;
+    size_t misses = 0;
+  };
+
+  // A capacity of 0 disables the cache.
+  explicit FimCache(size_t capacity);
+  ~FimCache();
+
+  // scope separates entries that must not be mixed, e.g. api id and filename.
+  std::optional<std::string> lookup(std::string_view scope, std::string_view prefix, std::string_view suffix);
+  void store(std::string_view scope, std::string_view prefix, std::string_view suffix, const std::string &completion);
+
+  Stats stats() const;
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> imp;
+
+  FimCache(const FimCache &) = delete;
+  FimCache &operator =(const FimCache &) = delete;
+};
+
+#endif // _FIMCACHE_H_
@@ -0,0 +1,49 @@
+#ifndef _FIMRETRIEVER_H_
+#define _FIMRETRIEVER_H_
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class App;
+struct ApiConfig;
+struct SearchResult;
+
+// Context retrieval for FIM under a hard time budget. Uses a window around the cursor as the query,
+// scores it against cached per-file chunk vectors of the edited file and its related files, and
+// falls back to the global index last. Stages left when the budget is spent are skipped.
+class FimRetriever {
+public:
+  struct Stage {
+    const char *name = "";
+    double ms = 0;
+    bool skipped = false;
+  };
+
+  struct Result {
+    std::vector<SearchResult> results;
+    size_t usedTokens = 0;
+    std::vector<Stage> stages;
+  };
+
+  explicit FimRetriever(const App &app);
+  ~FimRetriever();
+
+  Result retrieve(
+    const ApiConfig &apiConfig,
+    std::string_view prefix,
+    std::string_view suffix,
+    const std::string &filename,
+    float contextSizeRatio,
+    size_t budgetMs) const;
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> imp;
+
+  FimRetriever(const FimRetriever &) = delete;
+  FimRetriever &operator =(const FimRetriever &) = delete;
+};
+
+#endif // _FIMRETRIEVER_H_
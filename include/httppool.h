@@ -0,0 +1,75 @@
+#ifndef _HTTPPOOL_H_
+#define _HTTPPOOL_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace httplib {
+  class Client;
+}
+
+// Process-wide pool of keep-alive http clients, keyed by scheme://host:port.
+// A client serves one request at a time, so callers lease one for the duration of a request
+// and hand it back afterwards. Up to maxIdlePerHost idle clients are kept per host.
+class HttpClientPool {
+public:
+  class Lease {
+  public:
+    Lease() = default;
+    Lease(Lease &&other) noexcept;
+    Lease &operator=(Lease &&other) noexcept;
+    ~Lease();
+
+    httplib::Client *operator->() const { return client_.get(); }
+    httplib::Client *get() const { return client_.get(); }
+    explicit operator bool() const { return client_ != nullptr; }
+
+    // Path part of the url the lease was acquired for.
+    const std::string &path() const { return path_; }
+
+    // Call when the connection is in an unknown state, e.g. after a transport error
+    // or an aborted read, so that it is closed instead of returned to the pool.
+    void discard() { reusable_ = false; }
+
+  private:
+    friend class HttpClientPool;
+    HttpClientPool *pool_ = nullptr;
+    std::string key_;
+    std::string path_;
+    std::unique_ptr<httplib::Client> client_;
+    bool reusable_ = true;
+
+    void release();
+  };
+
+  struct Stats {
+    size_t hosts = 0;
+    size_t idle = 0;
+    size_t leased = 0;
+    size_t created = 0;
+    size_t reused = 0;
+  };
+
+  explicit HttpClientPool(size_t maxIdlePerHost = 4);
+  ~HttpClientPool();
+
+  // Throws std::runtime_error on a malformed url.
+  Lease acquire(const std::string &url, size_t timeoutMs);
+
+  Stats stats() const;
+
+  // Splits an url into its scheme://host:port and path parts.
+  static std::pair<std::string, std::string> splitUrl(const std::string &url);
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> imp;
+
+  void giveBack(const std::string &key, std::unique_ptr<httplib::Client> client, bool reusable);
+
+  HttpClientPool(const HttpClientPool &) = delete;
+  HttpClientPool &operator =(const HttpClientPool &) = delete;
+};
+
+#endif // _HTTPPOOL_H_
@@ -3,19 +3,57 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
 #include <memory>
 #include <functional>
+#include <atomic>
 #include "json_shim.h"
 
 
 class App;
 struct SearchResult;
 struct ApiConfig;
+class HttpClientPool;
+class SimpleTokenizer;
 
 
+// Set once whoever asked for a generation has gone away. The optional probe (e.g. the server's
+// connection-closed check) is polled, so a disconnect is noticed even while no bytes are flowing.
+class CancellationToken {
+public:
+  CancellationToken() = default;
+  explicit CancellationToken(std::function<bool()> isGone) : isGone_(std::move(isGone)) {}
+
+  void cancel() const { cancelled_ = true; }
+  bool isCancelled() const {
+    if (!cancelled_ && isGone_ && isGone_()) cancelled_ = true;
+    return cancelled_;
+  }
+
+private:
+  std::function<bool()> isGone_;
+  mutable std::atomic<bool> cancelled_{ false };
+
+  CancellationToken(const CancellationToken &) = delete;
+  CancellationToken &operator =(const CancellationToken &) = delete;
+};
+
+// A file attached to a chat request; tokens is filled in by fitAttachments.
+struct Attachment {
+  std::string filename;
+  std::string content;
+  size_t tokens = 0;
+};
+
+// Picks the attachments that go into a prompt, of whose maxTokens usedTokens are taken already.
+// Small attachments come first and whole, the others follow in order as far as they fit, the
+// last one possibly truncated. Empty attachments are skipped. usedTokens grows by what is picked.
+std::vector<Attachment> fitAttachments(const SimpleTokenizer &tok, std::vector<Attachment> attachments, size_t maxTokens,
+  size_t &usedTokens, const std::function<void(std::string_view)> &onInfo = {});
+
 class InferenceClient {
 public:
-  InferenceClient(const ApiConfig &cfg, size_t timeout);
+  InferenceClient(const ApiConfig &cfg, size_t timeout, HttpClientPool &pool);
   virtual ~InferenceClient();
 
 protected:
@@ -29,11 +67,15 @@ protected:
 class EmbeddingClient : public InferenceClient {
 public:
   enum class EncodeType { Document, Query };
-  EmbeddingClient(const ApiConfig &cfg, size_t timeout);
+  EmbeddingClient(const ApiConfig &cfg, size_t timeout, HttpClientPool &pool);
   void generateEmbeddings(const std::vector<std::string> &texts, std::vector<std::vector<float>> &embeddingsList, EmbeddingClient::EncodeType et) const;
   void generateEmbeddings(const std::string &text, std::vector<float> &embeddings, EmbeddingClient::EncodeType et) const;
 
   static float calculateL2Norm(const std::vector<float> &vec);
+
+  // Appends the embeddings found in a /embedding or /v1/embeddings response body, in index order.
+  // Throws std::runtime_error unless exactly `expected` embeddings are present.
+  static void parseEmbeddings(std::string_view body, size_t expected, std::vector<std::vector<float>> &embeddingsList);
 private:
   std::vector<std::string> prepareContent(const std::vector<std::string> &texts, EmbeddingClient::EncodeType et) const;
 };
@@ -42,12 +84,15 @@ class CompletionClient : public InferenceClient {
   const App &app_;
 public:
   CompletionClient(const ApiConfig &cfg, size_t timeout, const App &a);
+
+  // When `cancel` fires the upstream request is aborted and the text generated so far is returned.
   std::string generateCompletion(
     const nlohmann::json &messages, 
     const std::vector<SearchResult> &searchRes, 
     float temperature,
     size_t maxTokens,
-    std::function<void(const std::string &)> onStream) const;
+    std::function<void(const std::string &)> onStream,
+    const CancellationToken *cancel = nullptr) const;
 
   std::string generateFim(
     const std::string &prefix, 
@@ -55,7 +100,8 @@ public:
     const std::vector<std::string> &stops,
     float temperature, 
     size_t maxTokens,
-    const std::vector<SearchResult> &searchRes
+    const std::vector<SearchResult> &searchRes,
+    const CancellationToken *cancel = nullptr
   ) const;
 
 private:
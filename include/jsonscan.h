@@ -0,0 +1,178 @@
+#ifndef _JSONSCAN_H_
+#define _JSONSCAN_H_
+
+#include <string>
+#include <string_view>
+#include <stdexcept>
+
+namespace utils {
+
+  // Forward-only cursor over a json text for hot paths that only need a few fields
+  // and can't afford building a DOM. Strings are returned raw (escapes left in place),
+  // use appendUnescaped when the decoded text is needed.
+  class JsonCursor {
+  public:
+    explicit JsonCursor(std::string_view s) : s_(s) {}
+
+    std::string_view text() const { return s_; }
+    size_t pos() const { return p_; }
+    void setPos(size_t p) { p_ = p; }
+
+    [[noreturn]] void fail() const {
+      throw std::runtime_error("Malformed json at offset " + std::to_string(p_));
+    }
+
+    char peek() const { return p_ < s_.size() ? s_[p_] : '\0'; }
+
+    void skipWs() {
+      while (p_ < s_.size() && (s_[p_] == ' ' || s_[p_] == '\n' || s_[p_] == '\r' || s_[p_] == '\t')) ++p_;
+    }
+
+    void expect(char c) {
+      skipWs();
+      if (peek() != c) fail();
+      ++p_;
+    }
+
+    std::string_view string() {
+      expect('"');
+      const size_t start = p_;
+      while (p_ < s_.size() && s_[p_] != '"') {
+        p_ += (s_[p_] == '\\') ? 2 : 1;
+      }
+      if (s_.size() <= p_) fail();
+      return s_.substr(start, p_++ - start);
+    }
+
+    // Consumes `null` if it is next.
+    bool null() {
+      skipWs();
+      if (s_.substr(p_, 4) != "null") return false;
+      p_ += 4;
+      return true;
+    }
+
+    // Calls onKey(key) with the cursor on each value; onKey must consume the value.
+    template <typename F> void forEachKey(F &&onKey) {
+      expect('{');
+      skipWs();
+      if (peek() == '}') { ++p_; return; }
+      while (true) {
+        auto key = string();
+        expect(':');
+        skipWs();
+        onKey(key);
+        skipWs();
+        if (peek() == ',') { ++p_; continue; }
+        expect('}');
+        return;
+      }
+    }
+
+    // Calls onElement() with the cursor on each element; onElement must consume it.
+    template <typename F> void forEachElement(F &&onElement) {
+      expect('[');
+      skipWs();
+      if (peek() == ']') { ++p_; return; }
+      while (true) {
+        skipWs();
+        onElement();
+        skipWs();
+        if (peek() == ',') { ++p_; continue; }
+        expect(']');
+        return;
+      }
+    }
+
+    void skipValue() {
+      skipWs();
+      switch (peek()) {
+      case '"': string(); break;
+      case '{': forEachKey([this](std::string_view) { skipValue(); }); break;
+      case '[': forEachElement([this]() { skipValue(); }); break;
+      default:
+        while (p_ < s_.size() && s_[p_] != ',' && s_[p_] != '}' && s_[p_] != ']') ++p_;
+      }
+    }
+
+    std::string_view valueText() {
+      skipWs();
+      const size_t start = p_;
+      skipValue();
+      return s_.substr(start, p_ - start);
+    }
+
+  private:
+    std::string_view s_;
+    size_t p_ = 0;
+  };
+
+  // Decodes json string escapes of a raw string body (as returned by JsonCursor::string) into out.
+  inline void appendUnescaped(std::string_view raw, std::string &out) {
+    if (raw.find('\\') == std::string_view::npos) {
+      out.append(raw);
+      return;
+    }
+    auto hex4 = [&](size_t i) {
+      unsigned v = 0;
+      for (size_t k = 0; k < 4; ++k) {
+        char c = i + k < raw.size() ? raw[i + k] : '0';
+        v <<= 4;
+        if ('0' <= c && c <= '9') v |= c - '0';
+        else if ('a' <= c && c <= 'f') v |= c - 'a' + 10;
+        else if ('A' <= c && c <= 'F') v |= c - 'A' + 10;
+      }
+      return v;
+      };
+    auto putUtf8 = [&](unsigned cp) {
+      if (cp < 0x80) {
+        out.push_back(static_cast<char>(cp));
+      } else if (cp < 0x800) {
+        out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+      } else if (cp < 0x10000) {
+        out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+      } else {
+        out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+      }
+      };
+    out.reserve(out.size() + raw.size());
+    for (size_t i = 0; i < raw.size(); ++i) {
+      char c = raw[i];
+      if (c != '\\' || i + 1 == raw.size()) {
+        out.push_back(c);
+        continue;
+      }
+      c = raw[++i];
+      switch (c) {
+      case 'n': out.push_back('\n'); break;
+      case 't': out.push_back('\t'); break;
+      case 'r': out.push_back('\r'); break;
+      case 'b': out.push_back('\b'); break;
+      case 'f': out.push_back('\f'); break;
+      case 'u': {
+        unsigned cp = hex4(i + 1);
+        i += 4;
+        if (0xD800 <= cp && cp < 0xDC00 && i + 6 < raw.size() && raw[i + 1] == '\\' && raw[i + 2] == 'u') {
+          const unsigned lo = hex4(i + 3);
+          if (0xDC00 <= lo && lo < 0xE000) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+            i += 6;
+          }
+        }
+        putUtf8(cp);
+        break;
+      }
+      default: out.push_back(c); break; // '"', '\\', '/'
+      }
+    }
+  }
+
+} // namespace utils
+
+#endif // _JSONSCAN_H_
@@ -0,0 +1,157 @@
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Log-bucketed latency histogram (HDR-style: 4 linear sub-buckets per power of two microseconds,
+// so any recorded value is off by at most 25%). Recording is lock-free: each thread adds to one of
+// a few shards with relaxed atomics, shards are only merged when a snapshot is taken.
+class LatencyHistogram {
+public:
+  static constexpr size_t BUCKETS = 8 + (40 - 3) * 4; // 1us .. ~12 days
+  static constexpr size_t SHARDS = 8;
+
+  struct Snapshot {
+    std::array<uint64_t, BUCKETS> counts{};
+    uint64_t count = 0;
+    double sumMs = 0;
+
+    // q in [0, 1]; interpolated within the bucket. 0 when empty.
+    double percentileMs(double q) const;
+  };
+
+  void record(double ms);
+  void record(std::chrono::steady_clock::duration d) {
+    record(std::chrono::duration<double, std::milli>(d).count());
+  }
+
+  Snapshot snapshot() const;
+
+  static size_t bucketOf(uint64_t micros);
+  // Exclusive upper bound of a bucket, in microseconds.
+  static uint64_t bucketUpperMicros(size_t bucket);
+
+private:
+  struct alignas(64) Shard {
+    std::array<std::atomic<uint64_t>, BUCKETS> counts{};
+    std::atomic<uint64_t> sumMicros{ 0 };
+  };
+  std::array<Shard, SHARDS> shards_;
+};
+
+// Process-wide named histograms: one per HTTP endpoint and one per internal pipeline stage.
+// Returned references stay valid for the life of the process; hot call sites keep them in a static.
+class LatencyRegistry {
+public:
+  enum class Kind { Endpoint, Stage };
+
+  struct Entry {
+    Kind kind;
+    std::string name;
+    const LatencyHistogram *histogram;
+  };
+
+  static LatencyHistogram &endpoint(const std::string &name);
+  static LatencyHistogram &stage(const std::string &name);
+
+  // Sorted by kind, then name.
+  static std::vector<Entry> entries();
+};
+
+// Stage timings of a single request, for Server-Timing headers and the slow request log.
+// A trace is made current on a thread with Scope; TraceSpan and named ScopedLatency timers
+// add to the current trace, if any. Spans with the same name (e.g. one per fetched file)
+// are merged into one entry with a count.
+class RequestTrace {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Span {
+    std::string name;
+    double startMs = 0;    // first occurrence, relative to the trace start
+    double durationMs = 0; // summed over occurrences
+    size_t count = 0;
+  };
+
+  explicit RequestTrace(Clock::time_point start = Clock::now()) : start_(start) {}
+
+  void reset(Clock::time_point start = Clock::now());
+  void add(std::string_view name, Clock::time_point start, Clock::time_point end);
+
+  Clock::time_point start() const { return start_; }
+  double elapsedMs() const;
+  // In order of first occurrence.
+  std::vector<Span> spans() const;
+  // "total;dur=12.3, query_embed;dur=4.5, ..." as used by the Server-Timing header.
+  std::string serverTiming() const;
+
+  static RequestTrace *current();
+  // Returns the previously current trace.
+  static RequestTrace *setCurrent(RequestTrace *trace);
+
+  class Scope {
+  public:
+    explicit Scope(RequestTrace &trace) : prev_(setCurrent(&trace)) {}
+    ~Scope() { setCurrent(prev_); }
+
+  private:
+    RequestTrace *prev_;
+
+    Scope(const Scope &) = delete;
+    Scope &operator =(const Scope &) = delete;
+  };
+
+private:
+  Clock::time_point start_;
+  mutable std::mutex mutex_;
+  std::vector<Span> spans_;
+
+  RequestTrace(const RequestTrace &) = delete;
+  RequestTrace &operator =(const RequestTrace &) = delete;
+};
+
+// Adds the lifetime of the scope to the current request trace.
+class TraceSpan {
+public:
+  explicit TraceSpan(const char *name) : trace_(RequestTrace::current()), name_(name), start_(std::chrono::steady_clock::now()) {}
+  ~TraceSpan() { if (trace_) trace_->add(name_, start_, std::chrono::steady_clock::now()); }
+
+private:
+  RequestTrace *trace_;
+  const char *name_;
+  std::chrono::steady_clock::time_point start_;
+
+  TraceSpan(const TraceSpan &) = delete;
+  TraceSpan &operator =(const TraceSpan &) = delete;
+};
+
+// Records the lifetime of the scope into a histogram and, when named, into the current request trace.
+class ScopedLatency {
+public:
+  explicit ScopedLatency(LatencyHistogram &h, const char *span = nullptr, std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now())
+    : h_(h), span_(span), start_(start) {}
+  ~ScopedLatency() {
+    const auto end = std::chrono::steady_clock::now();
+    h_.record(end - start_);
+    if (span_) {
+      if (auto *trace = RequestTrace::current()) trace->add(span_, start_, end);
+    }
+  }
+
+private:
+  LatencyHistogram &h_;
+  const char *span_;
+  std::chrono::steady_clock::time_point start_;
+
+  ScopedLatency(const ScopedLatency &) = delete;
+  ScopedLatency &operator =(const ScopedLatency &) = delete;
+};
+
+#endif // _LATENCY_H_
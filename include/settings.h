@@ -12,15 +12,18 @@ struct ApiConfig {
   std::string id;
   std::string name;
   std::string apiUrl;
+  std::vector<std::string> replicaUrls; // Additional endpoints serving the same model, load-balanced with apiUrl.
   std::string apiKey;
   std::string model;
   std::string queryFormat;
   std::string documentFormat;
+  std::string encodingFormat; // For OpenAI-style embedding endpoints: "base64" (default) or "float".
   std::string maxTokensName; // e.g. max_tokens or max_completion_tokens
   bool temperatureSupport = true;
   bool enabled = true;
   bool stream = true;
   size_t contextLength = 0;
+  std::string tokenizerPath; // tokenizer.json of the model, for exact token budgets. Empty: the default tokenizer.
   struct {
     float input = 0;
     float output = 0;
@@ -98,6 +101,12 @@ public:
   std::vector<ApiConfig> embeddingApis() const;
   size_t embeddingTimeoutMs() const { return config_["embedding"].value("timeout_ms", size_t(10'000)); }
   size_t embeddingBatchSize() const { return config_["embedding"].value("batch_size", size_t(4)); }
+  size_t embeddingBatchMaxTokens() const { return config_["embedding"].value("batch_max_tokens", size_t(2048)); }
+  size_t embeddingConcurrency() const { return config_["embedding"].value("concurrency", size_t(4)); }
+  size_t embeddingTargetLatencyMs() const { return config_["embedding"].value("target_latency_ms", size_t(0)); }
+  size_t embeddingRetryAttempts() const { return config_["embedding"].value("retry_attempts", size_t(3)); }
+  size_t embeddingQueryBatchWindowMs() const { return config_["embedding"].value("query_batch_window_ms", size_t(3)); }
+  size_t embeddingQueryBatchMax() const { return config_["embedding"].value("query_batch_max", size_t(16)); }
   size_t embeddingTopK() const { return config_["embedding"].value("top_k", size_t(5)); }
   std::string embeddingPrependLabelFormat() const {
     return config_["embedding"].value("prepend_label_format", std::string(""));
@@ -128,6 +137,34 @@ public:
     return config_["generation"].contains("excerpt") ? config_["generation"]["excerpt"].value("threshold_ratio", 0.6f) : 0.6f;
   }
 
+  size_t generationFimDebounceMs() const {
+    return config_["generation"].contains("fim") ? config_["generation"]["fim"].value("debounce_ms", size_t(0)) : size_t(0);
+  }
+  size_t generationFimCacheEntries() const {
+    return config_["generation"].contains("fim") ? config_["generation"]["fim"].value("cache_entries", size_t(256)) : size_t(256);
+  }
+  size_t generationFimRetrievalBudgetMs() const {
+    return config_["generation"].contains("fim") ? config_["generation"]["fim"].value("retrieval_budget_ms", size_t(30)) : size_t(30);
+  }
+
+  size_t httpMaxIdlePerHost() const {
+    return config_.contains("http_client") ? config_["http_client"].value("max_idle_per_host", size_t(4)) : size_t(4);
+  }
+  size_t httpServerWorkers() const {
+    return config_.contains("http_server") ? config_["http_server"].value("workers", size_t(8)) : size_t(8);
+  }
+  size_t httpServerQueueDepth() const {
+    return config_.contains("http_server") ? config_["http_server"].value("queue_depth", size_t(64)) : size_t(64);
+  }
+  size_t httpServerRetryAfterS() const {
+    return config_.contains("http_server") ? config_["http_server"].value("retry_after_s", size_t(1)) : size_t(1);
+  }
+  // Max concurrent requests of a route lane (fim, search, chat, admin); 0 means unlimited.
+  size_t httpServerLaneLimit(const std::string &lane, size_t def) const {
+    if (!config_.contains("http_server") || !config_["http_server"].contains("lanes")) return def;
+    return config_["http_server"]["lanes"].value(lane, def);
+  }
+
   std::string databaseSqlitePath() const { return config_["database"].value("sqlite_path", "db.sqlite"); }
   std::string databaseIndexPath() const { return config_["database"].value("index_path", "index"); }
   size_t databaseVectorDim() const { return config_["database"].value("vector_dim", size_t(768)); }
@@ -151,6 +188,13 @@ public:
   bool loggingLogToConsole() const {
     return config_.contains("logging") ? config_["logging"].value("log_to_console", true) : true;
   }
+  // Requests slower than this are appended to the slow request log; 0 disables it.
+  size_t loggingSlowRequestMs() const {
+    return config_.contains("logging") ? config_["logging"].value("slow_request_ms", size_t(10'000)) : size_t(10'000);
+  }
+  std::string loggingSlowRequestFile() const {
+    return config_.contains("logging") ? config_["logging"].value("slow_request_file", "slow_requests.jsonl") : std::string("slow_requests.jsonl");
+  }
 
   void initProjectIdIfMissing(bool hydrateFile);
   void initProjectTitleIfMissing(bool hydrateFile);
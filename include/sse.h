@@ -0,0 +1,46 @@
+#ifndef _SSE_H_
+#define _SSE_H_
+
+#include <string>
+#include <string_view>
+#include <functional>
+
+// Incremental server-sent events framer. Bytes are appended to a buffer whose consumed
+// head is reclaimed lazily (ring-style), and each byte is scanned once. Event payloads
+// are handed out as string_views into the buffer, valid only during the callback.
+class SseParser {
+public:
+  // Receives the data of each complete event. Return false to stop parsing.
+  using EventHandler = std::function<bool(std::string_view data)>;
+
+  explicit SseParser(size_t initialCapacity = 4096);
+
+  // Returns false once parsing stopped, either by the handler or at "data: [DONE]".
+  bool feed(const char *data, size_t len, const EventHandler &onEvent);
+
+  bool done() const { return done_; }
+
+  // Bytes not yet framed into an event, e.g. a plain (non-SSE) error body.
+  std::string_view pending() const;
+
+  // Fast path for OpenAI-style stream chunks: appends choices[0].delta.content (or
+  // reasoning_content when content is null, or choices[0].text) to out without building a DOM.
+  // Returns false when the payload isn't shaped like a chunk; out is left untouched then.
+  static bool extractDeltaContent(std::string_view payload, std::string &out);
+
+private:
+  std::string buf_;
+  size_t eventStart_ = 0; // first byte of the event being assembled
+  size_t lineStart_ = 0;  // first byte of the current line
+  size_t end_ = 0;        // end of valid data
+  size_t dataStart_ = 0;  // single data line of the current event
+  size_t dataLen_ = 0;
+  bool hasData_ = false;
+  bool multiData_ = false;
+  std::string multi_;     // joined data lines, only used for multi-line events
+  bool done_ = false;
+
+  void append(const char *data, size_t len);
+};
+
+#endif // _SSE_H_
@@ -0,0 +1,47 @@
+#ifndef _TOKENCACHE_H_
+#define _TOKENCACHE_H_
+
+#include <memory>
+#include <string_view>
+
+// Bounded map from text to its token count, shared by all threads. Entries are spread over
+// mutex-guarded shards, each evicting with CLOCK (second chance) once full. In front of the
+// shards every thread keeps a small direct-mapped cache of short keys, so repeated words are
+// answered without taking a lock. Counts never change for a key, so the fronts can't go stale.
+class TokenCountCache {
+public:
+  struct Stats {
+    size_t entries = 0;
+    size_t capacity = 0;
+    size_t hits = 0; // front hits are added in batches, so recent ones may not show yet
+    size_t misses = 0;
+    size_t evictions = 0;
+  };
+
+  // A capacity of 0 disables the cache.
+  explicit TokenCountCache(size_t capacity);
+  ~TokenCountCache();
+
+  bool find(std::string_view key, size_t &count);
+  void insert(std::string_view key, size_t count);
+
+  template <typename F>
+  size_t get(std::string_view key, F &&compute) {
+    size_t count = 0;
+    if (find(key, count)) return count;
+    count = compute(key);
+    insert(key, count);
+    return count;
+  }
+
+  Stats stats() const;
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> imp;
+
+  TokenCountCache(const TokenCountCache &) = delete;
+  TokenCountCache &operator =(const TokenCountCache &) = delete;
+};
+
+#endif // _TOKENCACHE_H_
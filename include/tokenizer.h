@@ -1,23 +1,54 @@
 #ifndef _TOKENIZER_H_
 #define _TOKENIZER_H_
 
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
-#include <unordered_map>
-#include <mutex>
-#include "json_shim.h"
+#include "tokencache.h"
+#include "wordpiece.h"
+
+class BpeModel;
 
+// Counts tokens the way the tokenizer.json at configPath would: WordPiece (the embedding
+// models) or BPE (most generation models). Without one, counts are estimated.
 class SimpleTokenizer {
-  mutable std::mutex mutex_;
-  mutable std::unordered_map<std::string, size_t> cache_;
+  mutable TokenCountCache cache_; // word -> pieces
 private:
-  nlohmann::json vocab_;
+  WordPieceVocab vocab_;
+  std::unique_ptr<const BpeModel> bpe_;
   size_t maxInputCharsPerWord_ = 100;
-  size_t simulateWordpiece(const std::string &word, bool addSpecialTokens) const;
+  size_t simulateWordpiece(std::string_view word, bool addSpecialTokens) const;
+  size_t pieceTokens(std::string_view piece, bool addSpecialTokens, bool first) const;
 public:
   explicit SimpleTokenizer(const std::string &configPath);
+  ~SimpleTokenizer();
+  bool loaded() const { return !vocab_.empty() || bpe_; }
   size_t estimateTokenCount(std::string_view text, bool addSpecialTokens = false) const;
   size_t countTokensWithVocab(std::string_view text, bool addSpecialTokens = false) const;
+  // Length in bytes of the longest prefix of text that counts at most maxTokens, cut at a
+  // token boundary; its count goes to *tokens. One pass that stops at the cut.
+  size_t prefixWithinTokens(std::string_view text, size_t maxTokens, size_t *tokens = nullptr) const;
+  const WordPieceVocab &vocab() const { return vocab_; }
+  TokenCountCache::Stats cacheStats() const { return cache_.stats(); }
+};
+
+// Tokenizers of the models requests are sent to, loaded on first use and kept for the
+// lifetime of the process. Paths that don't load resolve to the fallback.
+class TokenizerRegistry {
+public:
+  explicit TokenizerRegistry(const SimpleTokenizer &fallback) : fallback_(fallback) {}
+
+  const SimpleTokenizer &get(const std::string &configPath);
+
+private:
+  const SimpleTokenizer &fallback_;
+  std::mutex mutex_;
+  std::map<std::string, std::unique_ptr<SimpleTokenizer>> tokenizers_; // nullptr: failed to load
+
+  TokenizerRegistry(const TokenizerRegistry &) = delete;
+  TokenizerRegistry &operator =(const TokenizerRegistry &) = delete;
 };
 
 #endif // _TOKENIZER_H_
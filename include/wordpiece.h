@@ -0,0 +1,60 @@
+#ifndef _WORDPIECE_H_
+#define _WORDPIECE_H_
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Compiled WordPiece vocabulary. Entries are kept in two byte tries laid out in flat arrays:
+// one for pieces that start a word and one for "##" continuation pieces (stored without the
+// "##"). Greedy longest-match then runs in one forward pass over the word, without allocating.
+//
+// The arrays live in one position-independent blob, which is also the on-disk format: save()
+// writes it and map() memory-maps it back, so a cached vocab loads without parsing and its
+// pages are shared by all processes using it. Copies share the blob.
+class WordPieceVocab {
+public:
+  WordPieceVocab() = default;
+  explicit WordPieceVocab(const std::vector<std::string> &tokens);
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  // Length in bytes of the longest entry that s starts with, 0 if there is none.
+  size_t longestMatch(std::string_view s, bool continuation) const;
+
+  // Number of pieces greedy longest-match splits word into. Bytes that start no entry
+  // count as a piece each, like the reference implementation.
+  size_t countPieces(std::string_view word) const;
+
+  // sourceHash identifies what the vocab was compiled from; map() only accepts a file
+  // written with the same hash (and format version) whose indexes all stay in bounds,
+  // anything else returns nullopt.
+  bool save(const std::string &path, uint64_t sourceHash) const;
+  static std::optional<WordPieceVocab> map(const std::string &path, uint64_t sourceHash);
+
+private:
+  struct Node {
+    uint32_t firstEdge;
+    uint16_t edgeCount;
+    uint16_t terminal;
+  };
+
+  std::shared_ptr<const char> blob_;
+  size_t blobSize_ = 0;
+  // Views into blob_. Children of a node are contiguous and sorted by label.
+  // Root fan-out is wide, so the first byte is a direct lookup in rootChild_; 0 means no child.
+  const uint32_t *rootChild_ = nullptr; // [2][256]
+  const Node *nodes_ = nullptr;
+  const uint32_t *children_ = nullptr;
+  const uint8_t *labels_ = nullptr;
+  size_t size_ = 0;
+
+  bool attach(std::shared_ptr<const char> blob, size_t blobSize, uint64_t sourceHash);
+  uint32_t child(uint32_t node, uint8_t label) const;
+};
+
+#endif // _WORDPIECE_H_
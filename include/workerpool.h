@@ -0,0 +1,69 @@
+#ifndef _WORKERPOOL_H_
+#define _WORKERPOOL_H_
+
+#include <functional>
+#include <memory>
+
+// Fixed-size pool of worker threads serving a task queue. A task that is about to block for a long
+// time (e.g. relaying a streamed generation) can detach its thread from the pool: a replacement
+// worker is started so the blocked task no longer counts against the pool size. The detached thread
+// rejoins the pool when reattached (surplus workers then exit), or exits when its task ends. At most
+// maxDetached threads are detached at once, so the pool never runs more than workers + maxDetached
+// threads.
+class WorkerPool {
+public:
+  struct Stats {
+    size_t workers = 0;
+    size_t busy = 0;
+    size_t detached = 0;
+    size_t threads = 0;         // live threads, detached ones included
+    size_t queued = 0;
+    size_t rejected = 0;
+    size_t started = 0;         // tasks taken off the queue
+    double totalWaitMs = 0;     // time those tasks spent queued
+  };
+
+  // maxQueued = 0 means an unbounded queue; maxDetached = 0 allows as many as there are workers.
+  explicit WorkerPool(size_t workers, size_t maxQueued = 0, size_t maxDetached = 0);
+  ~WorkerPool();
+
+  // Returns false when the queue is full or the pool is shutting down.
+  bool enqueue(std::function<void()> task);
+
+  // Stops taking tasks, runs the queued ones and waits for all threads, detached ones included.
+  void shutdown();
+
+  Stats stats() const;
+
+  // No-op returning false unless called from a task of some WorkerPool that has not reached
+  // maxDetached; the task then keeps its worker slot.
+  static bool detachCurrent();
+
+  // Returns the calling thread to its pool. No-op unless detachCurrent() succeeded for it.
+  static void reattachCurrent();
+
+  // Keeps the calling thread detached for the lifetime of the scope.
+  class DetachScope {
+  public:
+    DetachScope() : detached_(detachCurrent()) {}
+    ~DetachScope() { if (detached_) reattachCurrent(); }
+
+    // False when the thread could not be detached and keeps its worker slot.
+    explicit operator bool() const { return detached_; }
+
+  private:
+    bool detached_;
+
+    DetachScope(const DetachScope &) = delete;
+    DetachScope &operator =(const DetachScope &) = delete;
+  };
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> imp;
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator =(const WorkerPool &) = delete;
+};
+
+#endif // _WORKERPOOL_H_
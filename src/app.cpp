@@ -2,6 +2,8 @@
 #include "settings.h"
 #include "database.h"
 #include "inference.h"
+#include "dispatcher.h"
+#include "httppool.h"
 #include "chunker.h"
 #include "tokenizer.h"
 #include "sourceproc.h"
@@ -9,6 +11,7 @@
 #include "auth.h"
 #include "instregistry.h"
 #include "cutils.h"
+#include "latency.h"
 #include <iostream>
 #include <fstream>
 #include <algorithm>
@@ -45,6 +48,8 @@
 using json = nlohmann::json;
 namespace fs = std::filesystem;
 
+extern void runBenchmarks(const App &app, const std::vector<SourceProcessor::Data> &sources, size_t iterations);
+
 namespace {
 
   std::string stripUrlQueryAndAnchor(const std::string &url) {
@@ -57,35 +62,41 @@ namespace {
     return url.substr(0, pos);
   }
 
-  size_t addEmbedChunks(const std::vector<Chunk> &chunks, size_t batchSize, const EmbeddingClient &ec, VectorDatabase &db, std::string_view prependlabelFmt) {
+  // Token count of a whole indexed file, stored with its chunks.
+  size_t fileTokens(const SimpleTokenizer &tok, const std::string &content) {
+    static auto &latency = LatencyRegistry::stage("tokenize");
+    ScopedLatency timer(latency, "tokenize");
+    return tok.countTokensWithVocab(content);
+  }
+
+  // Computes embeddings for all chunks without touching the database, so that no write
+  // transaction is held across the network calls. Results are applied with replaceDocuments.
+  size_t embedChunks(const std::vector<Chunk> &chunks, const EmbeddingDispatcher &embedder, std::string_view prependlabelFmt, std::vector<std::vector<float>> &embeddings) {
     size_t totalTokens = 0;
-    size_t iBatch = 1;
-    const size_t nofBatches = static_cast<size_t>(std::ceil(chunks.size() / double(batchSize)));
-    for (size_t i = 0; i < chunks.size(); i += batchSize) {
-      size_t end = (std::min)(i + batchSize, chunks.size());
-      std::vector<Chunk> batch(chunks.begin() + i, chunks.begin() + end);
-      std::vector<std::vector<float>> embeddings;
-      std::vector<std::string> texts;
-      for (const auto &chunk : batch) {
-        auto text = chunk.text;
-        if (!prependlabelFmt.empty()) {
-          std::string info;
-          try {
-            info = std::filesystem::path(chunk.docUri).filename().string();
-          } catch (...) {
-            info = chunk.docUri;
-          }
-          auto label = fmt::vformat(prependlabelFmt, fmt::make_format_args(info));
-          text = label + "\n\n" + text;
+    std::vector<std::string> texts;
+    std::vector<size_t> tokenCounts;
+    texts.reserve(chunks.size());
+    tokenCounts.reserve(chunks.size());
+    for (const auto &chunk : chunks) {
+      auto text = chunk.text;
+      if (!prependlabelFmt.empty()) {
+        std::string info;
+        try {
+          info = std::filesystem::path(chunk.docUri).filename().string();
+        } catch (...) {
+          info = chunk.docUri;
         }
-        texts.push_back(std::move(text));
-        totalTokens += chunk.metadata.tokenCount;
+        auto label = fmt::vformat(prependlabelFmt, fmt::make_format_args(info));
+        text = label + "\n\n" + text;
       }
-      std::cout << "GENERATING embeddings for batch " << iBatch++ << "/" << nofBatches << "\r" << std::flush;
-      ec.generateEmbeddings(texts, embeddings, EmbeddingClient::EncodeType::Document);
-      db.addDocuments(batch, embeddings);
-      std::cout << "  Processed all chunks.                     \r" << std::flush;
+      texts.push_back(std::move(text));
+      tokenCounts.push_back(chunk.metadata.tokenCount);
+      totalTokens += chunk.metadata.tokenCount;
     }
+    embedder.embed(texts, tokenCounts, embeddings, EmbeddingClient::EncodeType::Document, [](size_t done, size_t total) {
+      std::cout << "GENERATING embeddings " << done << "/" << total << " chunks\r" << std::flush;
+      });
+    std::cout << "  Processed all chunks.                     \r" << std::flush;
     return totalTokens;
   }
 
@@ -94,13 +105,12 @@ namespace {
   private:
     App &app_;
     VectorDatabase *db_;
-    size_t batchSize_;
     // Failure tracking
     std::unordered_map<std::string, int> failureCounts_;
     std::unordered_set<std::string> ignoredFiles_;
 
   public:
-    IncrementalUpdater(App *app, size_t batchSize) : app_(*app), db_(&app->db()), batchSize_(batchSize) {
+    IncrementalUpdater(App *app) : app_(*app), db_(&app->db()) {
     }
 
     ~IncrementalUpdater() {
@@ -154,7 +164,7 @@ namespace {
     }
 
     // Update database incrementally
-    size_t updateDatabase(EmbeddingClient &client, Chunker &chunker, const UpdateInfo &info) {
+    size_t updateDatabase(const EmbeddingDispatcher &embedder, Chunker &chunker, const UpdateInfo &info) {
       size_t totalUpdated = 0;
       if (!info.deletedFiles.empty()) {
         try {
@@ -173,57 +183,43 @@ namespace {
         }
       }
 
-      // Handle modifications (delete old, insert new)
+      // Handle modifications and new files. Embeddings are computed first, then old chunks
+      // are swapped for the new ones in one short write, so searches keep seeing the old ones meanwhile.
+      auto reindex = [&](const std::string &filepath, const char *what) {
+        std::string content;
+        SourceProcessor::readFile(filepath, content);
+        if (content.empty()) {
+          LOG_MSG << "  Empty file" << filepath << ".Skipped.";
+          return;
+        }
+        auto chunks = chunker.chunkText(content, filepath);
+        std::vector<std::vector<float>> embeddings;
+        embedChunks(chunks, embedder, app_.settings().embeddingPrependLabelFormat(), embeddings);
+        db_->replaceDocuments(filepath, chunks, embeddings, fileTokens(app_.tokenizer(), content));
+        totalUpdated++;
+        clearFailure(filepath);
+        LOG_MSG << " " << what << "with" << chunks.size() << " chunks";
+        db_->persist();
+        };
+
       for (const auto &filepath : info.modifiedFiles) {
         if (shouldIgnore(filepath)) continue; // Skip ignored files (shouldn't happen due to detectChanges, but safety check)
         LOG_MSG << "Updating:" << filepath;
         try {
-          db_->beginTransaction();
-          db_->deleteDocumentsBySource(filepath);
-          std::string content;
-          SourceProcessor::readFile(filepath, content);
-          if (content.empty()) {
-            LOG_MSG << "  Empty file" << filepath << ".Skipped.";
-            db_->rollback();
-            continue;
-          }
-          auto chunks = chunker.chunkText(content, filepath);
-          addEmbedChunks(chunks, batchSize_, client, *db_, app_.settings().embeddingPrependLabelFormat());
-          totalUpdated++;
-          clearFailure(filepath);
-          LOG_MSG << "  Updated with" << chunks.size() << " chunks";
-          db_->commit();
-          db_->persist();
+          reindex(filepath, "Updated");
         } catch (const std::exception &e) {
-          db_->rollback();
           LOG_MSG << "  Error:" << e.what();
           recordFailure(filepath);
         }
       }
 
-      // Handle new files
       for (const auto &filepath : info.newFiles) {
         if (shouldIgnore(filepath)) continue;
         LOG_MSG << "Adding new file:" << filepath;
         try {
-          db_->beginTransaction();
-          std::string content;
-          SourceProcessor::readFile(filepath, content);
-          if (content.empty()) {
-            LOG_MSG << "  Empty file" << filepath << ".Skipped.";
-            db_->rollback();
-            continue;
-          }
-          auto chunks = chunker.chunkText(content, filepath);
-          addEmbedChunks(chunks, batchSize_, client, *db_, app_.settings().embeddingPrependLabelFormat());
-          totalUpdated++;
-          clearFailure(filepath);
-          LOG_MSG << "  Added with" << chunks.size() << " chunks";
-          db_->commit();
-          db_->persist();
+          reindex(filepath, "Added");
         } catch (const std::exception &e) {
           LOG_MSG << "  Error:" << e.what();
-          db_->rollback();
           recordFailure(filepath);
         }
       }
@@ -408,9 +404,12 @@ struct App::Impl {
   std::unique_ptr<AdminAuth> auth_;
   std::unique_ptr<VectorDatabase> db_;
   std::unique_ptr<SimpleTokenizer> tokenizer_;
+  std::unique_ptr<TokenizerRegistry> tokenizers_;
   std::unique_ptr<Chunker> chunker_;
   std::unique_ptr<SourceProcessor> processor_;
   std::unique_ptr<IncrementalUpdater> updater_;
+  std::unique_ptr<HttpClientPool> httpPool_;
+  std::unique_ptr<EmbeddingDispatcher> embedder_;
   std::unique_ptr<HttpServer> httpServer_;
 
   std::chrono::system_clock::time_point appStartTime_;
@@ -444,6 +443,8 @@ void App::initialize(/*const std::string &configPath*/)
 
   auto &ss = *imp->settings_;
 
+  imp->httpPool_ = std::make_unique<HttpClientPool>(ss.httpMaxIdlePerHost());
+
   std::string dbPath = ss.databaseSqlitePath();
   std::string indexPath = ss.databaseIndexPath();
   size_t vectorDim = ss.databaseVectorDim();
@@ -453,6 +454,7 @@ void App::initialize(/*const std::string &configPath*/)
   imp->db_ = std::make_unique<HnswSqliteVectorDatabase>(dbPath, indexPath, vectorDim, maxElements, metric);
 
   imp->tokenizer_ = std::make_unique<SimpleTokenizer>(ss.tokenizerConfigPath());
+  imp->tokenizers_ = std::make_unique<TokenizerRegistry>(*imp->tokenizer_);
 
   size_t minTokens = ss.chunkingMinTokens();
   size_t maxTokens = ss.chunkingMaxTokens();
@@ -460,7 +462,8 @@ void App::initialize(/*const std::string &configPath*/)
 
   imp->chunker_ = std::make_unique<Chunker>(*imp->tokenizer_, minTokens, maxTokens, overlap);
   imp->processor_ = std::make_unique<SourceProcessor>(*imp->settings_);
-  imp->updater_ = std::make_unique<IncrementalUpdater>(this, imp->settings_->embeddingBatchSize());
+  imp->updater_ = std::make_unique<IncrementalUpdater>(this);
+  imp->embedder_ = std::make_unique<EmbeddingDispatcher>(ss, *imp->httpPool_);
 
   imp->httpServer_ = std::make_unique<HttpServer>(*this);
 }
@@ -480,7 +483,7 @@ bool App::testSettings() const
       std::string textB0 = "double main() { return 0.0; }";
       std::string textB1 = "float main() { reutrn 0.f; }";
       std::string textC0 = "class Foo { void bar() { std::cout << \"hello\"; } };";
-      EmbeddingClient cl{ api, settings().embeddingTimeoutMs() };
+      EmbeddingClient cl{ api, settings().embeddingTimeoutMs(), *imp->httpPool_ };
       std::vector<float> vA0;
       cl.generateEmbeddings(textA0, vA0, EmbeddingClient::EncodeType::Query);
       if (vA0.size() == 0) {
@@ -608,7 +611,6 @@ void App::embed(bool noPrompt)
   size_t totalFiles = 0;
   size_t totalTokens = 0;
   size_t skippedFiles = 0;
-  EmbeddingClient embeddingClient{ settings().embeddingCurrentApi(), settings().embeddingTimeoutMs() };
   for (size_t i = 0; i < sources.size(); ++i) {
     const auto &source = sources[i].source;
     try {
@@ -623,7 +625,6 @@ void App::embed(bool noPrompt)
         continue;
       }
 
-      imp->db_->beginTransaction();
       LOG_MSG << "PROCESSING" << source << fmt::format("({}/{})", i + 1, sources.size());
 
       std::string content{ sources[i].content };
@@ -633,7 +634,6 @@ void App::embed(bool noPrompt)
         SourceProcessor::readFile(source, content);
         if (content.empty()) {
           LOG_MSG << "  Empty file. Skipped.";
-          imp->db_->rollback();
           skippedFiles++;
           continue;
         }
@@ -644,15 +644,14 @@ void App::embed(bool noPrompt)
       auto chunks = imp->chunker_->chunkText(content, sourceId);
 
       LOG_MSG << "  Generated" << chunks.size() << "chunks";
-      const size_t batchSize = imp->settings_->embeddingBatchSize();
-      totalTokens += addEmbedChunks(chunks, batchSize, embeddingClient, *imp->db_, settings().embeddingPrependLabelFormat());
+      std::vector<std::vector<float>> embeddings;
+      totalTokens += embedChunks(chunks, *imp->embedder_, settings().embeddingPrependLabelFormat(), embeddings);
       std::cout << std::endl;
+      imp->db_->replaceDocuments(sourceId, chunks, embeddings, fileTokens(*imp->tokenizer_, content));
       totalChunks += chunks.size();
       totalFiles++;
-      imp->db_->commit();
       imp->db_->persist();
     } catch (const std::exception &e) {
-      imp->db_->rollback();
       skippedFiles++;
       LOG_MSG << "Error processing" << source << ": " << e.what();
     }
@@ -677,9 +676,8 @@ void App::search(const std::string &query, size_t topK)
 {
   std::cout << "Searching for: " << query << std::endl;
 
-  EmbeddingClient embeddingClient{ settings().embeddingCurrentApi(), settings().embeddingTimeoutMs() };
   std::vector<float> queryEmbedding;
-  embeddingClient.generateEmbeddings(query, queryEmbedding, EmbeddingClient::EncodeType::Query);
+  imp->embedder_->embed(query, queryEmbedding, EmbeddingClient::EncodeType::Query);
   auto results = imp->db_->search(queryEmbedding, topK);
 
   std::cout << "\nFound " << results.size() << " results:" << std::endl;
@@ -729,7 +727,6 @@ void App::chat()
   std::cout << "Entering chat mode. Type 'exit' to quit." << std::endl;
   std::vector<json> messages;
   messages.push_back({ {"role", "system"}, {"content", "You are a helpful assistant."} });
-  EmbeddingClient embeddingClient{ settings().embeddingCurrentApi(), settings().embeddingTimeoutMs() };
   CompletionClient completionClient{ apiCfg, settings().generationTimeoutMs(), *this };
 
   while (true) {
@@ -741,7 +738,7 @@ void App::chat()
       messages.push_back({ {"role", "user"}, {"content", userInput} });
       // Generate embedding for the user input
       std::vector<float> queryEmbedding;
-      embeddingClient.generateEmbeddings(userInput, queryEmbedding, EmbeddingClient::EncodeType::Query);
+      imp->embedder_->embed(userInput, queryEmbedding, EmbeddingClient::EncodeType::Query);
       auto searchResults = imp->db_->search(queryEmbedding, 5);
       std::cout << "\nAssistant: " << std::flush;
       std::string assistantResponse = completionClient.generateCompletion(
@@ -860,6 +857,11 @@ void App::serve(int suggestedPort, bool watch, int interval, const std::string &
   }
 }
 
+void App::bench(size_t iterations)
+{
+  runBenchmarks(*this, imp->processor_->collectSources(true), iterations);
+}
+
 void App::providers(const std::string &testProvider)
 {
   auto vc = settings().generationApis();
@@ -949,8 +951,7 @@ size_t App::update()
     return 0;
   }
   LOG_MSG << "Applying updates...";
-  EmbeddingClient embeddingClient{ settings().embeddingCurrentApi(), settings().embeddingTimeoutMs() };
-  size_t updated = imp->updater_->updateDatabase(embeddingClient, *imp->chunker_, info);
+  size_t updated = imp->updater_->updateDatabase(*imp->embedder_, *imp->chunker_, info);
   LOG_MSG << "Update completed! " << updated << " file(s) processed.";
 
   imp->lastUpdateTime_ = std::chrono::system_clock::now();
@@ -989,6 +990,11 @@ const SimpleTokenizer &App::tokenizer() const
   return *imp->tokenizer_;
 }
 
+const SimpleTokenizer &App::tokenizer(const ApiConfig &api) const
+{
+  return imp->tokenizers_->get(api.tokenizerPath);
+}
+
 const SourceProcessor &App::sourceProcessor() const
 {
   return *imp->processor_;
@@ -1009,6 +1015,16 @@ VectorDatabase &App::db()
   return *imp->db_;
 }
 
+const EmbeddingDispatcher &App::embedder() const
+{
+  return *imp->embedder_;
+}
+
+HttpClientPool &App::httpPool() const
+{
+  return *imp->httpPool_;
+}
+
 const AdminAuth &App::auth() const
 {
   return *imp->auth_;
@@ -1461,6 +1477,10 @@ int App::run(int argc, char *argv[])
   std::string testProvider;
   cmdProviders->add_option("--test", testProvider, "Test call to a given provider");
 
+  auto cmdBench = app.add_subcommand("bench", "Benchmark hot paths on the configured sources");
+  size_t benchIterations = 5;
+  cmdBench->add_option("--iterations", benchIterations, "Runs per measurement, the best is reported")->default_val(5);
+
   try {
     app.parse(argc, argv);
 
@@ -1522,7 +1542,7 @@ int App::run(int argc, char *argv[])
     appInstance.imp->privateAppKey_ = std::move(privateAppKey);
     appInstance.initialize();
 
-    if (!noStartupTests) {
+    if (!noStartupTests && !cmdBench->parsed()) {
       if (!appInstance.testSettings()) {
         LOG_MSG << "Wrong/incomplete settings. Exiting.";
         return 1;
@@ -1548,6 +1568,8 @@ int App::run(int argc, char *argv[])
       appInstance.chat();
     } else if (cmdProviders->parsed()) {
       appInstance.providers(testProvider);
+    } else if (cmdBench->parsed()) {
+      appInstance.bench(benchIterations);
     } else if (cmdServe->parsed()) {
       if (!serveNoConfirm && appInstance.auth().isDefaultPassword()) {
         std::cout << "\n  WARNING: You are using the default admin password!\n";
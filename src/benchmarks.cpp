@@ -0,0 +1,630 @@
+#include "app.h"
+#include "chunker.h"
+#include "cutils.h"
+#include "sourceproc.h"
+#include "tokencache.h"
+#include "tokenizer.h"
+#include "wordpiece.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Micro benchmarks of hot paths against the implementations they replaced, run over the
+// configured sources: `bench [--iterations N]`. Each line reports the best of N runs.
+
+namespace {
+
+  // Reference implementations as they were before being replaced (plus bounds checks).
+  namespace legacy {
+
+    bool isPunctuation(char c) {
+      return (c >= 33 && c <= 47) || (c >= 58 && c <= 64) || (c >= 91 && c <= 96) || (c >= 123 && c <= 126);
+    }
+
+    bool isChineseChar(uint32_t c) {
+      return (c >= 0x4E00 && c <= 0x9FFF) || (c >= 0x3400 && c <= 0x4DBF) || (c >= 0xF900 && c <= 0xFAFF);
+    }
+
+    std::vector<uint32_t> utf8ToUtf32(std::string_view str) {
+      std::vector<uint32_t> result;
+      for (size_t i = 0; i < str.size();) {
+        uint32_t codepoint = 0;
+        unsigned char c = str[i];
+        if (c < 0x80) {
+          codepoint = c;
+          i += 1;
+        } else if ((c >> 5) == 0x06 && i + 1 < str.size()) {
+          codepoint = ((c & 0x1F) << 6) | (str[i + 1] & 0x3F);
+          i += 2;
+        } else if ((c >> 4) == 0x0E && i + 2 < str.size()) {
+          codepoint = ((c & 0x0F) << 12) | ((str[i + 1] & 0x3F) << 6) | (str[i + 2] & 0x3F);
+          i += 3;
+        } else if ((c >> 3) == 0x1E && i + 3 < str.size()) {
+          codepoint = ((c & 0x07) << 18) | ((str[i + 1] & 0x3F) << 12) | ((str[i + 2] & 0x3F) << 6) | (str[i + 3] & 0x3F);
+          i += 4;
+        } else {
+          i += 1; // Skip invalid byte
+        }
+        if (codepoint != 0)
+          result.push_back(codepoint);
+      }
+      return result;
+    }
+
+    std::string uint32ToUtf8(uint32_t c) {
+      std::string res;
+      if (c < 0x80) {
+        res += static_cast<char>(c);
+      } else if (c < 0x800) {
+        res += static_cast<char>(0xC0 | (c >> 6));
+        res += static_cast<char>(0x80 | (c & 0x3F));
+      } else if (c < 0x10000) {
+        res += static_cast<char>(0xE0 | (c >> 12));
+        res += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        res += static_cast<char>(0x80 | (c & 0x3F));
+      } else {
+        res += static_cast<char>(0xF0 | (c >> 18));
+        res += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+        res += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        res += static_cast<char>(0x80 | (c & 0x3F));
+      }
+      return res;
+    }
+
+    std::string padChineseChars(std::string_view text) {
+      auto utf32Chars = utf8ToUtf32(text);
+      std::string result;
+      for (auto c : utf32Chars) {
+        if (isChineseChar(c)) {
+          result += " " + uint32ToUtf8(c) + " ";
+        } else {
+          result += uint32ToUtf8(c);
+        }
+      }
+      return result;
+    }
+
+    std::vector<std::string> splitSimple(const std::string &input) {
+      std::istringstream stream(input);
+      std::vector<std::string> words;
+      words.reserve(input.size() / 3);
+      std::string word;
+      while (stream >> word) {
+        words.push_back(word);
+      }
+      return words;
+    }
+
+    void splitOnPunctSimple(const std::string &text, std::vector<std::string> &result) {
+      result.reserve(text.length() / 3);
+      std::string current;
+      for (char c : text) {
+        if (isPunctuation(c)) {
+          if (!current.empty()) {
+            result.push_back(current);
+            current.clear();
+          }
+          result.emplace_back(1, c);
+        } else {
+          current += c;
+        }
+      }
+      if (!current.empty()) {
+        result.emplace_back(current);
+      }
+    }
+
+    void forEachPiece(std::string_view text, const std::function<void(const std::string &)> &onPiece) {
+      std::string padded = padChineseChars(text);
+      std::vector<std::string> words = splitSimple(padded);
+      for (const auto &word : words) {
+        std::vector<std::string> punctSplit;
+        splitOnPunctSimple(word, punctSplit);
+        for (const auto &token : punctSplit) {
+          if (!token.empty()) onPiece(token);
+        }
+      }
+    }
+
+    size_t estimateTokenCount(std::string_view text) {
+      size_t totalTokens = 0;
+      forEachPiece(text, [&totalTokens](const std::string &token) {
+        totalTokens += token.length() <= 4 ? 1 : token.length() <= 8 ? 2 : (token.length() + 3) / 4;
+        });
+      return totalTokens;
+    }
+
+    size_t countTokensWithVocab(const WordPieceVocab &vocab, std::string_view text) {
+      size_t totalTokens = 0;
+      forEachPiece(text, [&](const std::string &token) {
+        if (token.length() <= 100) totalTokens += vocab.countPieces(token);
+        });
+      return totalTokens;
+    }
+
+    // Truncation by chunking the whole text into small chunks and keeping those that fit.
+    size_t truncateToTokens(const SimpleTokenizer &t, const std::string &s, size_t maxTokens) {
+      if (t.countTokensWithVocab(s) <= maxTokens) return s.size();
+      Chunker chunker(t, 1, 50, 0.f);
+      size_t end = 0;
+      size_t tokensSoFar = 0;
+      for (const auto &chunk : chunker.chunkText(s, {}, false)) {
+        if (maxTokens < chunk.metadata.tokenCount + tokensSoFar) {
+          end = chunk.metadata.end;
+          break;
+        }
+        tokensSoFar += chunk.metadata.tokenCount;
+      }
+      return end;
+    }
+
+    // Unbounded word cache behind one mutex.
+    class WordCache {
+      std::mutex mutex_;
+      std::unordered_map<std::string, size_t> cache_;
+    public:
+      template <typename F>
+      size_t get(const std::string &word, F &&compute) {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          if (auto it = cache_.find(word); it != cache_.end()) return it->second;
+        }
+        const size_t count = compute(word);
+        std::lock_guard<std::mutex> lock(mutex_);
+        cache_.emplace(word, count);
+        return count;
+      }
+    };
+
+    // Content classification with a std::regex search per pattern and line. The extension
+    // and binary checks in front of it are unchanged and left out.
+    Chunker::ContentType detectContentType(std::string_view text) {
+      static const std::vector<std::regex> patterns = {
+        std::regex(R"(\b(class|struct|interface|enum|trait)\s+\w+)", std::regex_constants::optimize),
+        std::regex(R"(\b(def|function|func|fn|lambda|const\s+\w+\s*=\s*\([^)]*\)\s*=>)\s*)", std::regex_constants::optimize),
+        std::regex(R"(\b(public|private|protected|static|final|virtual|override|async|await)\b)", std::regex_constants::optimize),
+        std::regex(R"(^[ \t]*(#include|#import|import\s+\{|from\s+\S+\s+import|using\s+\w+))", std::regex_constants::optimize),
+        std::regex(R"(\b(var|let|const|auto|int|float|double|bool|void|string)\s+\w+\s*[=;:])", std::regex_constants::optimize),
+        std::regex(R"(\bif\s*\(.*\)\s*\{|\bfor\s*\(.*\)|\bwhile\s*\()", std::regex_constants::optimize),
+        std::regex(R"(=>\s*\{|function\s*\(|:\s*function)", std::regex_constants::optimize),
+        std::regex(R"(^\s*[\{\}]\s*$)", std::regex_constants::optimize),
+        std::regex(R"(^[ \t]*/[/*]|^[ \t]*\*|^[ \t]*//)", std::regex_constants::optimize),
+      };
+      static const std::regex markdownFence(R"(^```)", std::regex_constants::optimize);
+      auto forEachLine = [text](size_t maxLines, auto &&onLine) {
+        size_t lines = 0;
+        for (size_t pos = 0; pos < text.size() && lines < maxLines; ++lines) {
+          size_t lineEnd = text.find('\n', pos);
+          if (lineEnd == std::string_view::npos) lineEnd = text.size();
+          if (!onLine(text.substr(pos, lineEnd - pos))) break;
+          pos = lineEnd + 1;
+        }
+        };
+
+      size_t nonEmptyLines = 0, codeIndicators = 0, indentedLines = 0, linesWithSemicolons = 0, linesWithBraces = 0;
+      bool earlyExit = false;
+      forEachLine(200, [&](std::string_view lineView) {
+        const size_t firstNonWs = lineView.find_first_not_of(" \t\r\n");
+        if (firstNonWs == std::string_view::npos) return true;
+        nonEmptyLines++;
+        if (firstNonWs > 0) indentedLines++;
+        if (codeIndicators >= 5 && nonEmptyLines >= 10) return !(earlyExit = true);
+        const std::string line(lineView);
+        if (std::any_of(patterns.begin(), patterns.end(), [&line](const std::regex &r) { return std::regex_search(line, r); })) codeIndicators++;
+        if (lineView.find_first_of("{}") != std::string_view::npos) linesWithBraces++;
+        if (lineView.find(';') != std::string_view::npos) linesWithSemicolons++;
+        return true;
+        });
+      if (earlyExit) return Chunker::ContentType::Code;
+      if (nonEmptyLines < 3) {
+        return (text.find('{') != std::string_view::npos || text.find("function") != std::string_view::npos ||
+          text.find("class ") != std::string_view::npos) ? Chunker::ContentType::Code : Chunker::ContentType::Text;
+      }
+      int fenceCount = 0;
+      forEachLine(75, [&](std::string_view line) {
+        if (std::regex_search(std::string(line), markdownFence)) fenceCount++;
+        return fenceCount < 2;
+        });
+      if (fenceCount >= 2) return Chunker::ContentType::Text;
+
+      const double codeRatio = double(codeIndicators) / nonEmptyLines;
+      const double braceRatio = double(linesWithBraces) / nonEmptyLines;
+      const double semicolonRatio = double(linesWithSemicolons) / nonEmptyLines;
+      const double indentRatio = double(indentedLines) / nonEmptyLines;
+      if (codeRatio > 0.25 || (braceRatio > 0.15 && codeIndicators > 2) || (semicolonRatio > 0.2 && codeIndicators > 2) ||
+        (codeIndicators > 5 && indentRatio > 0.5)) {
+        return Chunker::ContentType::Code;
+      }
+      if (codeRatio > 0.1 && indentRatio > 0.6 && (braceRatio > 0.05 || semicolonRatio > 0.1)) {
+        return Chunker::ContentType::Code;
+      }
+      return Chunker::ContentType::Text;
+    }
+
+    std::string normalizeWhitespaces(const std::string &str) {
+      auto start = str.find_first_not_of(" \t\r\n");
+      auto end = str.find_last_not_of(" \t\r\n");
+      std::string s = (start == std::string::npos) ? "" : str.substr(start, end - start + 1);
+      s = std::regex_replace(s, std::regex{ "[^\\S\n]+" }, " ");
+      s = std::regex_replace(s, std::regex{ "\n\\s*\n" }, "\n");
+      return s;
+    }
+
+    // Chunking with a std::string per unit, line and chunk. The chunks are what Chunker yields,
+    // reduced to the fields compared.
+    struct Chunk {
+      std::string text;
+      size_t tokens;
+      size_t start;
+      size_t end;
+      bool operator ==(const Chunk &) const = default;
+    };
+
+    std::vector<std::string> splitUnits(const std::string &text) {
+      std::vector<std::string> result;
+      std::string buf;
+      auto flushBuf = [&]() {
+        if (!buf.empty()) {
+          result.push_back(buf);
+          buf.clear();
+        }
+        };
+      for (unsigned char c : text) {
+        if (std::isspace(c)) {
+          flushBuf();
+          if (!result.empty() && std::all_of(result.back().begin(), result.back().end(),
+            [](unsigned char x) { return std::isspace(x); })) {
+            result.back().push_back(c);
+          } else {
+            result.emplace_back(1, c);
+          }
+        } else if (std::ispunct(c)) {
+          flushBuf();
+          result.emplace_back(1, c);
+        } else {
+          buf.push_back(c);
+        }
+      }
+      flushBuf();
+      return result;
+    }
+
+    class Chunker {
+      const SimpleTokenizer &tok_;
+      size_t minTokens_, maxTokens_, overlapTokens_;
+      mutable TokenCountCache cache_{ 16384 };
+
+      size_t tokenCount(const std::string &text) const {
+        return cache_.get(text, [this](std::string_view t) { return tok_.countTokensWithVocab(t); });
+      }
+
+      std::vector<std::string> splitIntoLines(const std::string &text) const {
+        if (tokenCount(text) <= maxTokens_) return { text + '\n' };
+        std::vector<std::string> result;
+        std::string current;
+        size_t currentTokens = 0;
+        for (const auto &u : splitUnits(text)) {
+          size_t uTokens = tokenCount(u);
+          if (maxTokens_ < currentTokens + uTokens && !current.empty()) {
+            result.push_back(std::move(current) + '\n');
+            current.clear();
+            currentTokens = 0;
+          }
+          current += u;
+          currentTokens += uTokens;
+        }
+        if (!current.empty()) result.push_back(std::move(current) + '\n');
+        return result;
+      }
+
+      std::vector<Chunk> textChunks(std::string text) const {
+        auto overlap = overlapTokens_;
+        if (maxTokens_ * 0.6 < overlap) overlap = static_cast<size_t>(maxTokens_ * 0.6);
+        text = normalizeWhitespaces(text);
+        struct Unit { std::string text; size_t tokens, startChar, endChar; };
+        std::vector<Unit> units;
+        size_t charPos = 0;
+        for (auto &u : splitUnits(text)) {
+          units.push_back({ u, tokenCount(u), charPos, charPos + u.size() });
+          charPos += u.size();
+        }
+        std::vector<Chunk> chunks;
+        size_t start = 0;
+        while (start < units.size()) {
+          size_t tokenCnt = 0;
+          size_t end = start;
+          while (end < units.size() && tokenCnt + units[end].tokens <= maxTokens_) tokenCnt += units[end++].tokens;
+          if (start == end) tokenCnt = units[end++].tokens;
+          std::string chunkText;
+          for (size_t i = start; i < end; i++) chunkText += units[i].text;
+          chunks.push_back({ chunkText, tokenCnt, units[start].startChar, units[end - 1].endChar });
+          if (units.size() <= end) break;
+          if (0 < overlap) {
+            size_t overlapTokens = 0;
+            size_t overlapUnits = 0;
+            while (start + overlapUnits < end && overlapTokens < overlap) overlapTokens += units[end - 1 - overlapUnits++].tokens;
+            start = (std::max)(end - overlapUnits, start + 1);
+          } else {
+            start = end;
+          }
+        }
+        return chunks;
+      }
+
+      std::vector<Chunk> lineChunks(const std::string &text) const {
+        std::vector<std::string> lines;
+        std::istringstream iss(text);
+        std::string line;
+        while (std::getline(iss, line)) {
+          for (auto &l : splitIntoLines(line)) lines.push_back(std::move(l));
+        }
+        std::vector<Chunk> chunks;
+        size_t start = 0;
+        while (start < lines.size()) {
+          size_t tokenCnt = 0;
+          size_t end = start;
+          std::string chunkText;
+          while (end < lines.size()) {
+            auto lineTokens = tokenCount(lines[end]);
+            if (tokenCnt + lineTokens > maxTokens_ && start < end) break;
+            tokenCnt += lineTokens;
+            chunkText += lines[end++];
+          }
+          chunks.push_back({ chunkText, tokenCnt, start, end });
+          if (lines.size() <= end) break;
+          if (0 < overlapTokens_) {
+            size_t overlapTokens = 0;
+            size_t overlapLines = 0;
+            while (start < end - overlapLines - 1) {
+              overlapTokens += tokenCount(lines[end - 1 - overlapLines]);
+              if (overlapTokens < overlapTokens_) overlapLines++;
+              else break;
+            }
+            start = end - overlapLines;
+          } else {
+            start = end;
+          }
+        }
+        return chunks;
+      }
+
+      std::vector<Chunk> postProcess(const std::vector<Chunk> &chunks) const {
+        std::vector<Chunk> processed;
+        for (size_t i = 0; i < chunks.size(); ++i) {
+          Chunk chunk = chunks[i];
+          if (chunk.tokens < minTokens_ && i + 1 < chunks.size()) {
+            size_t combined = tokenCount(chunk.text + chunks[i + 1].text);
+            if (combined <= maxTokens_) {
+              chunk.text += chunks[i + 1].text;
+              chunk.tokens = combined;
+              chunk.end = chunks[i + 1].end;
+              ++i;
+            }
+          }
+          processed.push_back(chunk);
+        }
+        return processed;
+      }
+
+    public:
+      Chunker(const SimpleTokenizer &tok, size_t minTok, size_t maxTok, float overlap)
+        : tok_(tok), minTokens_(minTok), maxTokens_(maxTok), overlapTokens_(static_cast<size_t>(maxTok * overlap)) {}
+
+      std::vector<Chunk> chunkText(const std::string &text) const {
+        switch (::Chunker::detectContentType(text, {})) {
+        case ::Chunker::ContentType::Text: return postProcess(textChunks(text));
+        case ::Chunker::ContentType::Code: return postProcess(lineChunks(text));
+        default: return {};
+        }
+      }
+    };
+
+  } // namespace legacy
+
+  // Results are stored here so that the measured loops can't be optimized away.
+  volatile size_t benchSink = 0;
+
+  template <typename F>
+  double bestOfMs(size_t iterations, F &&run) {
+    double best = 0;
+    for (size_t i = 0; i < (std::max)(iterations, size_t(1)); ++i) {
+      const auto start = std::chrono::steady_clock::now();
+      run();
+      const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      if (i == 0 || ms < best) best = ms;
+    }
+    return best;
+  }
+
+  void report(const char *name, size_t bytes, double baselineMs, double ms, size_t mismatches) {
+    auto mbps = [bytes](double t) { return 0 < t ? bytes / t / 1000.0 : 0.0; };
+    char line[256];
+    std::snprintf(line, sizeof(line), "[BENCH] %-22s baseline %9.2f ms (%7.1f MB/s)  new %9.2f ms (%7.1f MB/s)  x%.1f  mismatches %zu",
+      name, baselineMs, mbps(baselineMs), ms, mbps(ms), 0 < ms ? baselineMs / ms : 0.0, mismatches);
+    std::cout << line << "\n";
+  }
+
+  // Counts texts whose results differ between the two implementations.
+  template <typename A, typename B>
+  size_t mismatches(const std::vector<std::string_view> &texts, A &&baseline, B &&current) {
+    size_t n = 0;
+    for (auto t : texts) n += baseline(t) != current(t);
+    return n;
+  }
+
+  void benchTokenizer(const App &app, const std::vector<std::string_view> &texts, size_t bytes, size_t iterations) {
+    const auto &tok = app.tokenizer();
+
+    auto legacyEstimate = [](std::string_view t) { return legacy::estimateTokenCount(t); };
+    auto estimate = [&tok](std::string_view t) { return tok.estimateTokenCount(t); };
+    report("tokenizer.estimate", bytes,
+      bestOfMs(iterations, [&]() { for (auto t : texts) benchSink = benchSink + legacyEstimate(t); }),
+      bestOfMs(iterations, [&]() { for (auto t : texts) benchSink = benchSink + estimate(t); }),
+      mismatches(texts, legacyEstimate, estimate));
+
+    if (tok.vocab().empty()) {
+      std::cout << "[BENCH] tokenizer.count skipped, no vocab loaded\n";
+    } else {
+      auto legacyCount = [&tok](std::string_view t) { return legacy::countTokensWithVocab(tok.vocab(), t); };
+      auto count = [&tok](std::string_view t) { return tok.countTokensWithVocab(t); };
+      report("tokenizer.count", bytes,
+        bestOfMs(iterations, [&]() { for (auto t : texts) benchSink = benchSink + legacyCount(t); }),
+        bestOfMs(iterations, [&]() { for (auto t : texts) benchSink = benchSink + count(t); }),
+        mismatches(texts, legacyCount, count));
+    }
+  }
+
+  // Cuts every text to half its tokens. Mismatches count the texts where exactly one of the
+  // two cuts stays within the budget.
+  void benchTruncate(const App &app, const std::vector<std::string_view> &texts, size_t bytes, size_t iterations) {
+    const auto &tok = app.tokenizer();
+    std::vector<std::string> strings(texts.begin(), texts.end());
+    std::vector<size_t> budgets;
+    for (const auto &s : strings) budgets.push_back(tok.countTokensWithVocab(s) / 2);
+
+    auto legacyCut = [&](size_t i) { return legacy::truncateToTokens(tok, strings[i], budgets[i]); };
+    auto cut = [&](size_t i) { return tok.prefixWithinTokens(strings[i], budgets[i]); };
+    size_t differ = 0;
+    for (size_t i = 0; i < strings.size(); ++i) {
+      auto fits = [&](size_t len) { return tok.countTokensWithVocab(std::string_view(strings[i]).substr(0, len)) <= budgets[i]; };
+      differ += fits(legacyCut(i)) != fits(cut(i));
+    }
+    report("truncate.half", bytes,
+      bestOfMs(iterations, [&]() { for (size_t i = 0; i < strings.size(); ++i) benchSink = benchSink + legacyCut(i); }),
+      bestOfMs(iterations, [&]() { for (size_t i = 0; i < strings.size(); ++i) benchSink = benchSink + cut(i); }),
+      differ);
+  }
+
+  // Word lookups from all cores at once, as parallel ingest does. Each thread walks the words
+  // of every file starting at a different file.
+  void benchTokenCache(const App &app, const std::vector<std::string_view> &texts, size_t iterations) {
+    const auto &vocab = app.tokenizer().vocab();
+    auto pieces = [&vocab](std::string_view w) { return vocab.empty() ? w.size() : vocab.countPieces(w); };
+    std::vector<std::string> words;
+    size_t bytes = 0;
+    for (auto t : texts) {
+      legacy::forEachPiece(t, [&](const std::string &w) { words.push_back(w); bytes += w.size(); });
+    }
+    if (words.empty()) return;
+    const size_t threads = (std::max)(std::thread::hardware_concurrency(), 2u);
+    auto runParallel = [&](auto &&lookup) {
+      std::vector<std::future<size_t>> done;
+      for (size_t t = 0; t < threads; ++t) {
+        done.push_back(std::async(std::launch::async, [&, t]() {
+          size_t sum = 0;
+          const size_t offset = words.size() / threads * t;
+          for (size_t i = 0; i < words.size(); ++i) sum += lookup(words[(offset + i) % words.size()]);
+          return sum;
+          }));
+      }
+      for (auto &d : done) benchSink = benchSink + d.get();
+    };
+
+    legacy::WordCache legacyCache;
+    TokenCountCache cache(size_t(1) << 18);
+    auto legacyLookup = [&](const std::string &w) { return legacyCache.get(w, pieces); };
+    auto lookup = [&](const std::string &w) { return cache.get(w, pieces); };
+    report("token_cache.parallel", bytes * threads,
+      bestOfMs(iterations, [&]() { runParallel(legacyLookup); }),
+      bestOfMs(iterations, [&]() { runParallel(lookup); }),
+      0);
+    const auto st = cache.stats();
+    std::cout << "[BENCH] token_cache " << threads << " threads, " << st.entries << " entries, "
+      << st.evictions << " evictions, hit rate " << (st.hits + st.misses ? double(st.hits) / (st.hits + st.misses) : 0.0) << "\n";
+  }
+
+  // Content classification of whole files without the extension shortcut, as for unknown file types.
+  void benchContentType(const std::vector<std::string_view> &texts, size_t bytes, size_t iterations) {
+    std::vector<std::string> strings(texts.begin(), texts.end());
+    auto current = [](std::string_view t) { return Chunker::detectContentType(std::string(t), {}); };
+    report("content_type", bytes,
+      bestOfMs(iterations, [&]() { for (const auto &s : strings) benchSink = benchSink + size_t(legacy::detectContentType(s)); }),
+      bestOfMs(iterations, [&]() { for (const auto &s : strings) benchSink = benchSink + size_t(Chunker::detectContentType(s, {})); }),
+      mismatches(texts, legacy::detectContentType, current));
+  }
+
+  // Whitespace normalization of the files classified as text (docs, markdown), as done before
+  // chunking them.
+  void benchNormalize(const std::vector<std::string_view> &texts, size_t iterations) {
+    std::vector<std::string> docs;
+    size_t bytes = 0;
+    for (auto t : texts) {
+      std::string s(t);
+      if (Chunker::detectContentType(s, {}) != Chunker::ContentType::Text) continue;
+      bytes += s.size();
+      docs.push_back(std::move(s));
+    }
+    if (docs.empty()) return;
+    size_t differ = 0;
+    for (const auto &s : docs) {
+      std::string normalized = s;
+      utils::normalizeWhitespaces(normalized);
+      differ += normalized != legacy::normalizeWhitespaces(s);
+    }
+    report("normalize_whitespace", bytes,
+      bestOfMs(iterations, [&]() { for (const auto &s : docs) benchSink = benchSink + legacy::normalizeWhitespaces(s).size(); }),
+      bestOfMs(iterations, [&]() {
+        for (const auto &s : docs) {
+          std::string normalized = s;
+          utils::normalizeWhitespaces(normalized);
+          benchSink = benchSink + normalized.size();
+        }
+        }),
+      differ);
+  }
+
+  // Semantic chunking of every file with the default chunk sizes. Mismatches count the files
+  // whose chunks differ in text, token count or offsets.
+  void benchChunker(const App &app, const std::vector<std::string_view> &texts, size_t bytes, size_t iterations) {
+    const auto &tok = app.tokenizer();
+    std::vector<std::string> strings(texts.begin(), texts.end());
+    const legacy::Chunker legacyChunker(tok, 50, 500, 0.1f);
+    const Chunker chunker(tok, 50, 500, 0.1f);
+    auto legacyChunks = [&](std::string_view t) { return legacyChunker.chunkText(std::string(t)); };
+    auto chunks = [&](std::string_view t) {
+      std::vector<legacy::Chunk> reduced;
+      for (auto &c : chunker.chunkText(std::string(t))) {
+        reduced.push_back({ std::move(c.text), c.metadata.tokenCount, c.metadata.start, c.metadata.end });
+      }
+      return reduced;
+      };
+    report("chunker", bytes,
+      bestOfMs(iterations, [&]() { for (const auto &s : strings) benchSink = benchSink + legacyChunker.chunkText(s).size(); }),
+      bestOfMs(iterations, [&]() { for (const auto &s : strings) benchSink = benchSink + chunker.chunkText(s).size(); }),
+      mismatches(texts, legacyChunks, chunks));
+  }
+
+} // anonymous namespace
+
+
+void runBenchmarks(const App &app, const std::vector<SourceProcessor::Data> &sources, size_t iterations)
+{
+  std::vector<std::string_view> texts;
+  size_t bytes = 0;
+  for (const auto &s : sources) {
+    if (s.isUrl || s.content.empty()) continue;
+    texts.push_back(s.content);
+    bytes += s.content.size();
+  }
+  std::cout << "Benchmarking over " << texts.size() << " files, " << bytes / 1024 << " KiB, best of " << iterations << " runs\n";
+  if (texts.empty()) return;
+
+  benchTokenizer(app, texts, bytes, iterations);
+  benchTruncate(app, texts, bytes, iterations);
+  benchTokenCache(app, texts, iterations);
+  benchContentType(texts, bytes, iterations);
+  benchNormalize(texts, iterations);
+  benchChunker(app, texts, bytes, iterations);
+}
@@ -0,0 +1,203 @@
+#include "bpe.h"
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+  // Longer pieces (minified code, data blobs) are counted in windows of this many bytes,
+  // the merge loop is quadratic in the piece length.
+  constexpr size_t MAX_PIECE = 256;
+
+  const std::string METASPACE = "\xe2\x96\x81"; // U+2581
+
+  void appendUtf8(std::string &s, uint32_t cp) {
+    if (cp < 0x80) {
+      s += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+      s += static_cast<char>(0xC0 | (cp >> 6));
+      s += static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+      s += static_cast<char>(0xE0 | (cp >> 12));
+      s += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+      s += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+  }
+
+  // GPT-2's bytes_to_unicode(): printable bytes stand for themselves, the rest are moved to 256 and up.
+  std::array<uint32_t, 256> byteCodepoints() {
+    std::array<uint32_t, 256> cps{};
+    uint32_t next = 256;
+    for (uint32_t b = 0; b < 256; ++b) {
+      const bool printable = (33 <= b && b <= 126) || (161 <= b && b <= 172) || (174 <= b && b <= 255);
+      cps[b] = printable ? b : next++;
+    }
+    return cps;
+  }
+
+  const std::array<uint32_t, 256> &byteCodepoint() {
+    static const auto cps = byteCodepoints();
+    return cps;
+  }
+
+  size_t utf8Length(unsigned char c) {
+    return c < 0x80 ? 1 : (c >> 5) == 0x06 ? 2 : (c >> 4) == 0x0E ? 3 : (c >> 3) == 0x1E ? 4 : 1;
+  }
+
+  // Visits every object in a pre-tokenizer/normalizer description, including those nested in sequences.
+  void forEachComponent(const nlohmann::json &j, const std::function<void(const nlohmann::json &)> &visit) {
+    if (j.is_object()) {
+      visit(j);
+      for (const auto &[key, value] : j.items()) {
+        if (value.is_structured()) forEachComponent(value, visit);
+      }
+    } else if (j.is_array()) {
+      for (const auto &v : j) forEachComponent(v, visit);
+    }
+  }
+
+} // anonymous namespace
+
+
+BpeModel::BpeModel(const nlohmann::json &tokenizerJson)
+{
+  if (!tokenizerJson.contains("model") || tokenizerJson["model"].value("type", "") != "BPE") {
+    throw std::runtime_error("Not a BPE tokenizer");
+  }
+  const auto &model = tokenizerJson["model"];
+  for (const auto &[token, id] : model["vocab"].items()) {
+    vocab_.emplace(token, id.get<uint32_t>());
+  }
+  byteFallback_ = model.value("byte_fallback", false);
+  ignoreMerges_ = model.value("ignore_merges", false);
+
+  std::string regex;
+  auto inspect = [&](const nlohmann::json &c) {
+    const auto type = c.value("type", "");
+    if (type == "ByteLevel") byteLevel_ = true;
+    if (type == "Metaspace") {
+      metaspace_ = true;
+      splitSpaces_ = c.value("split", true);
+      prependSpace_ = c.value("prepend_scheme", c.value("add_prefix_space", true) ? "always" : "never") != "never";
+    }
+    if (type == "Prepend" && c.value("prepend", "") == METASPACE) prependSpace_ = true;
+    if (type == "Replace" && c.value("content", "") == METASPACE) metaspace_ = true;
+    if (type == "Digits" && c.value("individual_digits", false)) digitGroup_ = 1;
+    if (c.contains("pattern") && c["pattern"].is_object() && c["pattern"].contains("Regex")) regex += c["pattern"]["Regex"].get<std::string>();
+    };
+  for (const char *section : { "normalizer", "pre_tokenizer", "decoder" }) {
+    if (tokenizerJson.contains(section)) forEachComponent(tokenizerJson[section], inspect);
+  }
+  if (regex.find("\\p{N}{1,3}") != std::string::npos) digitGroup_ = 3;
+  else if (regex.find("\\p{N}+") != std::string::npos) digitGroup_ = 0;
+  else if (regex.find("\\p{N}") != std::string::npos || metaspace_) digitGroup_ = 1;
+
+  if (byteLevel_) {
+    for (size_t b = 0; b < 256; ++b) {
+      std::string s;
+      appendUtf8(s, byteCodepoint()[b]);
+      byteSymbol_[b] = idOf(s);
+    }
+  }
+
+  uint32_t rank = 0;
+  for (const auto &m : model["merges"]) {
+    std::string left, right;
+    if (m.is_string()) {
+      const auto s = m.get<std::string>();
+      const auto sp = s.find(' ', 1);
+      if (sp == std::string::npos) continue;
+      left = s.substr(0, sp);
+      right = s.substr(sp + 1);
+    } else if (m.is_array() && m.size() == 2) {
+      left = m[0].get<std::string>();
+      right = m[1].get<std::string>();
+    } else {
+      continue;
+    }
+    const uint32_t l = idOf(left), r = idOf(right), merged = idOf(left + right);
+    if (l != NONE && r != NONE && merged != NONE) {
+      merges_.emplace((uint64_t(l) << 32) | r, Merge{ rank, merged });
+    }
+    ++rank;
+  }
+}
+
+uint32_t BpeModel::idOf(std::string_view token) const
+{
+  auto it = vocab_.find(token);
+  return it != vocab_.end() ? it->second : NONE;
+}
+
+std::string BpeModel::mapped(std::string_view piece) const
+{
+  std::string s;
+  s.reserve(piece.size() * 2);
+  for (unsigned char c : piece) {
+    if (byteLevel_) appendUtf8(s, byteCodepoint()[c]);
+    else if (metaspace_ && c == ' ') s += METASPACE;
+    else s += static_cast<char>(c);
+  }
+  return s;
+}
+
+size_t BpeModel::countFirstPiece(std::string_view piece) const
+{
+  if (!prependSpace_ || piece.empty() || piece.front() == ' ') return countPieces(piece);
+  return countPieces(" " + std::string(piece));
+}
+
+size_t BpeModel::countPieces(std::string_view piece) const
+{
+  if (MAX_PIECE < piece.size()) {
+    size_t n = 0;
+    while (!piece.empty()) {
+      size_t len = (std::min)(piece.size(), MAX_PIECE);
+      while (len < piece.size() && 0 < len && (static_cast<unsigned char>(piece[len]) & 0xC0) == 0x80) --len;
+      if (len == 0) len = (std::min)(piece.size(), MAX_PIECE);
+      n += countPieces(piece.substr(0, len));
+      piece.remove_prefix(len);
+    }
+    return n;
+  }
+  if (piece.empty()) return 0;
+  if (ignoreMerges_ && idOf(mapped(piece)) != NONE) return 1;
+
+  // Initial symbols; NONE stands for a token that takes part in no merge.
+  std::vector<uint32_t> symbols;
+  symbols.reserve(piece.size());
+  if (byteLevel_) {
+    for (unsigned char c : piece) symbols.push_back(byteSymbol_[c]);
+  } else {
+    for (size_t i = 0; i < piece.size();) {
+      const size_t len = (std::min)(utf8Length(static_cast<unsigned char>(piece[i])), piece.size() - i);
+      const std::string_view ch = piece.substr(i, len);
+      const uint32_t id = metaspace_ && ch == " " ? idOf(METASPACE) : idOf(ch);
+      if (id != NONE) {
+        symbols.push_back(id);
+      } else {
+        symbols.insert(symbols.end(), byteFallback_ ? len : 1, NONE);
+      }
+      i += len;
+    }
+  }
+
+  // Repeatedly merge the adjacent pair with the lowest rank, leftmost first.
+  while (1 < symbols.size()) {
+    Merge best{ NONE, NONE };
+    size_t bestAt = 0;
+    for (size_t i = 0; i + 1 < symbols.size(); ++i) {
+      if (symbols[i] == NONE || symbols[i + 1] == NONE) continue;
+      auto it = merges_.find((uint64_t(symbols[i]) << 32) | symbols[i + 1]);
+      if (it != merges_.end() && it->second.rank < best.rank) {
+        best = it->second;
+        bestAt = i;
+      }
+    }
+    if (best.rank == NONE) break;
+    symbols[bestAt] = best.id;
+    symbols.erase(symbols.begin() + bestAt + 1);
+  }
+  return symbols.size();
+}
@@ -1,19 +1,146 @@
 #include "chunker.h"
-#include <sstream>
+#include "cutils.h"
 #include <algorithm>
+#include <array>
+#include <cstring>
+#include <span>
 #include <string>
 #include <string_view>
 #include <unordered_set>
+#include <filesystem>
 #include <utils_log/logger.hpp>
 
 namespace {
-  struct Unit {
-    std::string text;
-    size_t tokens;
-    size_t startChar;
-    size_t endChar;
-  };
+  // Lines and sentences of recently chunked files; repeats are mostly boilerplate and blank-ish lines.
+  constexpr size_t UNIT_CACHE_ENTRIES = 16384;
+
+  // First block of the per-file arena. A piece takes 24 bytes for a unit of a few characters;
+  // the arena adds blocks when a file needs more.
+  size_t arenaSizeFor(size_t textSize) { return textSize * 4 + 4096; }
+
+
+  // Byte classes of the line scanner: \w and \s as std::regex (classic locale) sees them.
+  enum : uint8_t { WORD = 1, SPACE = 2 };
+
+  constexpr std::array<uint8_t, 256> makeByteClasses() {
+    std::array<uint8_t, 256> t{};
+    for (int c = 0; c < 256; ++c) {
+      if (('0' <= c && c <= '9') || ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || c == '_') t[c] = WORD;
+      else if (c == ' ' || ('\t' <= c && c <= '\r')) t[c] = SPACE;
+    }
+    return t;
+  }
+  constexpr auto BYTE_CLASS = makeByteClasses();
+
+  bool isWord(char c) { return BYTE_CLASS[static_cast<unsigned char>(c)] & WORD; }
+  bool isSpace(char c) { return BYTE_CLASS[static_cast<unsigned char>(c)] & SPACE; }
+
+  size_t skipSpaces(std::string_view s, size_t i) {
+    while (i < s.size() && isSpace(s[i])) ++i;
+    return i;
+  }
+  size_t skipWord(std::string_view s, size_t i) {
+    while (i < s.size() && isWord(s[i])) ++i;
+    return i;
+  }
+
+  // Keywords that count wherever a word starts with them, e.g. "define" or "fnmatch".
+  constexpr std::string_view FUNCTION_PREFIXES[] = { "def", "fn", "func", "lambda" };
+  constexpr std::string_view MODIFIERS[] = {
+    "public", "private", "protected", "static", "final", "virtual", "override", "async", "await" };
+  constexpr std::string_view TYPE_KEYWORDS[] = { "class", "struct", "interface", "enum", "trait" };
+  constexpr std::string_view DECL_KEYWORDS[] = {
+    "var", "let", "const", "auto", "int", "float", "double", "bool", "void", "string" };
+
+  bool isOneOf(std::string_view word, std::span<const std::string_view> keywords) {
+    return std::find(keywords.begin(), keywords.end(), word) != keywords.end();
+  }
+
+  // What the code patterns matched at a word, given the rest of the line after it:
+  //   \b(class|struct|interface|enum|trait)\s+\w+
+  //   \b(def|function|func|fn|lambda)            (const arrow functions are declarations below)
+  //   \b(public|private|protected|static|final|virtual|override|async|await)\b
+  //   \b(var|let|const|auto|int|float|double|bool|void|string)\s+\w+\s*[=;:]
+  //   \bif\s*\(.*\)\s*\{|\bfor\s*\(.*\)|\bwhile\s*\(
+  bool isCodeWord(std::string_view line, size_t start, size_t end) {
+    const auto word = line.substr(start, end - start);
+    for (auto prefix : FUNCTION_PREFIXES) {
+      if (word.starts_with(prefix)) return true;
+    }
+    if (isOneOf(word, MODIFIERS)) return true;
+    const size_t next = skipSpaces(line, end);
+    if (isOneOf(word, TYPE_KEYWORDS)) {
+      return end < next && next < line.size() && isWord(line[next]);
+    }
+    if (isOneOf(word, DECL_KEYWORDS) && end < next && next < line.size() && isWord(line[next])) {
+      const size_t after = skipSpaces(line, skipWord(line, next));
+      if (after < line.size() && (line[after] == '=' || line[after] == ';' || line[after] == ':')) return true;
+    }
+    if ((word == "if" || word == "for" || word == "while") && next < line.size() && line[next] == '(') {
+      if (word == "while") return true;
+      // .* stops at a carriage return
+      for (size_t i = next + 1; i < line.size() && line[i] != '\r'; ++i) {
+        if (line[i] != ')') continue;
+        if (word == "for") return true;
+        const size_t brace = skipSpaces(line, i + 1);
+        if (brace < line.size() && line[brace] == '{') return true;
+      }
+    }
+    return false;
+  }
+
+  // Whether the line shows any of the code patterns below. One scan over its words plus a few
+  // anchored checks, no copy of the line and no regex engine.
+  bool isCodeLine(std::string_view line) {
+    // ^[ \t]*(//|/*|*) and ^[ \t]*(#include|#import|import\s+\{|from\s+\S+\s+import|using\s+\w+)
+    const size_t indent = (std::min)(line.find_first_not_of(" \t"), line.size());
+    const auto head = line.substr(indent);
+    if (head.starts_with("//") || head.starts_with("/*") || head.starts_with("*")) return true;
+    if (head.starts_with("#include") || head.starts_with("#import")) return true;
+    if (head.starts_with("import")) {
+      const size_t i = skipSpaces(head, 6);
+      if (6 < i && i < head.size() && head[i] == '{') return true;
+    }
+    if (head.starts_with("from")) {
+      const size_t module = skipSpaces(head, 4);
+      size_t i = module;
+      while (i < head.size() && !isSpace(head[i])) ++i;
+      const size_t keyword = skipSpaces(head, i);
+      if (4 < module && module < i && i < keyword && head.substr(keyword).starts_with("import")) return true;
+    }
+    if (head.starts_with("using")) {
+      const size_t i = skipSpaces(head, 5);
+      if (5 < i && i < head.size() && isWord(head[i])) return true;
+    }
+
+    // ^\s*[\{\}]\s*$
+    const size_t first = skipSpaces(line, 0);
+    if (first < line.size() && (line[first] == '{' || line[first] == '}') && skipSpaces(line, first + 1) == line.size()) return true;
+
+    // =>\s*\{|function\s*\(|:\s*function, anywhere
+    for (size_t i = line.find("=>"); i != std::string_view::npos; i = line.find("=>", i + 1)) {
+      const size_t brace = skipSpaces(line, i + 2);
+      if (brace < line.size() && line[brace] == '{') return true;
+    }
+    for (size_t i = line.find("function"); i != std::string_view::npos; i = line.find("function", i + 1)) {
+      const size_t paren = skipSpaces(line, i + 8);
+      if (paren < line.size() && line[paren] == '(') return true;
+    }
+    for (size_t i = line.find(':'); i != std::string_view::npos; i = line.find(':', i + 1)) {
+      if (line.substr(skipSpaces(line, i + 1)).starts_with("function")) return true;
+    }
 
+    for (size_t i = 0; i < line.size();) {
+      if (!isWord(line[i])) {
+        ++i;
+        continue;
+      }
+      const size_t end = skipWord(line, i);
+      if (isCodeWord(line, i, end)) return true;
+      i = end;
+    }
+    return false;
+  }
 
   class ContentTypeHelper {
   private:
@@ -33,49 +160,6 @@ namespace {
     static constexpr double BINARY_THRESHOLD = 0.3;
     static constexpr size_t BINARY_CHECK_BYTES = 1024;
 
-    // Precompiled optimized regexes (thread-safe after initialization)
-    struct RegexPatterns {
-      std::regex classStruct;
-      std::regex functionDef;
-      std::regex accessModifiers;
-      std::regex imports;
-      std::regex varDeclarations;
-      std::regex controlFlow;
-      std::regex arrowFunctions;
-      std::regex loneBraces;
-      std::regex comments;
-      std::regex markdownFence;
-
-      RegexPatterns() :
-        classStruct(R"(\b(class|struct|interface|enum|trait)\s+\w+)",
-          std::regex_constants::optimize),
-        functionDef(R"(\b(def|function|func|fn|lambda|const\s+\w+\s*=\s*\([^)]*\)\s*=>)\s*)",
-          std::regex_constants::optimize),
-        accessModifiers(R"(\b(public|private|protected|static|final|virtual|override|async|await)\b)",
-          std::regex_constants::optimize),
-        imports(R"(^[ \t]*(#include|#import|import\s+\{|from\s+\S+\s+import|using\s+\w+))",
-          std::regex_constants::optimize),
-        varDeclarations(R"(\b(var|let|const|auto|int|float|double|bool|void|string)\s+\w+\s*[=;:])",
-          std::regex_constants::optimize),
-        controlFlow(R"(\bif\s*\(.*\)\s*\{|\bfor\s*\(.*\)|\bwhile\s*\()",
-          std::regex_constants::optimize),
-        arrowFunctions(R"(=>\s*\{|function\s*\(|:\s*function)",
-          std::regex_constants::optimize),
-        loneBraces(R"(^\s*[\{\}]\s*$)",
-          std::regex_constants::optimize),
-        comments(R"(^[ \t]*/[/*]|^[ \t]*\*|^[ \t]*//)",
-          std::regex_constants::optimize),
-        markdownFence(R"(^```)",
-          std::regex_constants::optimize)
-      {
-      }
-    };
-
-    static const RegexPatterns &getPatterns() {
-      static RegexPatterns patterns;
-      return patterns;
-    }
-
     inline static const std::unordered_set<std::string> codeExtensions = {
         ".cpp", ".h", ".hpp", ".c", ".cc", ".cxx",
         ".py", ".js", ".ts", ".jsx", ".tsx",
@@ -111,7 +195,6 @@ namespace {
     }
 
     static bool hasMarkdownCodeBlocks(std::string_view text) {
-      const auto &patterns = getPatterns();
       int fenceCount = 0;
       size_t pos = 0;
       size_t linesChecked = 0;
@@ -119,15 +202,8 @@ namespace {
       while (pos < text.size() && fenceCount < 2 && linesChecked < M) {
         size_t lineEnd = text.find('\n', pos);
         if (lineEnd == std::string_view::npos) lineEnd = text.size();
-        std::string_view line = text.substr(pos, lineEnd - pos);
-        std::string lineStr(line); // Regex needs std::string
-        try {
-          if (std::regex_search(lineStr, patterns.markdownFence)) {
-            fenceCount++;
-          }
-        } catch (const std::regex_error &) {
-          // UTF-8 issues - bail out
-          return false;
+        if (text.substr(pos, lineEnd - pos).starts_with("```")) {
+          fenceCount++;
         }
         pos = lineEnd + 1;
         linesChecked++;
@@ -135,15 +211,6 @@ namespace {
       return fenceCount >= 2;
     }
 
-    static bool tryRegexSearch(const std::string &line, const std::regex &pattern) {
-      try {
-        return std::regex_search(line, pattern);
-      } catch (const std::regex_error &) {
-        // Non-UTF8 or malformed input
-        return false;
-      }
-    }
-
   public:
     static Chunker::ContentType detectContentType(const std::string &text, const std::string &uri) {
       std::string_view textView(text);
@@ -158,7 +225,6 @@ namespace {
       if (textExtensions.count(ext)) {
         return Chunker::ContentType::Text;
       }
-      const auto &patterns = getPatterns();
       size_t totalLines = 0;
       size_t nonEmptyLines = 0;
       size_t codeIndicators = 0;
@@ -190,37 +256,16 @@ namespace {
           return Chunker::ContentType::Code;
         }
 
-        // Convert to string for regex (only if needed)
-        std::string line(lineView);
-
-        // Check patterns with UTF-8 error handling
-        bool matched = false;
-        matched = matched || tryRegexSearch(line, patterns.classStruct);
-        matched = matched || tryRegexSearch(line, patterns.functionDef);
-        matched = matched || tryRegexSearch(line, patterns.accessModifiers);
-        matched = matched || tryRegexSearch(line, patterns.imports);
-        matched = matched || tryRegexSearch(line, patterns.varDeclarations);
-        matched = matched || tryRegexSearch(line, patterns.controlFlow);
-        matched = matched || tryRegexSearch(line, patterns.arrowFunctions);
-        matched = matched || tryRegexSearch(line, patterns.loneBraces);
-        matched = matched || tryRegexSearch(line, patterns.comments);
-
-        if (matched) {
+        if (isCodeLine(lineView)) {
           codeIndicators++;
         }
 
-        // Structural indicators - single pass
-        for (char c : lineView) {
-          if (c == '{' || c == '}') {
-            linesWithBraces++;
-            break;
-          }
+        // Structural indicators
+        if (lineView.find_first_of("{}") != std::string_view::npos) {
+          linesWithBraces++;
         }
-        for (char c : lineView) {
-          if (c == ';') {
-            linesWithSemicolons++;
-            break;
-          }
+        if (lineView.find(';') != std::string_view::npos) {
+          linesWithSemicolons++;
         }
 
         pos = lineEnd + 1;
@@ -263,68 +308,66 @@ namespace {
     }
   };
 
-  std::vector<std::string> splitUnits(const std::string &text) {
-    std::vector<std::string> result;
-    std::string buf;
-    auto flushBuf = [&]() {
-      if (!buf.empty()) {
-        result.push_back(buf);
-        buf.clear();
-      }
-      };
-    for (unsigned char c : text) {
-      if (std::isspace(c)) {
-        flushBuf();
-        // group consecutive whitespace into one unit
-        if (!result.empty() && std::all_of(result.back().begin(), result.back().end(),
-          [](unsigned char x) { return std::isspace(x); })) {
-          result.back().push_back(c);
-        } else {
-          result.emplace_back(1, c);
-        }
-      } else if (std::ispunct(c)) {
-        flushBuf();
-        // punctuation = its own unit
-        result.emplace_back(1, c);
-      } else {
-        buf.push_back(c);
+  // Byte classes of the unit splitter: std::isspace and std::ispunct in the C locale.
+  enum UnitClass : uint8_t { UnitWord, UnitSpace, UnitPunct };
+
+  constexpr std::array<uint8_t, 256> makeUnitClasses() {
+    std::array<uint8_t, 256> t{};
+    for (int c = 0; c < 256; ++c) {
+      if (c == ' ' || ('\t' <= c && c <= '\r')) t[c] = UnitSpace;
+      else if ((33 <= c && c <= 47) || (58 <= c && c <= 64) || (91 <= c && c <= 96) || (123 <= c && c <= 126)) t[c] = UnitPunct;
+    }
+    return t;
+  }
+  constexpr auto UNIT_CLASS = makeUnitClasses();
+
+  // Splits text into units: runs of whitespace, single punctuation characters and the words
+  // between them. onUnit gets views into text; together they cover it.
+  template <typename F>
+  void forEachUnit(std::string_view text, F &&onUnit) {
+    auto cls = [&text](size_t i) { return UNIT_CLASS[static_cast<unsigned char>(text[i])]; };
+    for (size_t i = 0; i < text.size();) {
+      const uint8_t c = cls(i);
+      size_t end = i + 1;
+      if (c != UnitPunct) {
+        while (end < text.size() && cls(end) == c) ++end;
       }
+      onUnit(text.substr(i, end - i));
+      i = end;
     }
-    flushBuf();
-    return result;
   }
 
-
 } // anonymous namespace
 
 
 Chunker::Chunker(const SimpleTokenizer &tok, size_t min_tok, size_t max_tok, float overlap)
-  : tokenizer_(tok), minTokens_(min_tok), maxTokens_(max_tok), overlapTokens_(static_cast<size_t>(max_tok * overlap))
+  : tokenizer_(tok), maxTokens_(max_tok), minTokens_(min_tok), overlapTokens_(static_cast<size_t>(max_tok * overlap))
+  , tokenCache_(UNIT_CACHE_ENTRIES)
 {
 }
 
 std::vector<Chunk> Chunker::chunkText(const std::string &text, const std::string &uri, bool semantic) const
 {
-  std::vector<Chunk> chunks;
-  if (semantic) {
-    switch (detectContentType(text, uri)) {
-    case ContentType::Text:
-      chunks = postProcessChunks(splitIntoTextChunks(text, uri), ContentType::Text);
-      break;
-    case ContentType::Code:
-      chunks = postProcessChunks(splitIntoLineChunks(text, uri), ContentType::Code);
-      break;
-    default:
-      LOG_MSG << "Unsupported content type for URI: " << uri << ". Skipped.";
-      break;
-    }
-  } else {
-    chunks = postProcessChunks(splitIntoTextChunks(text, uri), ContentType::Text);
+  const auto type = semantic ? detectContentType(text, uri) : ContentType::Text;
+  if (type != ContentType::Text && type != ContentType::Code) {
+    LOG_MSG << "Unsupported content type for URI: " << uri << ". Skipped.";
+    return {};
   }
-  return chunks;
+  // Only the chunks themselves outlive the arena.
+  std::pmr::monotonic_buffer_resource arena(arenaSizeFor(text.size()));
+  Pieces pieces(&arena);
+  Drafts drafts(&arena);
+  if (type == ContentType::Code) {
+    splitIntoLineChunks(text, arena, pieces, drafts);
+    return materialize(pieces, drafts, uri, Chunk::Unit::Line, type);
+  }
+  std::string normalized = text;
+  utils::normalizeWhitespaces(normalized);
+  splitIntoTextChunks(normalized, pieces, drafts);
+  return materialize(pieces, drafts, uri, Chunk::Unit::Char, type);
 }
 
-std::string Chunker::contentTypeToStr(Chunker::ContentType t)
+const char *Chunker::contentTypeToStr(Chunker::ContentType t)
 {
   switch (t) {
   case Chunker::ContentType::Code: return "code";
@@ -334,156 +377,139 @@ std::string Chunker::contentTypeToStr(Chunker::ContentType t)
   }
 }
 
+const char *Chunker::unitToStr(Chunk::Unit u)
+{
+  switch (u) {
+  case Chunk::Unit::Char: return "char";
+  case Chunk::Unit::Line: return "line";
+  default: return "unknown";
+  }
+}
+
 Chunker::ContentType Chunker::detectContentType(const std::string &text, const std::string &uri)
 {
   return ContentTypeHelper::detectContentType(text, uri);
 }
 
-std::vector<Chunk> Chunker::postProcessChunks(const std::vector<Chunk> &chunks, ContentType chunkType) const
+std::vector<Chunk> Chunker::materialize(const Pieces &pieces, const Drafts &drafts, const std::string &uri, Chunk::Unit unit, ContentType type) const
 {
-  std::vector<Chunk> processed;
-  for (size_t i = 0; i < chunks.size(); ++i) {
-    Chunk chunk = chunks[i];
-    chunk.metadata.type = contentTypeToStr(chunkType);
-    if (chunk.metadata.tokenCount < minTokens_ && i + 1 < chunks.size()) {
-      Chunk nextChunk = chunks[i + 1];
-      size_t combined_tokens = tokenCount(chunk.text + nextChunk.text);
-      if (combined_tokens <= maxTokens_ && chunk.docUri == nextChunk.docUri) {
-        chunk.text += nextChunk.text;
-        chunk.metadata.tokenCount = combined_tokens;
-        chunk.metadata.end = nextChunk.metadata.end;
+  auto length = [&pieces](const Draft &d) {
+    size_t n = 0;
+    for (size_t i = d.first; i < d.last; ++i) n += pieces[i].text.size();
+    return n;
+    };
+  // Consecutive pieces mostly view consecutive bytes and are copied as one run.
+  auto append = [&pieces](std::string &out, const Draft &d) {
+    const char *run = nullptr;
+    size_t runSize = 0;
+    for (size_t i = d.first; i < d.last; ++i) {
+      const auto t = pieces[i].text;
+      if (run && run + runSize == t.data()) {
+        runSize += t.size();
+        continue;
+      }
+      if (run) out.append(run, runSize);
+      run = t.data();
+      runSize = t.size();
+    }
+    if (run) out.append(run, runSize);
+    };
+
+  std::vector<Chunk> chunks;
+  chunks.reserve(drafts.size());
+  for (size_t i = 0; i < drafts.size(); ++i) {
+    const auto &d = drafts[i];
+    Chunk chunk{ uri, uri + "_" + std::to_string(i), {}, { d.tokens, d.start, d.end, unit, type } };
+    // A chunk below the minimum takes in the next one when both fit together.
+    const Draft *next = d.tokens < minTokens_ && i + 1 < drafts.size() ? &drafts[i + 1] : nullptr;
+    chunk.text.reserve(length(d) + (next ? length(*next) : 0));
+    append(chunk.text, d);
+    if (next) {
+      const size_t own = chunk.text.size();
+      append(chunk.text, *next);
+      const size_t combined = tokenizer_.countTokensWithVocab(chunk.text);
+      if (combined <= maxTokens_) {
+        chunk.metadata.tokenCount = combined;
+        chunk.metadata.end = next->end;
         ++i;
+      } else {
+        chunk.text.resize(own);
       }
     }
-    processed.push_back(chunk);
+    chunks.push_back(std::move(chunk));
   }
-  return processed;
+  return chunks;
 }
 
-size_t Chunker::tokenCount(const std::string &text) const
+size_t Chunker::tokenCount(std::string_view text) const
 {
-  std::lock_guard<std::mutex> lock(cacheMutex_);
-  auto it = tokenCache_.find(text);
-  if (it != tokenCache_.end()) {
-    return it->second;
-  }
-  size_t count = tokenizer_.countTokensWithVocab(text);
-  if (10'000 < tokenCache_.size()) {
-    // TODO: more robust cleanup (freq based, etc)
-    tokenCache_.clear();
-  }
-  tokenCache_[text] = count;
-  return count;
+  return tokenCache_.get(text, [this](std::string_view t) { return tokenizer_.countTokensWithVocab(t); });
 }
 
-std::vector<Chunk> Chunker::splitIntoTextChunks(std::string text, const std::string &uri) const
+void Chunker::splitIntoTextChunks(std::string_view text, Pieces &pieces, Drafts &drafts) const
 {
   auto overlap = overlapTokens_;
   if (maxTokens_ * 0.6 < overlap) overlap = static_cast<size_t>(maxTokens_ * 0.6);
-  text = normalizeWhitespaces(text);
-  auto rawUnits = splitUnits(text);
-  std::vector<Unit> units;
-  size_t charPos = 0;
-  for (auto &uText : rawUnits) {
-    size_t tks = tokenCount(uText);
-    units.push_back({ uText, tks, charPos, charPos + uText.size() });
-    charPos += uText.size();
-  }
-  std::vector<Chunk> chunks;
-  size_t chunkId = 0;
+  forEachUnit(text, [&](std::string_view u) { pieces.push_back({ u, tokenCount(u) }); });
+  auto offsetOf = [&text](std::string_view u) { return static_cast<size_t>(u.data() - text.data()); };
   size_t start = 0;
-  while (start < units.size()) {
+  while (start < pieces.size()) {
     size_t tokenCnt = 0;
     size_t end = start;
-    while (end < units.size() &&
-      tokenCnt + units[end].tokens <= maxTokens_) {
-      tokenCnt += units[end].tokens;
+    while (end < pieces.size() &&
+      tokenCnt + pieces[end].tokens <= maxTokens_) {
+      tokenCnt += pieces[end].tokens;
       end++;
     }
-    if (start < end) {
-      size_t startChar = units[start].startChar;
-      size_t endChar = units[end - 1].endChar;
-      std::string raw;
-#ifdef _DEBUG
-      raw = text.substr(startChar, endChar - startChar);
-      size_t tokensToCheck = tokenCount(raw);
-#endif
-      std::string chunkText;
-      for (size_t i = start; i < end; i++) chunkText += units[i].text;
-      chunks.push_back({
-          uri,
-          uri + "_" + std::to_string(chunkId++),
-          chunkText,
-          raw,
-          {tokenCnt, startChar, endChar, "char"}
-        });
+    if (start == end) {
+      // A unit over the budget makes a chunk of its own.
+      tokenCnt = pieces[end++].tokens;
     }
-    if (units.size() <= end) break;
+    drafts.push_back({ start, end, tokenCnt, offsetOf(pieces[start].text), offsetOf(pieces[end - 1].text) + pieces[end - 1].text.size() });
+    if (pieces.size() <= end) break;
     if (0 < overlap) {
       size_t overlapTokens = 0;
       size_t overlapUnits = 0;
       while (start + overlapUnits < end && overlapTokens < overlap) {
-        overlapTokens += units[end - 1 - overlapUnits].tokens;
+        overlapTokens += pieces[end - 1 - overlapUnits].tokens;
         overlapUnits++;
       }
-      start = end - overlapUnits;
+      // The overlap never takes the whole chunk, the next one has to start further on.
+      start = (std::max)(end - overlapUnits, start + 1);
     } else {
       start = end;
     }
   }
-  return chunks;
 }
 
-std::vector<Chunk> Chunker::splitIntoLineChunks(const std::string &text, const std::string &uri) const
+void Chunker::splitIntoLineChunks(std::string_view text, std::pmr::memory_resource &arena, Pieces &pieces, Drafts &drafts) const
 {
-  std::vector<std::string> lines;
-  lines.reserve(100);
-  {
-    std::istringstream iss(text);
-    std::string line;
-    while (std::getline(iss, line)) {
-      auto subLines = splitIntoLines(line); // split into more lines if too wide
-      lines.insert(lines.end(),
-        std::make_move_iterator(subLines.begin()),
-        std::make_move_iterator(subLines.end()));
-    }
+  for (size_t pos = 0; pos < text.size();) {
+    size_t lineEnd = text.find('\n', pos);
+    const bool hasNewline = lineEnd != std::string_view::npos;
+    if (!hasNewline) lineEnd = text.size();
+    splitIntoLines(text.substr(pos, lineEnd - pos), hasNewline, arena, pieces); // split into more lines if too wide
+    pos = lineEnd + 1;
   }
-  if (lines.empty()) return {};
-  std::vector<Chunk> chunks;
-  size_t chunkId = 0;
   size_t start = 0;
-  while (start < lines.size()) {
+  while (start < pieces.size()) {
     size_t tokenCnt = 0;
     size_t end = start;
-    std::string chunkText;
-    chunkText.reserve(maxTokens_ * 4);
     // Accumulate lines until token budget exceeded
-    while (end < lines.size()) {
-      auto lineTokens = tokenCount(lines[end]);
-      if (tokenCnt + lineTokens > maxTokens_) break;
-      tokenCnt += lineTokens;
-      chunkText += lines[end];
+    while (end < pieces.size() && tokenCnt + pieces[end].tokens <= maxTokens_) {
+      tokenCnt += pieces[end].tokens;
       end++;
     }
-    if (start < end) {
-      std::string raw;
-#ifdef _DEBUG
-      for (size_t i = start; i < end; i++) raw += lines[i];
-#endif
-      chunks.push_back({
-          uri,
-          uri + "_" + std::to_string(chunkId++),
-          chunkText,
-          raw,
-          {tokenCnt, start, end, "line"}
-        });
+    if (start == end) {
+      tokenCnt = pieces[end++].tokens;
     }
-    if (lines.size() <= end) break;
+    drafts.push_back({ start, end, tokenCnt, start, end });
+    if (pieces.size() <= end) break;
     if (0 < overlapTokens_) {
       size_t overlapTokens = 0;
       size_t overlapLines = 0;
       while (start < end - overlapLines - 1) {
-        overlapTokens += tokenCount(lines[end - 1 - overlapLines]);
+        overlapTokens += pieces[end - 1 - overlapLines].tokens;
         if (overlapTokens < overlapTokens_) overlapLines++;
         else break;
       }
@@ -492,7 +518,6 @@ std::vector<Chunk> Chunker::splitIntoLineChunks(const std::string &text, const s
       start = end;
     }
   }
-  return chunks;
 }
 
 std::vector<Chunk> Chunker::splitIntoSemanticChunks(const std::string &text, const std::string &docId) const
@@ -504,44 +529,41 @@ std::vector<Chunk> Chunker::splitIntoSemanticChunks(const std::string &text, con
 
 std::string Chunker::normalizeWhitespaces(const std::string &str)
 {
-  auto start = str.find_first_not_of(" \t\r\n");
-  auto end = str.find_last_not_of(" \t\r\n");
-  std::string s = (start == std::string::npos) ? "" : str.substr(start, end - start + 1);
-  // collapse whitespace except newlines into single space
-  s = std::regex_replace(s, std::regex{ "[^\\S\n]+" }, " ");
-  // collapse multiple newlines
-  s = std::regex_replace(s, std::regex{ "\n\\s*\n" }, "\n");
+  std::string s = str;
+  utils::normalizeWhitespaces(s);
   return s;
 }
 
-std::vector<std::string> Chunker::splitIntoLines(const std::string &text) const
+void Chunker::splitIntoLines(std::string_view line, bool hasNewline, std::pmr::memory_resource &arena, Pieces &pieces) const
 {
-  auto nTokens = tokenCount(text);
-  if (nTokens <= maxTokens_) {
-    auto s = text;
-    if (!s.ends_with('\n')) s += '\n';
-    return { s };
+  // Every piece ends with a newline: the one after the line in the source, or one added to
+  // a copy in the arena.
+  auto withNewline = [&](std::string_view s, bool inSource) {
+    if (inSource) return std::string_view(s.data(), s.size() + 1);
+    char *copy = static_cast<char *>(arena.allocate(s.size() + 1, 1));
+    std::memcpy(copy, s.data(), s.size());
+    copy[s.size()] = '\n';
+    return std::string_view(copy, s.size() + 1);
+    };
+  if (tokenCount(line) <= maxTokens_) {
+    const auto whole = withNewline(line, hasNewline);
+    pieces.push_back({ whole, tokenCount(whole) });
+    return;
   }
   // Line too long - split by words/punctuation
-  auto units = splitUnits(text);
-  std::vector<std::string> result;
-  std::string current;
-  current.reserve(maxTokens_ * 4);
-  size_t currentTokens = 0;
-  for (const auto &u : units) {
-    size_t uTokens = tokenCount(u);
-    if (maxTokens_ < currentTokens + uTokens && !current.empty()) {
-      if (!current.ends_with('\n')) current += '\n';
-      result.push_back(std::move(current));
-      current.clear();
-      currentTokens = 0;
-    }
-    current += u;
-    currentTokens += uTokens;
-  }
-  if (!current.empty()) {
-    if (!current.ends_with('\n')) current += '\n';
-    result.push_back(std::move(current));
-  }
-  return result;
+  size_t groupStart = 0;
+  size_t groupTokens = 0;
+  auto flush = [&](size_t groupEnd) {
+    const auto piece = withNewline(line.substr(groupStart, groupEnd - groupStart), hasNewline && groupEnd == line.size());
+    pieces.push_back({ piece, tokenCount(piece) });
+    groupStart = groupEnd;
+    groupTokens = 0;
+    };
+  forEachUnit(line, [&](std::string_view u) {
+    const size_t offset = static_cast<size_t>(u.data() - line.data());
+    const size_t uTokens = tokenCount(u);
+    if (maxTokens_ < groupTokens + uTokens && groupStart < offset) flush(offset);
+    groupTokens += uTokens;
+    });
+  if (groupStart < line.size()) flush(line.size());
 }
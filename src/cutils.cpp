@@ -146,6 +146,43 @@ std::string utils::trimmed(std::string_view sv)
   return (wsfront < wsback ? std::string(wsfront, wsback) : std::string{});
 }
 
+void utils::normalizeWhitespaces(std::string &s)
+{
+  // One pass over the string with the result of: trim " \t\r\n", replace [^\S\n]+ with " ",
+  // then \n\s*\n with "\n". The output never gets ahead of the input, so it's written in place.
+  auto isSpace = [](char c) { return c == ' ' || ('\t' <= c && c <= '\r'); };
+  auto isTrimmed = [](char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; };
+  size_t begin = 0;
+  size_t end = s.size();
+  while (begin < end && isTrimmed(s[begin])) ++begin;
+  while (begin < end && isTrimmed(s[end - 1])) --end;
+  size_t out = 0;
+  for (size_t i = begin; i < end;) {
+    if (!isSpace(s[i])) {
+      s[out++] = s[i++];
+      continue;
+    }
+    size_t runEnd = i;
+    size_t firstBreak = std::string::npos;
+    size_t lastBreak = std::string::npos;
+    for (; runEnd < end && isSpace(s[runEnd]); ++runEnd) {
+      if (s[runEnd] != '\n') continue;
+      if (firstBreak == std::string::npos) firstBreak = runEnd;
+      lastBreak = runEnd;
+    }
+    if (firstBreak == std::string::npos) {
+      s[out++] = ' ';
+    } else {
+      // Whatever lies between the first and the last line break is dropped.
+      if (i < firstBreak) s[out++] = ' ';
+      s[out++] = '\n';
+      if (lastBreak + 1 < runEnd) s[out++] = ' ';
+    }
+    i = runEnd;
+  }
+  s.resize(out);
+}
+
 std::string utils::addLineComments(std::string_view code, std::string_view filename)
 {
   namespace fs = std::filesystem;
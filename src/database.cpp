@@ -1,5 +1,6 @@
 #include "database.h"
 #include "cutils.h"
+#include "latency.h"
 #include <hnswlib/hnswlib.h>
 #include <sqlite3.h>
 #include <algorithm>
@@ -7,6 +8,7 @@
 #include <filesystem>
 #include <mutex>
 #include <fstream>
+#include <string_view>
 #include <iterator>
 #include "utils_log/logger.hpp"
 #include "3rdparty/fmt/core.h"
@@ -83,7 +85,7 @@ size_t HnswSqliteVectorDatabase::addDocument(const Chunk &chunk, const std::vect
   size_t chunkId = insertMetadata(chunk);
   try {
     size_t nofLines = countLines(chunk.docUri);
-    upsertFileMetadata(chunk.docUri, utils::getFileModificationTime(chunk.docUri), std::filesystem::file_size(chunk.docUri), nofLines);
+    upsertFileMetadata(chunk.docUri, utils::getFileModificationTime(chunk.docUri), std::filesystem::file_size(chunk.docUri), nofLines, 0);
   } catch (const std::exception &ex) {
     LOG_MSG << "Error during upserting a chunk:" << ex.what();
   }
@@ -104,6 +106,70 @@ std::vector<size_t> HnswSqliteVectorDatabase::addDocuments(const std::vector<Chu
   return chunkIds;
 }
 
+std::vector<size_t> HnswSqliteVectorDatabase::replaceDocuments(const std::string &sourceId, const std::vector<Chunk> &chunks, const std::vector<std::vector<float>> &embeddings, size_t sourceTokens)
+{
+  if (chunks.size() != embeddings.size()) {
+    throw std::runtime_error("Chunks and embeddings count mismatch");
+  }
+  for (const auto &embedding : embeddings) {
+    if (embedding.size() != imp->vectorDim_) {
+      throw std::runtime_error(fmt::format("Embedding dimension mismatch: actual {}, claimed {}", embedding.size(), imp->vectorDim_));
+    }
+  }
+
+  // File stats hit the disk, so gather them before taking the lock.
+  bool hasFileInfo = false;
+  std::time_t mtime = 0;
+  size_t fileSize = 0;
+  size_t nofLines = 0;
+  try {
+    fileSize = std::filesystem::file_size(sourceId);
+    mtime = utils::getFileModificationTime(sourceId);
+    nofLines = countLines(sourceId);
+    hasFileInfo = true;
+  } catch (const std::exception &ex) {
+    LOG_MSG << "Error reading file info for" << sourceId << ":" << ex.what();
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto oldIds = getChunkIdsBySource(sourceId);
+  std::vector<size_t> newIds;
+  newIds.reserve(chunks.size());
+  try {
+    beginTransaction();
+    {
+      utils::SqliteStmt stmt;
+      const char *sql = "DELETE FROM chunks WHERE source_id = ?";
+      _checkErr = sqlite3_prepare_v2(imp->db_, sql, -1, &stmt.ref(), nullptr);
+      _checkErr = sqlite3_bind_text(stmt.ref(), 1, sourceId.c_str(), -1, SQLITE_STATIC);
+      _checkErr = sqlite3_step(stmt.ref());
+    }
+    for (const auto &chunk : chunks) {
+      newIds.push_back(insertMetadata(chunk));
+    }
+    if (hasFileInfo) {
+      upsertFileMetadata(sourceId, mtime, fileSize, nofLines, sourceTokens);
+    }
+    commit();
+  } catch (...) {
+    rollback();
+    throw;
+  }
+
+  // Index is touched only after a successful commit, so rolled back ids never reach it.
+  for (size_t i = 0; i < newIds.size(); ++i) {
+    imp->index_->addPoint(embeddings[i].data(), newIds[i], true);
+  }
+  for (size_t id : oldIds) {
+    try {
+      imp->index_->markDelete(id);
+    } catch (const std::runtime_error &e) {
+      LOG_MSG << "Label" << id << "might already be deleted or not exist." << e.what();
+    }
+  }
+  return newIds;
+}
+
 std::vector<SearchResult> HnswSqliteVectorDatabase::search(const std::vector<float> &queryEmbedding, size_t topK) const
 {
   if (queryEmbedding.size() != imp->vectorDim_) {
@@ -113,7 +179,15 @@ std::vector<SearchResult> HnswSqliteVectorDatabase::search(const std::vector<flo
   if (imp->index_->getCurrentElementCount() == 0) {
     return {};
   }
+  static auto &annLatency = LatencyRegistry::stage("ann_search");
+  static auto &hydrationLatency = LatencyRegistry::stage("hydration");
+  auto annStart = std::chrono::steady_clock::now();
   auto result = imp->index_->searchKnn(queryEmbedding.data(), topK);
+  const auto annEnd = std::chrono::steady_clock::now();
+  annLatency.record(annEnd - annStart);
+  if (auto *trace = RequestTrace::current()) trace->add("ann_search", annStart, annEnd);
+
+  ScopedLatency hydration(hydrationLatency, "hydration");
   std::vector<SearchResult> searchResults;
   while (!result.empty()) {
     const auto [distance, label] = result.top();
@@ -222,10 +296,24 @@ void HnswSqliteVectorDatabase::initializeDatabase()
             last_modified INTEGER NOT NULL,
             file_size INTEGER NOT NULL,
             nof_lines INTEGER NOT NULL,
+            token_count INTEGER NOT NULL DEFAULT 0,
             indexed_at DATETIME DEFAULT CURRENT_TIMESTAMP
         )
     )";
     executeSql(filesTable);
+
+    // Databases created before token_count was tracked get the column; their files count as unknown until reindexed.
+    bool hasTokenCount = false;
+    {
+      utils::SqliteStmt stmt;
+      _checkErr = sqlite3_prepare_v2(imp->db_, "PRAGMA table_info(files_metadata)", -1, &stmt.ref(), nullptr);
+      while (sqlite3_step(stmt.ref()) == SQLITE_ROW) {
+        if (std::string_view(reinterpret_cast<const char *>(sqlite3_column_text(stmt.ref(), 1))) == "token_count") hasTokenCount = true;
+      }
+    }
+    if (!hasTokenCount) {
+      executeSql("ALTER TABLE files_metadata ADD COLUMN token_count INTEGER NOT NULL DEFAULT 0");
+    }
   }
   auto files = getTrackedFiles();
   LOG_MSG << "Loaded metadata with" << files.size() << "files";
@@ -281,8 +369,8 @@ size_t HnswSqliteVectorDatabase::insertMetadata(const Chunk &chunk)
   sqlite3_bind_int64(stmt.ref(), k++, chunk.metadata.start);
   sqlite3_bind_int64(stmt.ref(), k++, chunk.metadata.end);
   sqlite3_bind_int64(stmt.ref(), k++, chunk.metadata.tokenCount);
-  sqlite3_bind_text(stmt.ref(), k++, chunk.metadata.unit.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt.ref(), k++, chunk.metadata.type.c_str(), -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt.ref(), k++, Chunker::unitToStr(chunk.metadata.unit), -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt.ref(), k++, Chunker::contentTypeToStr(chunk.metadata.type), -1, SQLITE_STATIC);
   int rc = sqlite3_step(stmt.ref());
   if (rc != SQLITE_DONE) {
     throw std::runtime_error("Failed to insert chunk metadata: " + std::string(sqlite3_errmsg(imp->db_)));
@@ -294,7 +382,7 @@ size_t HnswSqliteVectorDatabase::insertMetadata(const Chunk &chunk)
 std::optional<SearchResult> HnswSqliteVectorDatabase::getChunkData(size_t chunkId) const
 {
   const char *selectSql = R"(
-        SELECT content, source_id, unit, type, start_pos, end_pos
+        SELECT content, source_id, unit, type, start_pos, end_pos, token_count
         FROM chunks WHERE id = ?
     )";
   utils::SqliteStmt stmt;
@@ -310,6 +398,7 @@ std::optional<SearchResult> HnswSqliteVectorDatabase::getChunkData(size_t chunkI
     result.chunkType = reinterpret_cast<const char *>(sqlite3_column_text(stmt.ref(), k++));
     result.start = sqlite3_column_int64(stmt.ref(), k++);
     result.end = sqlite3_column_int64(stmt.ref(), k++);
+    result.tokenCount = sqlite3_column_int64(stmt.ref(), k++);
     found = true;
   }
   return found ? std::optional<SearchResult>(result) : std::nullopt;
@@ -359,15 +448,16 @@ void HnswSqliteVectorDatabase::removeFileMetadata(const std::string &filepath)
   _checkErr = sqlite3_step(stmt.ref());
 }
 
-void HnswSqliteVectorDatabase::upsertFileMetadata(const std::string &filepath, std::time_t mtime, size_t size, size_t lines)
+void HnswSqliteVectorDatabase::upsertFileMetadata(const std::string &filepath, std::time_t mtime, size_t size, size_t lines, size_t tokens)
 {
   utils::SqliteStmt stmt;
-  const char *sql = "INSERT OR REPLACE INTO files_metadata (path, last_modified, file_size, nof_lines) VALUES (?, ?, ?, ?)";
+  const char *sql = "INSERT OR REPLACE INTO files_metadata (path, last_modified, file_size, nof_lines, token_count) VALUES (?, ?, ?, ?, ?)";
   _checkErr = sqlite3_prepare_v2(imp->db_, sql, -1, &stmt.ref(), nullptr);
   _checkErr = sqlite3_bind_text(stmt.ref(), 1, filepath.c_str(), -1, SQLITE_STATIC);
   _checkErr = sqlite3_bind_int64(stmt.ref(), 2, mtime);
   _checkErr = sqlite3_bind_int64(stmt.ref(), 3, size);
   _checkErr = sqlite3_bind_int64(stmt.ref(), 4, lines);
+  _checkErr = sqlite3_bind_int64(stmt.ref(), 5, tokens);
   _checkErr = sqlite3_step(stmt.ref());
 }
 
@@ -376,7 +466,7 @@ std::vector<FileMetadata> HnswSqliteVectorDatabase::getTrackedFiles() const
   std::lock_guard<std::mutex> lock(mutex_);
   std::vector<FileMetadata> files;
   utils::SqliteStmt stmt;
-  const char *sql = "SELECT path, last_modified, file_size, nof_lines FROM files_metadata";
+  const char *sql = "SELECT path, last_modified, file_size, nof_lines, token_count FROM files_metadata";
   _checkErr = sqlite3_prepare_v2(imp->db_, sql, -1, &stmt.ref(), nullptr);
   while (sqlite3_step(stmt.ref()) == SQLITE_ROW) {
     FileMetadata meta;
@@ -384,11 +474,29 @@ std::vector<FileMetadata> HnswSqliteVectorDatabase::getTrackedFiles() const
     meta.lastModified = sqlite3_column_int64(stmt.ref(), 1);
     meta.fileSize = sqlite3_column_int64(stmt.ref(), 2);
     meta.nofLines = sqlite3_column_int64(stmt.ref(), 3);
+    meta.tokenCount = sqlite3_column_int64(stmt.ref(), 4);
     files.push_back(meta);
   }
   return files;
 }
 
+std::optional<FileMetadata> HnswSqliteVectorDatabase::getFileMetadata(const std::string &path) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  utils::SqliteStmt stmt;
+  const char *sql = "SELECT last_modified, file_size, nof_lines, token_count FROM files_metadata WHERE path = ?";
+  _checkErr = sqlite3_prepare_v2(imp->db_, sql, -1, &stmt.ref(), nullptr);
+  _checkErr = sqlite3_bind_text(stmt.ref(), 1, path.c_str(), -1, SQLITE_STATIC);
+  if (sqlite3_step(stmt.ref()) != SQLITE_ROW) return std::nullopt;
+  FileMetadata meta;
+  meta.path = path;
+  meta.lastModified = sqlite3_column_int64(stmt.ref(), 0);
+  meta.fileSize = sqlite3_column_int64(stmt.ref(), 1);
+  meta.nofLines = sqlite3_column_int64(stmt.ref(), 2);
+  meta.tokenCount = sqlite3_column_int64(stmt.ref(), 3);
+  return meta;
+}
+
 std::unordered_map<std::string, size_t> HnswSqliteVectorDatabase::getChunkCountsBySources() const
 {
   std::unordered_map<std::string, size_t> counts;
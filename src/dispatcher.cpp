@@ -0,0 +1,497 @@
+#include "dispatcher.h"
+#include "settings.h"
+#include "latency.h"
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <utils_log/logger.hpp>
+
+
+namespace {
+
+  // A batch whose per-token latency exceeds the best observed one by this factor is treated as congestion.
+  constexpr double CONGESTION_FACTOR = 2.0;
+  constexpr size_t MIN_BATCH_TOKENS = 128;
+  constexpr size_t RETRY_BACKOFF_MS = 200;
+
+  // An endpoint is taken out of rotation after this many consecutive failures,
+  // for a cooldown that doubles with every further failure.
+  constexpr size_t UNHEALTHY_AFTER_FAILURES = 3;
+  constexpr size_t COOLDOWN_BASE_MS = 1000;
+  constexpr size_t COOLDOWN_MAX_MS = 30'000;
+
+  // Extra in-flight slots per endpoint that only queries may use, so that
+  // a saturating ingest never queues interactive requests behind it.
+  constexpr size_t QUERY_RESERVED_SLOTS = 1;
+
+  constexpr size_t NONE = std::numeric_limits<size_t>::max();
+
+  using Clock = std::chrono::steady_clock;
+
+  struct Job {
+    std::vector<size_t> indices;
+    size_t tokens = 0;
+    size_t attempt = 0;
+  };
+
+  // A query text waiting to be coalesced with others. Owned by the waiting caller.
+  struct QueryRequest {
+    const std::string *text = nullptr;
+    std::vector<float> embedding;
+    std::exception_ptr error;
+    bool done = false;
+  };
+
+  struct Endpoint {
+    ApiConfig cfg;
+    size_t outstanding = 0;
+    size_t requests = 0;
+    size_t errors = 0;
+    size_t consecutiveFailures = 0;
+    Clock::time_point downUntil{};
+  };
+
+} // anonymous namespace
+
+
+struct EmbeddingDispatcher::Impl {
+  HttpClientPool *pool_ = nullptr;
+  size_t timeoutMs_ = 10'000;
+  size_t maxBatchTexts_ = 4;
+  size_t maxBatchTokens_ = 2048;
+  size_t maxConcurrency_ = 4; // per endpoint
+  size_t targetLatencyMs_ = 0;
+  size_t retryAttempts_ = 3;
+
+  // Endpoint pool, guarded by poolMutex_.
+  mutable std::mutex poolMutex_;
+  std::condition_variable poolCv_;
+  std::vector<Endpoint> endpoints_;
+  size_t queryWaiters_ = 0;
+
+  // AIMD state, shared across calls so that it converges over a whole ingest.
+  mutable std::mutex stateMutex_;
+  std::atomic<size_t> batchTokens_{ 0 };
+  std::atomic<size_t> concurrency_{ 1 };
+  std::atomic<size_t> inFlight_{ 0 };
+  size_t requests_ = 0;
+  size_t errors_ = 0;
+  size_t retries_ = 0;
+  double bestMsPerToken_ = 0;
+  double avgLatencyMs_ = 0;
+
+  // Query micro-batching. Callers queue their texts; the first one to find no leader
+  // waits out the window, then sends whatever has accumulated on behalf of everyone.
+  size_t queryWindowMs_ = 0;
+  size_t queryBatchMax_ = 16;
+  std::mutex queryMutex_;
+  std::condition_variable queryCv_;
+  std::vector<QueryRequest *> queryPending_;
+  bool queryLeader_ = false;
+  size_t queryBatches_ = 0;
+  size_t queryTexts_ = 0;
+
+  size_t maxWindow() const { return maxConcurrency_ * endpoints_.size(); }
+
+  size_t pickEndpoint(bool query) const;
+  size_t acquire(bool query);
+  void release(size_t ep, bool ok);
+
+  void onSuccess(size_t tokens, double ms);
+  void onError();
+};
+
+// Least outstanding requests among healthy endpoints. If every endpoint is down,
+// the one whose cooldown ends first is probed. Expects poolMutex_ to be locked.
+size_t EmbeddingDispatcher::Impl::pickEndpoint(bool query) const
+{
+  const size_t limit = maxConcurrency_ + (query ? QUERY_RESERVED_SLOTS : 0);
+  const auto now = Clock::now();
+  size_t best = NONE;
+  size_t probe = NONE;
+  bool anyHealthy = false;
+  for (size_t i = 0; i < endpoints_.size(); ++i) {
+    const auto &ep = endpoints_[i];
+    const bool healthy = ep.downUntil <= now;
+    anyHealthy = anyHealthy || healthy;
+    if (limit <= ep.outstanding) continue;
+    if (!healthy) {
+      if (probe == NONE || ep.downUntil < endpoints_[probe].downUntil) probe = i;
+    } else if (best == NONE || ep.outstanding < endpoints_[best].outstanding) {
+      best = i;
+    }
+  }
+  if (best != NONE) return best;
+  return anyHealthy ? NONE : probe;
+}
+
+size_t EmbeddingDispatcher::Impl::acquire(bool query)
+{
+  std::unique_lock<std::mutex> lock(poolMutex_);
+  if (query) queryWaiters_++;
+  size_t ep = NONE;
+  poolCv_.wait(lock, [&]() {
+    if (!query && 0 < queryWaiters_) return false;
+    ep = pickEndpoint(query);
+    return ep != NONE;
+    });
+  if (query) queryWaiters_--;
+  endpoints_[ep].outstanding++;
+  endpoints_[ep].requests++;
+  return ep;
+}
+
+void EmbeddingDispatcher::Impl::release(size_t ep, bool ok)
+{
+  {
+    std::lock_guard<std::mutex> lock(poolMutex_);
+    auto &e = endpoints_[ep];
+    e.outstanding--;
+    if (ok) {
+      e.consecutiveFailures = 0;
+      e.downUntil = {};
+    } else {
+      e.errors++;
+      e.consecutiveFailures++;
+      if (UNHEALTHY_AFTER_FAILURES <= e.consecutiveFailures) {
+        const size_t shift = (std::min)(e.consecutiveFailures - UNHEALTHY_AFTER_FAILURES, size_t(16));
+        const size_t ms = (std::min)(COOLDOWN_BASE_MS << shift, COOLDOWN_MAX_MS);
+        e.downUntil = Clock::now() + std::chrono::milliseconds(ms);
+        LOG_MSG << "Embedding endpoint" << e.cfg.apiUrl << "marked unhealthy for" << ms << "ms";
+      }
+    }
+  }
+  poolCv_.notify_all();
+}
+
+void EmbeddingDispatcher::Impl::onSuccess(size_t tokens, double ms)
+{
+  std::lock_guard<std::mutex> lock(stateMutex_);
+  requests_++;
+  avgLatencyMs_ = (requests_ == 1) ? ms : avgLatencyMs_ * 0.9 + ms * 0.1;
+  const double msPerToken = ms / static_cast<double>((std::max)(tokens, size_t(1)));
+  const bool congested = 0 < bestMsPerToken_ && bestMsPerToken_ * CONGESTION_FACTOR < msPerToken;
+  if (bestMsPerToken_ == 0 || msPerToken < bestMsPerToken_) {
+    bestMsPerToken_ = msPerToken;
+  } else {
+    // Slowly forget the best value so the baseline follows changes on the server side.
+    bestMsPerToken_ = bestMsPerToken_ * 0.99 + msPerToken * 0.01;
+  }
+  const bool slow = 0 < targetLatencyMs_ && static_cast<double>(targetLatencyMs_) < ms;
+
+  size_t c = concurrency_.load();
+  concurrency_ = congested ? (std::max)(size_t(1), c / 2) : (std::min)(maxWindow(), c + 1);
+
+  size_t b = batchTokens_.load();
+  const size_t minTokens = (std::min)(MIN_BATCH_TOKENS, maxBatchTokens_);
+  batchTokens_ = slow ? (std::max)(minTokens, b / 2) : (std::min)(maxBatchTokens_, b + (std::max)(maxBatchTokens_ / 8, size_t(1)));
+}
+
+void EmbeddingDispatcher::Impl::onError()
+{
+  std::lock_guard<std::mutex> lock(stateMutex_);
+  errors_++;
+  concurrency_ = (std::max)(size_t(1), concurrency_.load() / 2);
+  batchTokens_ = (std::max)((std::min)(MIN_BATCH_TOKENS, maxBatchTokens_), batchTokens_.load() / 2);
+}
+
+
+EmbeddingDispatcher::EmbeddingDispatcher(const Settings &s, HttpClientPool &pool) : imp(new Impl)
+{
+  imp->pool_ = &pool;
+  const auto api = s.embeddingCurrentApi();
+  imp->endpoints_.push_back(Endpoint{ api });
+  for (const auto &url : api.replicaUrls) {
+    Endpoint ep{ api };
+    ep.cfg.apiUrl = url;
+    imp->endpoints_.push_back(std::move(ep));
+  }
+  imp->timeoutMs_ = s.embeddingTimeoutMs();
+  imp->maxBatchTexts_ = (std::max)(s.embeddingBatchSize(), size_t(1));
+  imp->maxBatchTokens_ = (std::max)(s.embeddingBatchMaxTokens(), size_t(1));
+  imp->maxConcurrency_ = (std::max)(s.embeddingConcurrency(), size_t(1));
+  imp->targetLatencyMs_ = s.embeddingTargetLatencyMs();
+  imp->retryAttempts_ = s.embeddingRetryAttempts();
+  imp->queryWindowMs_ = s.embeddingQueryBatchWindowMs();
+  imp->queryBatchMax_ = (std::max)(s.embeddingQueryBatchMax(), size_t(1));
+  imp->batchTokens_ = imp->maxBatchTokens_;
+  imp->concurrency_ = imp->endpoints_.size();
+}
+
+EmbeddingDispatcher::~EmbeddingDispatcher()
+{
+}
+
+void EmbeddingDispatcher::embed(
+  const std::vector<std::string> &texts,
+  const std::vector<size_t> &tokenCounts,
+  std::vector<std::vector<float>> &embeddings,
+  EmbeddingClient::EncodeType et,
+  std::function<void(size_t, size_t)> onProgress) const
+{
+  if (et == EmbeddingClient::EncodeType::Query) {
+    static auto &latency = LatencyRegistry::stage("query_embed");
+    ScopedLatency timer(latency, "query_embed");
+    if (0 < imp->queryWindowMs_ && texts.size() < imp->queryBatchMax_) {
+      embedQueries(texts, embeddings);
+      if (onProgress) onProgress(texts.size(), texts.size());
+    } else {
+      embedNow(texts, tokenCounts, embeddings, et, onProgress);
+    }
+    return;
+  }
+  embedNow(texts, tokenCounts, embeddings, et, onProgress);
+}
+
+void EmbeddingDispatcher::embedQueries(const std::vector<std::string> &texts, std::vector<std::vector<float>> &embeddings) const
+{
+  embeddings.assign(texts.size(), {});
+  if (texts.empty()) return;
+
+  std::vector<QueryRequest> mine(texts.size());
+  for (size_t i = 0; i < texts.size(); ++i) {
+    mine[i].text = &texts[i];
+  }
+  auto allDone = [&]() {
+    return std::all_of(mine.begin(), mine.end(), [](const QueryRequest &r) { return r.done; });
+    };
+
+  std::unique_lock<std::mutex> lock(imp->queryMutex_);
+  for (auto &r : mine) imp->queryPending_.push_back(&r);
+  imp->queryCv_.notify_all();
+
+  while (!allDone()) {
+    if (imp->queryLeader_ || imp->queryPending_.empty()) {
+      imp->queryCv_.wait(lock, [&]() {
+        return allDone() || (!imp->queryLeader_ && !imp->queryPending_.empty());
+        });
+      continue;
+    }
+
+    imp->queryLeader_ = true;
+    const auto deadline = Clock::now() + std::chrono::milliseconds(imp->queryWindowMs_);
+    imp->queryCv_.wait_until(lock, deadline, [&]() { return imp->queryBatchMax_ <= imp->queryPending_.size(); });
+    const size_t take = (std::min)(imp->queryBatchMax_, imp->queryPending_.size());
+    std::vector<QueryRequest *> batch(imp->queryPending_.begin(), imp->queryPending_.begin() + take);
+    imp->queryPending_.erase(imp->queryPending_.begin(), imp->queryPending_.begin() + take);
+    imp->queryLeader_ = false;
+    imp->queryBatches_++;
+    imp->queryTexts_ += take;
+    imp->queryCv_.notify_all(); // leftovers can elect the next leader right away
+    lock.unlock();
+
+    std::vector<std::string> batchTexts;
+    batchTexts.reserve(batch.size());
+    for (auto *r : batch) batchTexts.push_back(*r->text);
+    std::vector<std::vector<float>> result;
+    std::exception_ptr error;
+    try {
+      embedNow(batchTexts, {}, result, EmbeddingClient::EncodeType::Query, nullptr);
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    lock.lock();
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (error) batch[i]->error = error;
+      else batch[i]->embedding = std::move(result[i]);
+      batch[i]->done = true;
+    }
+    imp->queryCv_.notify_all();
+  }
+  lock.unlock();
+
+  for (size_t i = 0; i < mine.size(); ++i) {
+    if (mine[i].error) std::rethrow_exception(mine[i].error);
+    embeddings[i] = std::move(mine[i].embedding);
+  }
+}
+
+void EmbeddingDispatcher::embedNow(
+  const std::vector<std::string> &texts,
+  const std::vector<size_t> &tokenCounts,
+  std::vector<std::vector<float>> &embeddings,
+  EmbeddingClient::EncodeType et,
+  std::function<void(size_t, size_t)> onProgress) const
+{
+  const size_t n = texts.size();
+  embeddings.assign(n, {});
+  if (n == 0) return;
+
+  const bool query = et == EmbeddingClient::EncodeType::Query;
+
+  auto tokensOf = [&](size_t i) {
+    return i < tokenCounts.size() ? tokenCounts[i] : texts[i].size() / 4 + 1;
+    };
+
+  std::mutex m;
+  std::condition_variable cv;
+  size_t cursor = 0;
+  size_t done = 0;
+  size_t active = 0;
+  std::deque<Job> retryQueue;
+  std::exception_ptr failure;
+
+  // Forms the next batch from the cursor using the current token budget. Expects m to be locked.
+  auto nextJob = [&]() {
+    if (!retryQueue.empty()) {
+      Job job = std::move(retryQueue.front());
+      retryQueue.pop_front();
+      return job;
+    }
+    Job job;
+    const size_t budget = imp->batchTokens_.load();
+    while (cursor < n && job.indices.size() < imp->maxBatchTexts_) {
+      const size_t t = tokensOf(cursor);
+      if (!job.indices.empty() && budget < job.tokens + t) break;
+      job.indices.push_back(cursor++);
+      job.tokens += t;
+    }
+    return job;
+    };
+
+  auto worker = [&]() {
+    // One client per endpoint, created on first use.
+    std::vector<std::unique_ptr<EmbeddingClient>> clients(imp->endpoints_.size());
+    while (true) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(m);
+        auto hasWork = [&]() { return !retryQueue.empty() || cursor < n; };
+        cv.wait(lock, [&]() {
+          return failure || (!hasWork() && active == 0) || (hasWork() && active < imp->concurrency_.load());
+          });
+        if (failure || !hasWork()) break;
+        job = nextJob();
+        active++;
+      }
+      cv.notify_all();
+
+      std::vector<std::string> batch;
+      batch.reserve(job.indices.size());
+      for (auto i : job.indices) batch.push_back(texts[i]);
+
+      std::vector<std::vector<float>> result;
+      std::exception_ptr error;
+      const size_t ep = imp->acquire(query);
+      imp->inFlight_++;
+      const auto start = Clock::now();
+      try {
+        if (!clients[ep]) clients[ep] = std::make_unique<EmbeddingClient>(imp->endpoints_[ep].cfg, imp->timeoutMs_, *imp->pool_);
+        clients[ep]->generateEmbeddings(batch, result, et);
+        if (result.size() != batch.size()) {
+          throw std::runtime_error("Embedding count mismatch");
+        }
+      } catch (...) {
+        error = std::current_exception();
+      }
+      const std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+      imp->inFlight_--;
+      imp->release(ep, !error);
+
+      if (!error) {
+        imp->onSuccess(job.tokens, elapsed.count());
+      } else {
+        imp->onError();
+        if (job.attempt < imp->retryAttempts_) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(RETRY_BACKOFF_MS << job.attempt));
+        }
+      }
+
+      size_t nDone = 0;
+      {
+        std::lock_guard<std::mutex> lock(m);
+        active--;
+        if (!error) {
+          for (size_t k = 0; k < job.indices.size(); ++k) {
+            embeddings[job.indices[k]] = std::move(result[k]);
+          }
+          done += job.indices.size();
+          nDone = done;
+        } else if (job.attempt < imp->retryAttempts_) {
+          {
+            std::lock_guard<std::mutex> stateLock(imp->stateMutex_);
+            imp->retries_++;
+          }
+          // Oversized batches are a common failure cause, so retry them as two halves.
+          if (1 < job.indices.size()) {
+            const size_t half = job.indices.size() / 2;
+            Job a, b;
+            a.indices.assign(job.indices.begin(), job.indices.begin() + half);
+            b.indices.assign(job.indices.begin() + half, job.indices.end());
+            for (auto i : a.indices) a.tokens += tokensOf(i);
+            for (auto i : b.indices) b.tokens += tokensOf(i);
+            a.attempt = b.attempt = job.attempt + 1;
+            retryQueue.push_back(std::move(a));
+            retryQueue.push_back(std::move(b));
+          } else {
+            job.attempt++;
+            retryQueue.push_back(std::move(job));
+          }
+        } else if (!failure) {
+          failure = error;
+        }
+      }
+      cv.notify_all();
+      if (nDone && onProgress) onProgress(nDone, n);
+    }
+    };
+
+  // Workers are cheap compared to the HTTP round trips, but don't spawn more than there can be batches.
+  const size_t estBatches = (n + imp->maxBatchTexts_ - 1) / imp->maxBatchTexts_;
+  const size_t nofWorkers = (std::min)(imp->maxWindow(), estBatches);
+  if (nofWorkers <= 1) {
+    worker();
+  } else {
+    std::vector<std::thread> threads;
+    threads.reserve(nofWorkers);
+    for (size_t i = 0; i < nofWorkers; ++i) {
+      threads.emplace_back(worker);
+    }
+    for (auto &t : threads) t.join();
+  }
+
+  if (failure) {
+    std::rethrow_exception(failure);
+  }
+}
+
+void EmbeddingDispatcher::embed(const std::string &text, std::vector<float> &embedding, EmbeddingClient::EncodeType et) const
+{
+  std::vector<std::vector<float>> embs;
+  embed(std::vector<std::string>{ text }, {}, embs, et);
+  if (!embs.empty()) embedding = std::move(embs.front());
+}
+
+EmbeddingDispatcher::Stats EmbeddingDispatcher::stats() const
+{
+  Stats s;
+  {
+    std::lock_guard<std::mutex> lock(imp->stateMutex_);
+    s.batchTokens = imp->batchTokens_.load();
+    s.concurrency = imp->concurrency_.load();
+    s.inFlight = imp->inFlight_.load();
+    s.requests = imp->requests_;
+    s.errors = imp->errors_;
+    s.retries = imp->retries_;
+    s.avgLatencyMs = imp->avgLatencyMs_;
+  }
+  {
+    std::lock_guard<std::mutex> lock(imp->queryMutex_);
+    s.queryBatches = imp->queryBatches_;
+    s.queryTexts = imp->queryTexts_;
+  }
+  std::lock_guard<std::mutex> lock(imp->poolMutex_);
+  const auto now = Clock::now();
+  for (const auto &ep : imp->endpoints_) {
+    s.endpoints.push_back({ ep.cfg.apiUrl, ep.outstanding, ep.requests, ep.errors, ep.downUntil <= now });
+  }
+  return s;
+}
@@ -0,0 +1,116 @@
+#include "fimcache.h"
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <functional>
+#include <algorithm>
+
+
+namespace {
+
+  // Characters of the prefix, right before the cursor, that identify where a completion was made.
+  constexpr size_t TAIL_LEN = 64;
+  // Longer completions aren't worth keeping, typing along them rarely goes that far.
+  constexpr size_t MAX_COMPLETION_LEN = 2048;
+
+  std::string_view tailOf(std::string_view prefix) {
+    return prefix.substr(prefix.size() - (std::min)(prefix.size(), TAIL_LEN));
+  }
+
+  size_t combine(size_t seed, size_t h) {
+    return seed ^ (h + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+  }
+
+  size_t keyOf(std::string_view scope, size_t suffixHash, std::string_view tail) {
+    std::hash<std::string_view> hasher;
+    return combine(combine(hasher(scope), suffixHash), hasher(tail));
+  }
+
+} // anonymous namespace
+
+
+struct FimCache::Impl {
+  struct Entry {
+    size_t key = 0;
+    std::string scope;
+    std::string tail;
+    size_t suffixHash = 0;
+    std::string completion;
+  };
+
+  size_t capacity_ = 0;
+  mutable std::mutex mutex_;
+  std::list<Entry> lru_; // most recently used first
+  std::unordered_map<size_t, std::list<Entry>::iterator> index_;
+  size_t maxCompletionLen_ = 0;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+};
+
+
+FimCache::FimCache(size_t capacity) : imp(new Impl)
+{
+  imp->capacity_ = capacity;
+}
+
+FimCache::~FimCache() = default;
+
+std::optional<std::string> FimCache::lookup(std::string_view scope, std::string_view prefix, std::string_view suffix)
+{
+  if (imp->capacity_ == 0) return std::nullopt;
+  const size_t suffixHash = std::hash<std::string_view>{}(suffix);
+
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  // Try each split of the prefix into (old prefix, typed), typed being at most a completion long.
+  const size_t maxTyped = (std::min)(prefix.size(), imp->maxCompletionLen_);
+  for (size_t typedLen = 0; typedLen <= maxTyped; ++typedLen) {
+    const std::string_view old = prefix.substr(0, prefix.size() - typedLen);
+    const std::string_view tail = tailOf(old);
+    auto it = imp->index_.find(keyOf(scope, suffixHash, tail));
+    if (it == imp->index_.end()) continue;
+
+    const auto &e = *it->second;
+    if (e.scope != scope || e.suffixHash != suffixHash || e.tail != tail) continue;
+    const std::string_view typed = prefix.substr(prefix.size() - typedLen);
+    if (e.completion.size() <= typedLen || !std::string_view(e.completion).starts_with(typed)) continue;
+
+    imp->lru_.splice(imp->lru_.begin(), imp->lru_, it->second);
+    ++imp->hits_;
+    return e.completion.substr(typedLen);
+  }
+  ++imp->misses_;
+  return std::nullopt;
+}
+
+void FimCache::store(std::string_view scope, std::string_view prefix, std::string_view suffix, const std::string &completion)
+{
+  if (imp->capacity_ == 0 || completion.empty() || MAX_COMPLETION_LEN < completion.size()) return;
+  const size_t suffixHash = std::hash<std::string_view>{}(suffix);
+  const std::string_view tail = tailOf(prefix);
+  const size_t key = keyOf(scope, suffixHash, tail);
+
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  auto it = imp->index_.find(key);
+  if (it != imp->index_.end()) {
+    imp->lru_.erase(it->second);
+    imp->index_.erase(it);
+  }
+  imp->lru_.push_front({ key, std::string(scope), std::string(tail), suffixHash, completion });
+  imp->index_[key] = imp->lru_.begin();
+  imp->maxCompletionLen_ = (std::max)(imp->maxCompletionLen_, completion.size());
+
+  while (imp->capacity_ < imp->lru_.size()) {
+    imp->index_.erase(imp->lru_.back().key);
+    imp->lru_.pop_back();
+  }
+}
+
+FimCache::Stats FimCache::stats() const
+{
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  Stats s;
+  s.entries = imp->lru_.size();
+  s.hits = imp->hits_;
+  s.misses = imp->misses_;
+  return s;
+}
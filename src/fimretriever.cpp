@@ -0,0 +1,261 @@
+#include "fimretriever.h"
+#include "app.h"
+#include "database.h"
+#include "dispatcher.h"
+#include "settings.h"
+#include "sourceproc.h"
+#include "tokenizer.h"
+#include "latency.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utils_log/logger.hpp>
+
+
+namespace {
+
+  using Clock = std::chrono::steady_clock;
+
+  // Cursor-local query: the end of the prefix and the start of the suffix.
+  constexpr size_t WINDOW_PREFIX_CHARS = 1024;
+  constexpr size_t WINDOW_SUFFIX_CHARS = 256;
+  // Best chunks taken from the edited file, from each related file and from the global index.
+  constexpr size_t FILE_CHUNKS = 2;
+  constexpr size_t RELATED_CHUNKS = 1;
+  constexpr size_t SEARCH_CHUNKS = 2;
+  // Files whose chunk vectors are kept around.
+  constexpr size_t MAX_CACHED_FILES = 64;
+
+  std::string cursorWindow(std::string_view prefix, std::string_view suffix) {
+    std::string_view head = prefix.substr(prefix.size() - (std::min)(prefix.size(), WINDOW_PREFIX_CHARS));
+    std::string_view tail = suffix.substr(0, (std::min)(suffix.size(), WINDOW_SUFFIX_CHARS));
+    // Don't start or end mid-line.
+    if (head.size() < prefix.size()) {
+      auto nl = head.find('\n');
+      if (nl != std::string_view::npos) head.remove_prefix(nl + 1);
+    }
+    if (tail.size() < suffix.size()) {
+      auto nl = tail.rfind('\n');
+      if (nl != std::string_view::npos) tail = tail.substr(0, nl);
+    }
+    std::string window;
+    window.reserve(head.size() + tail.size());
+    window.append(head).append(tail);
+    return window;
+  }
+
+  float cosine(const std::vector<float> &a, const std::vector<float> &b) {
+    const size_t n = (std::min)(a.size(), b.size());
+    float dot = 0, na = 0, nb = 0;
+    for (size_t i = 0; i < n; ++i) {
+      dot += a[i] * b[i];
+      na += a[i] * a[i];
+      nb += b[i] * b[i];
+    }
+    return (0 < na && 0 < nb) ? dot / std::sqrt(na * nb) : 0.0f;
+  }
+
+  // Per-source entries, evicting the least recently used one once MAX_CACHED_FILES are held.
+  // The file being edited is looked up on every request, so it stays.
+  template <typename V>
+  class SourceLru {
+  public:
+    V *find(const std::string &src) {
+      auto it = index_.find(src);
+      if (it == index_.end()) return nullptr;
+      lru_.splice(lru_.begin(), lru_, it->second);
+      return &it->second->second;
+    }
+
+    void put(const std::string &src, V v) {
+      if (auto *e = find(src)) {
+        *e = std::move(v);
+        return;
+      }
+      lru_.emplace_front(src, std::move(v));
+      index_.emplace(lru_.front().first, lru_.begin());
+      if (MAX_CACHED_FILES < lru_.size()) {
+        index_.erase(lru_.back().first);
+        lru_.pop_back();
+      }
+    }
+
+  private:
+    std::list<std::pair<std::string, V>> lru_; // most recently used first
+    std::unordered_map<std::string_view, typename std::list<std::pair<std::string, V>>::iterator> index_; // views the keys in lru_
+  };
+
+} // anonymous namespace
+
+
+struct FimRetriever::Impl {
+  // Chunks of one source with their vectors, as of the chunk ids they were loaded for.
+  struct FileChunks {
+    std::vector<size_t> ids;
+    std::vector<SearchResult> chunks;
+    std::vector<std::vector<float>> vectors;
+    std::vector<size_t> tokens; // by the default tokenizer
+  };
+
+  struct Related {
+    size_t stamp = 0;
+    std::vector<std::string> sources;
+  };
+
+  const App &app_;
+  mutable std::mutex mutex_;
+  mutable SourceLru<std::shared_ptr<const FileChunks>> files_;
+  mutable SourceLru<Related> related_;
+
+  explicit Impl(const App &a) : app_(a) {}
+
+  // Chunk ids change whenever a source is re-indexed, so they double as the cache key's version.
+  std::shared_ptr<const FileChunks> fileChunks(const std::string &src) const {
+    auto ids = app_.db().getChunkIdsBySource(src);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto *cached = files_.find(src);
+      if (cached && (*cached)->ids == ids) return *cached;
+    }
+    auto fc = std::make_shared<FileChunks>();
+    for (auto id : ids) {
+      auto data = app_.db().getChunkData(id);
+      if (!data) continue;
+      data->chunkId = id;
+      fc->tokens.push_back(data->tokenCount != std::string::npos ? data->tokenCount : app_.tokenizer().countTokensWithVocab(data->content));
+      fc->vectors.push_back(app_.db().getEmbeddingVector(id));
+      fc->chunks.push_back(std::move(*data));
+    }
+    fc->ids = std::move(ids);
+    std::lock_guard<std::mutex> lock(mutex_);
+    files_.put(src, fc);
+    return fc;
+  }
+
+  // Related sources only change when the tracked file set does, i.e. after an index update.
+  std::vector<std::string> relatedSources(const std::string &src) const {
+    const size_t stamp = app_.lastUpdateTimestamp();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto *cached = related_.find(src);
+      if (cached && cached->stamp == stamp) return cached->sources;
+    }
+    std::vector<std::string> tracked;
+    for (const auto &tf : app_.db().getTrackedFiles()) {
+      tracked.push_back(tf.path);
+    }
+    auto sources = app_.sourceProcessor().filterRelatedSources(tracked, src);
+    std::lock_guard<std::mutex> lock(mutex_);
+    related_.put(src, { stamp, sources });
+    return sources;
+  }
+};
+
+
+FimRetriever::FimRetriever(const App &app) : imp(new Impl(app))
+{
+}
+
+FimRetriever::~FimRetriever() = default;
+
+FimRetriever::Result FimRetriever::retrieve(
+  const ApiConfig &apiConfig,
+  std::string_view prefix,
+  std::string_view suffix,
+  const std::string &filename,
+  float contextSizeRatio,
+  size_t budgetMs) const
+{
+  const auto &app = imp->app_;
+  const auto deadline = Clock::now() + std::chrono::milliseconds(budgetMs);
+  Result res;
+
+  auto stage = [&](const char *name, auto &&body) {
+    Stage st{ name };
+    const auto start = Clock::now();
+    if (deadline <= start) {
+      st.skipped = true;
+    } else {
+      body();
+      const auto end = Clock::now();
+      st.ms = std::chrono::duration<double, std::milli>(end - start).count();
+      const std::string stageName = std::string("fim_") + name;
+      LatencyRegistry::stage(stageName).record(st.ms);
+      if (auto *trace = RequestTrace::current()) trace->add(stageName, start, end);
+    }
+    res.stages.push_back(st);
+    };
+
+  // The budget is in the target model's tokens; stored counts are in the default tokenizer's.
+  const auto &tok = app.tokenizer(apiConfig);
+  const bool storedCounts = &tok == &app.tokenizer();
+  // The model sees prefix and suffix anyway; an estimate is enough to size what is left.
+  const auto maxTokenBudget = static_cast<size_t>(apiConfig.contextLength * std::clamp(contextSizeRatio, 0.1f, 1.0f));
+  res.usedTokens = tok.estimateTokenCount(prefix) + tok.estimateTokenCount(suffix);
+  const size_t maxChunks = app.settings().generationMaxChunks();
+
+  auto take = [&](const SearchResult &chunk, size_t storedTokens) {
+    if (maxChunks <= res.results.size()) return false;
+    // Skip what the model already gets as prefix or suffix.
+    if (prefix.find(chunk.content) != std::string_view::npos || suffix.find(chunk.content) != std::string_view::npos) return false;
+    for (const auto &r : res.results) {
+      if (r.chunkId == chunk.chunkId) return false;
+    }
+    const size_t tokens = storedCounts && storedTokens != std::string::npos ? storedTokens : tok.countTokensWithVocab(chunk.content);
+    if (maxTokenBudget < res.usedTokens + tokens) return false;
+    res.usedTokens += tokens;
+    res.results.push_back(chunk);
+    res.results.back().tokenCount = tokens;
+    res.results.back().countedBy = &tok;
+    return true;
+    };
+
+  auto takeBest = [&](const Impl::FileChunks &fc, const std::vector<float> &query, size_t n) {
+    std::vector<std::pair<float, size_t>> ranked;
+    ranked.reserve(fc.chunks.size());
+    for (size_t i = 0; i < fc.chunks.size(); ++i) {
+      ranked.emplace_back(cosine(query, fc.vectors[i]), i);
+    }
+    std::sort(ranked.begin(), ranked.end(), std::greater<>());
+    for (const auto &[score, i] : ranked) {
+      if (n == 0 || deadline <= Clock::now()) break;
+      auto chunk = fc.chunks[i];
+      chunk.similarityScore = score;
+      if (take(chunk, fc.tokens[i])) --n;
+    }
+    };
+
+  std::string window;
+  stage("window", [&]() { window = cursorWindow(prefix, suffix); });
+
+  std::vector<float> query;
+  if (!window.empty()) {
+    stage("embed", [&]() { app.embedder().embed(window, query, EmbeddingClient::EncodeType::Query); });
+  }
+  if (query.empty()) return res;
+
+  if (!filename.empty()) {
+    stage("file", [&]() { takeBest(*imp->fileChunks(filename), query, FILE_CHUNKS); });
+    stage("related", [&]() {
+      for (const auto &rel : imp->relatedSources(filename)) {
+        if (deadline <= Clock::now()) break;
+        takeBest(*imp->fileChunks(rel), query, RELATED_CHUNKS);
+      }
+      });
+  }
+
+  stage("search", [&]() {
+    size_t n = SEARCH_CHUNKS;
+    for (const auto &r : app.db().search(query, app.settings().embeddingTopK())) {
+      if (n == 0) break;
+      if (r.sourceId == filename) continue;
+      if (take(r, r.tokenCount)) --n;
+    }
+    });
+
+  return res;
+}
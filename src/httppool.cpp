@@ -0,0 +1,140 @@
+#include "httppool.h"
+#include <stdexcept>
+#include <mutex>
+#include <unordered_map>
+#include <httplib.h>
+#include <utils_log/logger.hpp>
+
+
+struct HttpClientPool::Impl {
+  size_t maxIdlePerHost_ = 4;
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, std::vector<std::unique_ptr<httplib::Client>>> idle_;
+  size_t leased_ = 0;
+  size_t created_ = 0;
+  size_t reused_ = 0;
+};
+
+
+HttpClientPool::Lease::Lease(Lease &&other) noexcept
+  : pool_(other.pool_), key_(std::move(other.key_)), path_(std::move(other.path_)),
+    client_(std::move(other.client_)), reusable_(other.reusable_)
+{
+  other.pool_ = nullptr;
+}
+
+HttpClientPool::Lease &HttpClientPool::Lease::operator=(Lease &&other) noexcept
+{
+  if (this != &other) {
+    release();
+    pool_ = other.pool_;
+    key_ = std::move(other.key_);
+    path_ = std::move(other.path_);
+    client_ = std::move(other.client_);
+    reusable_ = other.reusable_;
+    other.pool_ = nullptr;
+  }
+  return *this;
+}
+
+HttpClientPool::Lease::~Lease()
+{
+  release();
+}
+
+void HttpClientPool::Lease::release()
+{
+  if (pool_ && client_) {
+    pool_->giveBack(key_, std::move(client_), reusable_);
+  }
+  pool_ = nullptr;
+}
+
+
+HttpClientPool::HttpClientPool(size_t maxIdlePerHost) : imp(new Impl)
+{
+  imp->maxIdlePerHost_ = maxIdlePerHost;
+}
+
+HttpClientPool::~HttpClientPool()
+{
+}
+
+std::pair<std::string, std::string> HttpClientPool::splitUrl(const std::string &url)
+{
+  size_t protocolEnd = url.find("://");
+  if (protocolEnd == std::string::npos) {
+    throw std::runtime_error("Invalid server URL format");
+  }
+  size_t hostStart = protocolEnd + 3;
+  size_t pathStart = url.find("/", hostStart);
+  if (pathStart == std::string::npos) {
+    pathStart = url.size();
+  }
+  return { url.substr(0, pathStart), url.substr(pathStart) };
+}
+
+HttpClientPool::Lease HttpClientPool::acquire(const std::string &url, size_t timeoutMs)
+{
+  auto [schemaHostPort, path] = splitUrl(url);
+  Lease lease;
+  lease.pool_ = this;
+  lease.key_ = schemaHostPort;
+  lease.path_ = std::move(path);
+  {
+    std::lock_guard<std::mutex> lock(imp->mutex_);
+    auto it = imp->idle_.find(schemaHostPort);
+    if (it != imp->idle_.end() && !it->second.empty()) {
+      lease.client_ = std::move(it->second.back());
+      it->second.pop_back();
+      imp->reused_++;
+    }
+    imp->leased_++;
+  }
+  if (!lease.client_) {
+    try {
+      lease.client_ = std::make_unique<httplib::Client>(schemaHostPort);
+      lease.client_->set_keep_alive(true);
+    } catch (const std::exception &e) {
+      LOG_MSG << "Error initializing http client for" << schemaHostPort << ":" << e.what();
+    }
+    std::lock_guard<std::mutex> lock(imp->mutex_);
+    if (lease.client_) {
+      imp->created_++;
+    } else {
+      imp->leased_--;
+      lease.pool_ = nullptr;
+    }
+  }
+  if (lease.client_) {
+    // Timeouts belong to the caller, not to the pooled connection.
+    lease.client_->set_connection_timeout(0, timeoutMs * 1000);
+    lease.client_->set_read_timeout(timeoutMs / 1000, (timeoutMs % 1000) * 1000);
+  }
+  return lease;
+}
+
+void HttpClientPool::giveBack(const std::string &key, std::unique_ptr<httplib::Client> client, bool reusable)
+{
+  std::unique_ptr<httplib::Client> dropped;
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  imp->leased_--;
+  auto &idle = imp->idle_[key];
+  if (reusable && idle.size() < imp->maxIdlePerHost_) {
+    idle.push_back(std::move(client));
+  } else {
+    dropped = std::move(client);
+  }
+}
+
+HttpClientPool::Stats HttpClientPool::stats() const
+{
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  Stats s;
+  s.hosts = imp->idle_.size();
+  for (const auto &[_, v] : imp->idle_) s.idle += v.size();
+  s.leased = imp->leased_;
+  s.created = imp->created_;
+  s.reused = imp->reused_;
+  return s;
+}
@@ -4,8 +4,15 @@
 #include "sourceproc.h"
 #include "database.h"
 #include "inference.h"
+#include "dispatcher.h"
+#include "httppool.h"
+#include "fimcache.h"
+#include "fimretriever.h"
+#include "workerpool.h"
+#include "latency.h"
 #include "settings.h"
 #include "tokenizer.h"
+#include "cutils.h"
 #include "instregistry.h"
 #include "auth.h"
 #include "3rdparty/base64.h"
@@ -21,9 +28,15 @@
 #include <string>
 #include <atomic>
 #include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <array>
 #include <string_view>
 //#include <format>
 #include <filesystem>
+#include <fstream>
+#include <cmath>
 #include "3rdparty/fmt/core.h"
 
 using json = nlohmann::json;
@@ -55,30 +68,6 @@ using socket_t = int;
 
 namespace {
 
-  std::string truncateToTokens(const SimpleTokenizer &t, const std::string &s, size_t maxTokens) {
-    std::string res{ s };
-
-    auto tokens = t.countTokensWithVocab(res);
-    if (tokens <= maxTokens) return res;
-
-    Chunker chunker(t, 1, 50, 0.f);
-
-    auto chunks = chunker.chunkText(res, {}, false);
-
-    size_t end = 0;
-    size_t tokensSoFar = 0;
-    for (const auto &chunk : chunks) {
-      if (maxTokens < chunk.metadata.tokenCount + tokensSoFar) {
-        assert(chunk.metadata.unit == "char");
-        end = chunk.metadata.end;
-        break;
-      }
-      tokensSoFar += chunk.metadata.tokenCount;
-    }
-    res = res.substr(0, end);
-    return res;
-  }
-
   size_t suffixPrefixMatch(const std::string &a, const std::string &b) {
     size_t maxLen = std::min(a.size(), b.size());
     for (size_t len = maxLen; len > 0; --len)
@@ -137,24 +126,38 @@ namespace {
     return std::clamp(std::clamp(neighbors, size_t(minChunks), size_t(maxChunks)), size_t(1), size_t(101));
   }
 
-  bool isWithinThreshold(const App &app, const std::string &content, size_t maxTokenBudget, size_t usedTokens, float thresholdRatio, size_t *pTokens = nullptr) {
+  // Token count of a fetched source by tok: the one stored when it was indexed, as long as the
+  // file still has the indexed size and tok is the one it was indexed with, otherwise it is counted.
+  size_t sourceTokens(const App &app, const SimpleTokenizer &tok, const std::string &src, const std::string &content) {
+    // The stored count is trusted only while the file is as it was indexed; an edit can keep its size.
+    if (&tok == &app.tokenizer()) {
+      if (auto meta = app.db().getFileMetadata(src); meta && 0 < meta->tokenCount && meta->fileSize == content.size() &&
+        0 < meta->lastModified && meta->lastModified == utils::getFileModificationTime(src)) {
+        return meta->tokenCount;
+      }
+    }
+    static auto &latency = LatencyRegistry::stage("tokenize");
+    ScopedLatency timer(latency, "tokenize");
+    return tok.countTokensWithVocab(content);
+  }
+
+  bool isWithinThreshold(const App &app, size_t tokens, size_t maxTokenBudget, size_t usedTokens, float thresholdRatio) {
     const auto excerptBudget = maxTokenBudget - usedTokens;
     if (excerptBudget <= 0) return false;
     const auto avgChunkTokens = app.settings().chunkingMaxTokens();
-    const auto tokens = app.tokenizer().countTokensWithVocab(content);
-    if (pTokens) *pTokens = tokens;
     auto threshold = (std::max)(static_cast<size_t>(excerptBudget * thresholdRatio), avgChunkTokens);
     return tokens <= threshold;
   }
 
-  bool processContent(const App &app, std::string &content, const std::string &src, size_t chunkId, size_t maxTokenBudget, size_t &usedTokens) {
+  // Fits content, or an excerpt of it, into what is left of the budget; contentTokens is what it takes.
+  bool processContent(const App &app, const SimpleTokenizer &tok, std::string &content, const std::string &src, size_t chunkId, size_t maxTokenBudget, size_t usedTokens, size_t &contentTokens) {
     const auto excerptBudget = maxTokenBudget - usedTokens;
     if (excerptBudget <= 0) return false;
     // If the source file of the best chunk is too large then we fetch an excerpt of it instead.
     const auto avgChunkTokens = app.settings().chunkingMaxTokens();    
     float thresholdRatio = app.settings().generationExcerptThresholdRatio();
-    size_t contentTokens = 0;
-    if (!isWithinThreshold(app, content, maxTokenBudget, usedTokens, thresholdRatio, &contentTokens)) {
+    contentTokens = sourceTokens(app, tok, src, content);
+    if (!isWithinThreshold(app, contentTokens, maxTokenBudget, usedTokens, thresholdRatio)) {
       if (!app.settings().generationExcerptEnabled()) {
         return false;
       }
@@ -175,9 +178,9 @@ namespace {
         }
       }
       content = stitchChunks(chunkhood); // Also removes overlaps
-      contentTokens = app.tokenizer().countTokensWithVocab(content);
+      // The neighbour count is an estimate, the cut makes the excerpt fit exactly.
+      content.resize(tok.prefixWithinTokens(content, excerptBudget, &contentTokens));
     }
-    usedTokens += contentTokens;
     return true;
   }
 
@@ -238,7 +241,7 @@ namespace {
     return a;
   }
 
-  void addToSearchResult(std::vector<SearchResult> &v, const std::string &src, const std::string &content) {
+  void addToSearchResult(std::vector<SearchResult> &v, const std::string &src, const std::string &content, const SimpleTokenizer &tok, size_t tokens) {
     assert(!content.empty());
     if (!content.empty()) {
       v.push_back({
@@ -249,16 +252,14 @@ namespace {
           std::string::npos,
           0,
           content.length(),
-          1.0f
+          1.0f,
+          0,
+          tokens,
+          &tok
         });
     }
   }
 
-  struct Attachment {
-    std::string filename;
-    std::string content;
-  };
-
   std::vector<Attachment> parseAttachments(const json &attachmentsJson) {
     std::vector<Attachment> res;
     if (!attachmentsJson.is_array()) return res;
@@ -280,16 +281,6 @@ namespace {
     return res;
   }
 
-  void recordDuration(const std::chrono::steady_clock::time_point &start, std::atomic<double> &v) {
-    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
-    double newSearchTimeMs = duration.count() * 1000.0;
-    double oldVal = v.load();
-    double newVal;
-    do {
-      newVal = oldVal * 0.9 + newSearchTimeMs * 0.1;
-    } while (!v.compare_exchange_weak(oldVal, newVal));
-  }
-
   std::optional<std::pair<std::string, std::string>> extractPassword(const httplib::Request &req) {
     try {
       auto header = req.get_header_value("Authorization");
@@ -340,6 +331,7 @@ namespace {
     std::function<void(std::string_view)> onInfo
   ) {
     if (!onInfo) onInfo = [](std::string_view) {};
+    TraceSpan retrievalSpan("retrieval");
     // Preferred order
     std::vector<SearchResult> attachmentResults;
     std::vector<SearchResult> fullSourceResults;
@@ -358,7 +350,10 @@ namespace {
     }
 
     //onInfo(fmt::format("Context token budget:", ((maxTokenBudget % 1000) == 0) ? std::to_string(maxTokenBudget) + "k" : std::to_string(maxTokenBudget)));
-    const size_t questionTokens = app.tokenizer().countTokensWithVocab(question);
+    // The budget is in the target model's tokens; stored counts are in the default tokenizer's.
+    const auto &tok = app.tokenizer(apiConfig);
+    const bool storedCounts = &tok == &app.tokenizer();
+    const size_t questionTokens = tok.countTokensWithVocab(question);
     size_t usedTokens = questionTokens;
 
     LOG_MSG << "Total context budget:" << maxTokenBudget;
@@ -366,39 +361,13 @@ namespace {
     LOG_MSG << "Budget used for question:" << questionTokens;
 
     {
+      TraceSpan span("attachments");
       if (!attachments.empty()) {
         onInfo("Processing attachment(s)");
       }
       const auto maxAttBudget = static_cast<size_t>(maxTokenBudget * 0.8);
-      for (size_t j = 0; j < attachments.size(); j ++) {
-        const auto &att{ attachments[j] };
-        auto content{ att.content };
-        size_t tokens = app.tokenizer().countTokensWithVocab(content);
-        if (tokens < maxAttBudget * 0.2 && usedTokens + tokens < maxAttBudget) {
-          usedTokens += tokens;
-          onInfo(fmt::format("Adding attachment {}", att.filename));
-          addToSearchResult(attachmentResults, att.filename.empty() ? "attachment" : att.filename, std::move(content));
-          attachments.erase(attachments.begin() + j);
-          j --;
-        }
-      }
-      for (const auto &att : attachments) {
-        if (maxAttBudget <= usedTokens) break;
-        onInfo(fmt::format("Adding attachment {}", att.filename));
-        auto content{ att.content };
-        size_t tokens = app.tokenizer().countTokensWithVocab(content);
-        if (usedTokens + tokens < maxAttBudget) {
-          usedTokens += tokens;
-        } else {
-          auto m = content.length();
-          content = truncateToTokens(app.tokenizer(), content, maxAttBudget - usedTokens);
-          usedTokens = maxAttBudget;
-          auto percent = int((content.length() / double(m)) * 100);
-          auto info = fmt::format("Warning: Attachment too large, truncated to {}% of {}", percent, att.filename);
-          LOG_MSG << info;
-          onInfo(fmt::format("{} truncated to {}% ", att.filename, percent));
-        }
-        addToSearchResult(attachmentResults, att.filename.empty() ? "attachment" : att.filename, std::move(content));
+      for (auto &att : fitAttachments(tok, std::move(attachments), maxAttBudget, usedTokens, onInfo)) {
+        addToSearchResult(attachmentResults, att.filename.empty() ? "attachment" : att.filename, std::move(att.content), tok, att.tokens);
       }
     }
 
@@ -409,11 +378,14 @@ namespace {
     std::vector<std::string> allFullSources;
     std::vector<std::string> relSources;
 
-    EmbeddingClient embeddingClient(app.settings().embeddingCurrentApi(), app.settings().embeddingTimeoutMs());
     const auto questionChunks = app.chunker().chunkText(question, "", false);
     std::vector<std::string> questionTexts;
-    for (const auto &qc : questionChunks) questionTexts.push_back(qc.text);
-    embeddingClient.generateEmbeddings(questionTexts, questionEmbeddingVectors, EmbeddingClient::EncodeType::Query);
+    std::vector<size_t> questionTokenCounts;
+    for (const auto &qc : questionChunks) {
+      questionTexts.push_back(qc.text);
+      questionTokenCounts.push_back(qc.metadata.tokenCount);
+    }
+    app.embedder().embed(questionTexts, questionTokenCounts, questionEmbeddingVectors, EmbeddingClient::EncodeType::Query);
 
     if (!attachedOnly) {
       std::set<size_t> uniqueChunkResults;
@@ -438,6 +410,7 @@ namespace {
         sourceToChunk[r.sourceId] = r;
       }
 
+      TraceSpan relatedSpan("related_lookup");
       const auto trackedFiles = app.db().getTrackedFiles();
       std::vector<std::string> trackedSources;
       for (const auto &tf : trackedFiles) {
@@ -468,6 +441,7 @@ namespace {
     }
 
     size_t srcTokens = 0;
+    const auto fullSourcesStart = std::chrono::steady_clock::now();
     for (size_t j = 0; j < sources.size(); j ++) {
       const auto &src = sources[j];
       // src is either a user-set context file, or a chunk's base file (sourceToChunk).
@@ -475,15 +449,15 @@ namespace {
       if (maxTokenBudget <= usedTokens) break;
       size_t contentTokens = 0;
       if (sourceToChunk.count(src)) {
-        auto nUsed = usedTokens;
-        if (!processContent(app, content, src, sourceToChunk[src].chunkId, maxTokenBudget, usedTokens)) {
+        if (!processContent(app, tok, content, src, sourceToChunk[src].chunkId, maxTokenBudget, usedTokens, contentTokens)) {
           break;
         }
-        srcTokens += usedTokens - nUsed;
+        srcTokens += contentTokens;
       } else {
         float thresholdRatio = app.settings().generationExcerptThresholdRatio();
         if (attachedOnly && j == sources.size() - 1) thresholdRatio = 1.0f;
-        if (!isWithinThreshold(app, content, maxTokenBudget, usedTokens, thresholdRatio, &contentTokens)) {
+        contentTokens = sourceTokens(app, tok, src, content);
+        if (!isWithinThreshold(app, contentTokens, maxTokenBudget, usedTokens, thresholdRatio)) {
           auto info = fmt::format("Processing large file {}", std::filesystem::path(src).filename().string());
           onInfo(info);
           auto ids = app.db().getChunkIdsBySource(src);
@@ -494,12 +468,12 @@ namespace {
             hnswlib::InnerProductSpace space{ app.settings().databaseVectorDim() };
             hnswlib::HierarchicalNSW<float> hnswDB(&space, 1000, 16, 200, 42, true);
             ids.resize(999);
-            std::unordered_map<size_t, std::string> idToContent;
+            std::unordered_map<size_t, SearchResult> idToChunk;
             for (auto id : ids) {
               if (auto opt = app.db().getChunkData(id)) {
                 auto vec = app.db().getEmbeddingVector(id);
                 hnswDB.addPoint(vec.data(), id);
-                idToContent[id] = std::move(opt->content);
+                idToChunk[id] = std::move(*opt);
               }
             }
             content.clear();
@@ -517,33 +491,35 @@ namespace {
                   const auto [distance, label] = result.top();
                   result.pop();
                   float similarity = 1.0f - distance; // Higher = more similar
-                  auto chunk = idToContent[label];
-                  content += chunk;
+                  const auto &chunk = idToChunk[label];
+                  content += chunk.content;
+                  contentTokens += storedCounts && chunk.tokenCount != std::string::npos ? chunk.tokenCount : tok.countTokensWithVocab(chunk.content);
                 }
               }
               onInfo(fmt::format("Adding {} relevant chunks from {}", nofFetched, std::filesystem::path(src).filename().string()));
-              auto tokens = app.tokenizer().countTokensWithVocab(content);
-              contentTokens += tokens;
-              srcTokens += tokens;
+              srcTokens += contentTokens;
             }
           }
         }
       }
       if (!content.empty()) {
-        addToSearchResult(fullSourceResults, src, std::move(content));
+        addToSearchResult(fullSourceResults, src, std::move(content), tok, contentTokens);
         usedTokens += contentTokens;
       }
     }
+    if (auto *trace = RequestTrace::current()) trace->add("full_sources", fullSourcesStart, std::chrono::steady_clock::now());
     LOG_MSG << "Budget used for full sources:" << srcTokens;
 
     if (!attachedOnly) {
+      TraceSpan span("related_sources");
       size_t relTokens = 0;
       for (const auto &rel : relSources) {
         auto content = app.sourceProcessor().fetchSource(rel).content;
-        auto nUsed = usedTokens;
-        if (processContent(app, content, rel, -1, maxTokenBudget, usedTokens)) {
-          relTokens += usedTokens - nUsed;
-          addToSearchResult(relatedSrcResults, rel, std::move(content));
+        size_t tokens = 0;
+        if (processContent(app, tok, content, rel, -1, maxTokenBudget, usedTokens, tokens)) {
+          usedTokens += tokens;
+          relTokens += tokens;
+          addToSearchResult(relatedSrcResults, rel, std::move(content), tok, tokens);
         }
       }
       LOG_MSG << "Budget used for related sources:" << relTokens;
@@ -588,12 +564,230 @@ namespace {
     return apiConfig;
   }
 
+  enum class Lane { Fim, Search, Chat, Admin, None };
+  constexpr std::array<const char *, 4> LANE_NAMES = { "fim", "search", "chat", "admin" };
+  constexpr std::array<size_t, 4> LANE_DEFAULT_LIMITS = { 4, 8, 8, 2 };
+
+  Lane laneOf(const httplib::Request &req) {
+    const auto &p = req.path;
+    if (p == "/api/fim") return Lane::Fim;
+    if (p == "/api/chat") return Lane::Chat;
+    if (p == "/api/search" || p == "/api/embed" || p == "/api/documents") return Lane::Search;
+    if (p == "/api/update" || p == "/api/shutdown" || (p == "/api/setup" && req.method == "POST")) return Lane::Admin;
+    return Lane::None;
+  }
+
+  // Per-lane concurrency limits. A slot is freed when the last copy of its handle goes away,
+  // so a streamed response can hold on to it until the stream ends.
+  class AdmissionLanes {
+  public:
+    using Slot = std::shared_ptr<void>;
+
+    struct LaneStats {
+      const char *name = "";
+      size_t limit = 0;
+      size_t active = 0;
+      size_t admitted = 0;
+      size_t rejected = 0;
+    };
+
+    explicit AdmissionLanes(const Settings &s) {
+      for (size_t i = 0; i < LANE_NAMES.size(); ++i) {
+        lanes_[i].limit = s.httpServerLaneLimit(LANE_NAMES[i], LANE_DEFAULT_LIMITS[i]);
+      }
+    }
+
+    // Returns an empty slot when the lane is full.
+    Slot tryAcquire(Lane lane) {
+      auto &l = lanes_[static_cast<size_t>(lane)];
+      size_t cur = l.active.load();
+      do {
+        if (0 < l.limit && l.limit <= cur) {
+          l.rejected++;
+          return nullptr;
+        }
+      } while (!l.active.compare_exchange_weak(cur, cur + 1));
+      l.admitted++;
+      return Slot(static_cast<void *>(&l), [](void *p) { static_cast<State *>(p)->active--; });
+    }
+
+    // 0 = unlimited.
+    size_t limit(Lane lane) const { return lanes_[static_cast<size_t>(lane)].limit; }
+
+    std::vector<LaneStats> stats() const {
+      std::vector<LaneStats> res;
+      for (size_t i = 0; i < LANE_NAMES.size(); ++i) {
+        res.push_back({ LANE_NAMES[i], lanes_[i].limit, lanes_[i].active.load(), lanes_[i].admitted.load(), lanes_[i].rejected.load() });
+      }
+      return res;
+    }
+
+  private:
+    struct State {
+      size_t limit = 0;
+      std::atomic<size_t> active{ 0 };
+      std::atomic<size_t> admitted{ 0 };
+      std::atomic<size_t> rejected{ 0 };
+    };
+    std::array<State, LANE_NAMES.size()> lanes_;
+  };
+
+  // Serves httplib's connections from a WorkerPool, so that long streams can leave the pool.
+  // Connections that don't fit its queue go to a few shedding threads, whose requests are only
+  // answered with 429. Beyond the shedding queue, a connection is closed without a response.
+  class WorkerTaskQueue : public httplib::TaskQueue {
+  public:
+    WorkerTaskQueue(WorkerPool &pool, size_t maxShed) : pool_(pool), shed_(SHED_WORKERS, maxShed) {}
+
+    bool enqueue(std::function<void()> fn) override {
+      if (pool_.enqueue(fn)) return true;
+      return shed_.enqueue([fn = std::move(fn)]() {
+        shedding_ = true;
+        fn();
+        shedding_ = false;
+        });
+    }
+    void shutdown() override {
+      pool_.shutdown();
+      shed_.shutdown();
+    }
+
+    // True while the calling thread serves a shed connection.
+    static bool shedding() { return shedding_; }
+
+  private:
+    static constexpr size_t SHED_WORKERS = 2;
+    WorkerPool &pool_;
+    WorkerPool shed_;
+    static thread_local bool shedding_;
+  };
+
+  thread_local bool WorkerTaskQueue::shedding_ = false;
+
+  // Tracks the newest /api/fim request per editor session. Editors fire a request on almost
+  // every keystroke and only the newest one gets shown, so older ones are superseded.
+  class FimSessions {
+  public:
+    class Ticket {
+    public:
+      Ticket(FimSessions *owner, std::string key, uint64_t seq)
+        : owner_(owner), key_(std::move(key)), seq_(seq) {}
+      ~Ticket() { if (owner_) owner_->finish(key_, seq_); }
+
+      bool superseded() const { return owner_ && !owner_->isLatest(key_, seq_); }
+
+      // Holds the request back for up to ms; returns true if a newer one arrived meanwhile.
+      bool debounce(size_t ms) const { return owner_ && owner_->waitSuperseded(key_, seq_, ms); }
+
+    private:
+      FimSessions *owner_;
+      std::string key_;
+      uint64_t seq_;
+
+      Ticket(const Ticket &) = delete;
+      Ticket &operator =(const Ticket &) = delete;
+    };
+
+    // An empty key gives a ticket that is never superseded.
+    Ticket begin(const std::string &key) {
+      if (key.empty()) return Ticket(nullptr, {}, 0);
+      uint64_t seq;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        seq = ++next_;
+        latest_[key] = seq;
+      }
+      cv_.notify_all();
+      return Ticket(this, key, seq);
+    }
+
+  private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::unordered_map<std::string, uint64_t> latest_;
+    uint64_t next_ = 0;
+
+    bool isLatest(const std::string &key, uint64_t seq) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = latest_.find(key);
+      return it != latest_.end() && it->second == seq;
+    }
+
+    bool waitSuperseded(const std::string &key, uint64_t seq, size_t ms) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      return cv_.wait_for(lock, std::chrono::milliseconds(ms), [&]() {
+        auto it = latest_.find(key);
+        return it == latest_.end() || it->second != seq;
+        });
+    }
+
+    void finish(const std::string &key, uint64_t seq) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = latest_.find(key);
+      if (it != latest_.end() && it->second == seq) latest_.erase(it);
+    }
+  };
+
+  // Appends requests slower than a threshold, with their stage timings, to a json-lines file
+  // for offline analysis.
+  class SlowRequestLog {
+  public:
+    explicit SlowRequestLog(const Settings &s)
+      : path_(s.loggingSlowRequestFile()), thresholdMs_(s.loggingSlowRequestMs()) {}
+
+    void record(const std::string &method, const std::string &path, int status, const RequestTrace &trace, bool cancelled = false) {
+      const double totalMs = trace.elapsedMs();
+      if (thresholdMs_ == 0 || totalMs < thresholdMs_) return;
+      auto round1 = [](double ms) { return std::round(ms * 10) / 10; };
+      json spans = json::array();
+      for (const auto &sp : trace.spans()) {
+        spans.push_back({ {"name", sp.name}, {"start_ms", round1(sp.startMs)}, {"ms", round1(sp.durationMs)}, {"count", sp.count} });
+      }
+      json entry = {
+        {"time", utils::currentTimestamp()},
+        {"method", method},
+        {"path", path},
+        {"status", status},
+        {"total_ms", round1(totalMs)},
+        {"spans", spans}
+      };
+      if (cancelled) entry["cancelled"] = true;
+      const std::string line = entry.dump() + "\n";
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::ofstream out(path_, std::ios::app | std::ios::binary);
+      if (!out) {
+        LOG_MSG << "Cannot write slow request log" << path_;
+        return;
+      }
+      out << line;
+    }
+
+  private:
+    std::mutex mutex_;
+    std::string path_;
+    size_t thresholdMs_;
+  };
+
+  // One line summary of a trace for the chat stream, e.g. "total 2310, retrieval 120, ...".
+  std::string timingSummary(const RequestTrace &trace) {
+    std::string res = fmt::format("total {:.0f}", trace.elapsedMs());
+    for (const auto &sp : trace.spans()) {
+      res += fmt::format(", {} {:.0f}", sp.name, sp.durationMs);
+      if (1 < sp.count) res += fmt::format(" ({}x)", sp.count);
+    }
+    return res;
+  }
+
 } // anonymous namespace
 
 
 struct HttpServer::Impl {
   Impl(App &a)
     : app_(a)
+    , lanes_(a.settings())
+    , fimCache_(a.settings().generationFimCacheEntries())
+    , fimRetriever_(a)
+    , slowLog_(a.settings())
   {
   }
 
@@ -601,18 +795,37 @@ struct HttpServer::Impl {
 
   App &app_;
 
+  std::unique_ptr<WorkerPool> workers_; // created when the server starts listening
+  AdmissionLanes lanes_;
+  // Lane slot of the request being handled on this thread.
+  static thread_local AdmissionLanes::Slot currentSlot_;
+
+  FimSessions fimSessions_;
+  FimCache fimCache_;
+  FimRetriever fimRetriever_;
+  SlowRequestLog slowLog_;
+
   static std::atomic<size_t> requestCounter_;
   static std::atomic<size_t> searchCounter_;
   static std::atomic<size_t> chatCounter_;
   static std::atomic<size_t> embedCounter_;
   static std::atomic<size_t> errorCounter_;
+  static std::atomic<size_t> cancelledCounter_;
+  static std::atomic<size_t> tokensSavedCounter_;
+  static std::atomic<size_t> fimSupersededCounter_;
 
   static std::chrono::steady_clock::time_point startTime_;
 
-  // Moving averages for performance
-  static std::atomic<double> avgSearchTimeMs_;
-  static std::atomic<double> avgChatTimeMs_;
-  static std::atomic<double> avgEmbedTimeMs_;
+  // Stage timings of the request being handled on this thread; its start feeds the endpoint latency histogram.
+  static thread_local RequestTrace requestTrace_;
+
+  // Counts a generation aborted on client disconnect; what was left of the max_tokens budget
+  // is the (upper bound of the) output the upstream didn't have to produce.
+  static void recordCancelled(const SimpleTokenizer &tok, size_t maxTokens, const std::string &partial) {
+    const size_t generated = tok.countTokensWithVocab(partial);
+    cancelledCounter_++;
+    tokensSavedCounter_ += generated < maxTokens ? maxTokens - generated : 0;
+  }
 };
 
 std::atomic<size_t> HttpServer::Impl::requestCounter_{ 0 };
@@ -620,16 +833,24 @@ std::atomic<size_t> HttpServer::Impl::searchCounter_{ 0 };
 std::atomic<size_t> HttpServer::Impl::chatCounter_{ 0 };
 std::atomic<size_t> HttpServer::Impl::embedCounter_{ 0 };
 std::atomic<size_t> HttpServer::Impl::errorCounter_{ 0 };
+std::atomic<size_t> HttpServer::Impl::cancelledCounter_{ 0 };
+std::atomic<size_t> HttpServer::Impl::tokensSavedCounter_{ 0 };
+std::atomic<size_t> HttpServer::Impl::fimSupersededCounter_{ 0 };
 std::chrono::steady_clock::time_point HttpServer::Impl::startTime_;
-std::atomic<double> HttpServer::Impl::avgSearchTimeMs_{ 0.0 };
-std::atomic<double> HttpServer::Impl::avgChatTimeMs_{ 0.0 };
-std::atomic<double> HttpServer::Impl::avgEmbedTimeMs_{ 0.0 };
+thread_local AdmissionLanes::Slot HttpServer::Impl::currentSlot_;
+thread_local RequestTrace HttpServer::Impl::requestTrace_;
 
 
 HttpServer::HttpServer(App &a)
   : imp(new Impl(a))
 {
-  imp->server_.new_task_queue = [] { return new httplib::ThreadPool(4); };
+  imp->server_.new_task_queue = [this] {
+    const auto &ss = imp->app_.settings();
+    // Every admitted chat stream may leave the pool; with an unlimited chat lane, as many as
+    // there are workers.
+    imp->workers_ = std::make_unique<WorkerPool>(ss.httpServerWorkers(), ss.httpServerQueueDepth(), imp->lanes_.limit(Lane::Chat));
+    return new WorkerTaskQueue(*imp->workers_, ss.httpServerQueueDepth());
+    };
 
   imp->server_.set_error_logger([](const httplib::Error &err, const httplib::Request *req) {
     std::cerr << httplib::to_string(err) << " while processing request";
@@ -671,6 +892,43 @@ bool HttpServer::startServer()
 
   server.set_mount_point("/setup", "./public/setup/");
 
+  // Admission control: over-capacity lanes get a fast 429 instead of queueing behind long requests.
+  server.set_pre_routing_handler([this](const httplib::Request &req, httplib::Response &res) {
+    Impl::requestTrace_.reset();
+    RequestTrace::setCurrent(&Impl::requestTrace_);
+    Impl::currentSlot_.reset();
+    auto tooManyRequests = [this, &res](const std::string &message) {
+      json error = { {"error", message} };
+      res.status = 429;
+      res.set_header("Retry-After", std::to_string(imp->app_.settings().httpServerRetryAfterS()));
+      res.set_content(error.dump(), "application/json");
+      Impl::requestCounter_++;
+      return httplib::Server::HandlerResponse::Handled;
+      };
+    // The connection queue overflowed: the client should come back later on a new connection.
+    if (WorkerTaskQueue::shedding()) {
+      res.set_header("Connection", "close");
+      return tooManyRequests("Server busy");
+    }
+    const Lane lane = laneOf(req);
+    if (lane == Lane::None) return httplib::Server::HandlerResponse::Unhandled;
+    Impl::currentSlot_ = imp->lanes_.tryAcquire(lane);
+    if (Impl::currentSlot_) return httplib::Server::HandlerResponse::Unhandled;
+    return tooManyRequests(fmt::format("Too many concurrent {} requests", LANE_NAMES[static_cast<size_t>(lane)]));
+    });
+  server.set_post_routing_handler([this](const httplib::Request &req, httplib::Response &res) {
+    Impl::currentSlot_.reset();
+    RequestTrace::setCurrent(nullptr);
+    // Streamed chats record and report themselves when the stream ends; unknown paths would only add noise.
+    const bool streamedChat = req.path == "/api/chat" && res.status == 200;
+    if (!streamedChat && res.status != 404 && (req.path.starts_with("/api/") || req.path == "/metrics")) {
+      const auto &trace = Impl::requestTrace_;
+      LatencyRegistry::endpoint(req.method + " " + req.path).record(std::chrono::steady_clock::now() - trace.start());
+      res.set_header("Server-Timing", trace.serverTiming());
+      imp->slowLog_.record(req.method, req.path, res.status, trace);
+    }
+    });
+
   server.Get("/", [this](const httplib::Request &, httplib::Response &res) {
     LOG_MSG << "GET /";
     if (!std::filesystem::exists(imp->app_.settings().configPath())) {
@@ -759,15 +1017,13 @@ bool HttpServer::startServer()
     });
 
   server.Post("/api/search", [this](const httplib::Request &req, httplib::Response &res) {
-    const auto start = std::chrono::steady_clock::now();
     try {
       LOG_MSG << "POST /api/search";
       json request = json::parse(req.body);
       std::string query = request["query"].get<std::string>();
       size_t top_k = request.value("top_k", 5);
       std::vector<float> queryEmbedding;
-      EmbeddingClient embeddingClient(imp->app_.settings().embeddingCurrentApi(), imp->app_.settings().embeddingTimeoutMs());
-      embeddingClient.generateEmbeddings(query, queryEmbedding, EmbeddingClient::EncodeType::Query);
+      imp->app_.embedder().embed(query, queryEmbedding, EmbeddingClient::EncodeType::Query);
       auto results = imp->app_.db().search(queryEmbedding, top_k);
       json response = json::array();
       for (const auto &result : results) {
@@ -790,35 +1046,26 @@ bool HttpServer::startServer()
     }
     Impl::requestCounter_++;
     Impl::searchCounter_++;
-    recordDuration(start, Impl::avgSearchTimeMs_);
     });
 
   // (one-off embedding without storage)
   server.Post("/api/embed", [this](const httplib::Request &req, httplib::Response &res) {
-    const auto start = std::chrono::steady_clock::now();
     try {
       LOG_MSG << "POST /api/embed";
       json request = json::parse(req.body);
       std::string text = request["text"].get<std::string>();
       auto chunks = imp->app_.chunker().chunkText(text, "api-request");
       std::vector<std::string> texts;
+      std::vector<size_t> tokenCounts;
       for (const auto &c : chunks) {
         texts.push_back(c.text);
+        tokenCounts.push_back(c.metadata.tokenCount);
       }
+      std::vector<std::vector<float>> embeddings;
+      imp->app_.embedder().embed(texts, tokenCounts, embeddings, EmbeddingClient::EncodeType::Query);
       json response = json::array();
-      const auto &ss = imp->app_.settings();
-      const auto batchSize = ss.embeddingBatchSize();
-      EmbeddingClient embeddingClient(ss.embeddingCurrentApi(), ss.embeddingTimeoutMs());
-      for (size_t i = 0; i < chunks.size(); i += batchSize) {
-        size_t end = (std::min)(i + batchSize, chunks.size());
-        std::vector<std::string> batchTexts(texts.begin() + i, texts.begin() + end);
-
-        std::vector<std::vector<float>> embeddings;
-        embeddingClient.generateEmbeddings(batchTexts, embeddings, EmbeddingClient::EncodeType::Query);
-
-        for (const auto &emb : embeddings) {
-          response.push_back({ {"embedding", emb}, {"dimension", emb.size()} });
-        }
+      for (const auto &emb : embeddings) {
+        response.push_back({ {"embedding", emb}, {"dimension", emb.size()} });
       }
       res.set_content(response.dump(), "application/json");
     } catch (const std::exception &e) {
@@ -829,7 +1076,6 @@ bool HttpServer::startServer()
     }
     Impl::requestCounter_++;
     Impl::embedCounter_++;
-    recordDuration(start, Impl::avgEmbedTimeMs_);
     });
 
   server.Post("/api/documents", [this](const httplib::Request &req, httplib::Response &res) {
@@ -842,12 +1088,17 @@ bool HttpServer::startServer()
 
       auto chunks = imp->app_.chunker().chunkText(content, source_id);
 
-      EmbeddingClient embeddingClient(imp->app_.settings().embeddingCurrentApi(), imp->app_.settings().embeddingTimeoutMs());
+      std::vector<std::string> texts;
+      std::vector<size_t> tokenCounts;
+      for (const auto &c : chunks) {
+        texts.push_back(c.text);
+        tokenCounts.push_back(c.metadata.tokenCount);
+      }
+      std::vector<std::vector<float>> embeddings;
+      imp->app_.embedder().embed(texts, tokenCounts, embeddings, EmbeddingClient::EncodeType::Document);
       size_t inserted = 0;
-      for (const auto &chunk : chunks) {
-        std::vector<float> embedding;
-        embeddingClient.generateEmbeddings(chunk.text, embedding, EmbeddingClient::EncodeType::Document);
-        imp->app_.db().addDocument(chunk, embedding);
+      for (size_t i = 0; i < chunks.size(); ++i) {
+        imp->app_.db().addDocument(chunks[i], embeddings[i]);
         inserted++;
       }
 
@@ -878,7 +1129,8 @@ bool HttpServer::startServer()
         response.push_back({
             {"path", file.path},
             {"lastModified", file.lastModified},
-            {"size", file.fileSize}
+            {"size", file.fileSize},
+            {"tokens", file.tokenCount}
           });
       }
       res.set_content(response.dump(), "application/json");
@@ -987,14 +1239,31 @@ bool HttpServer::startServer()
       const float contextSizeRatio = request.value("ctxratio", 0.9f);
       const bool attachedOnly = request.value("attachedonly", false);
 
+      // Retrieval and generation keep this thread for the whole stream; hand its worker slot to a
+      // replacement so concurrent chats don't starve search and fim. A chat that can't leave the
+      // pool is turned away rather than holding a slot. The thread rejoins the pool when the
+      // response is released, before it serves the connection's next request.
+      auto detached = std::make_shared<WorkerPool::DetachScope>();
+      if (!*detached) {
+        json error = { {"error", "Too many concurrent chat streams"} };
+        res.status = 429;
+        res.set_header("Retry-After", std::to_string(imp->app_.settings().httpServerRetryAfterS()));
+        res.set_content(error.dump(), "application/json");
+        return;
+      }
+
       res.set_header("Content-Type", "text/event-stream");
       res.set_header("Cache-Control", "no-cache");
       res.set_header("Connection", "keep-alive");
 
       res.set_chunked_content_provider(
         "text/event-stream",
-        [this, messagesJson, question, temperature, contextSizeRatio, attachedOnly, attachments, sources, maxTokens, apiConfig]
+        [this, &req, messagesJson, question, temperature, contextSizeRatio, attachedOnly, attachments, sources, maxTokens, apiConfig, start, laneSlot = Impl::currentSlot_, detached]
         (size_t offset, httplib::DataSink &sink) {
+          // The stream outlives the handler, so the endpoint's latency is taken here.
+          ScopedLatency latency(LatencyRegistry::endpoint("POST /api/chat"), nullptr, start);
+          RequestTrace trace(start);
+          RequestTrace::Scope traceScope(trace);
 
           auto packPayload = [](std::string data) {
             // SSE format requires "data: <payload>\n\n"
@@ -1016,19 +1285,28 @@ bool HttpServer::startServer()
           );
 
           CompletionClient completionClient(apiConfig, imp->app_.settings().generationTimeoutMs(), imp->app_);
+          // The request outlives its response. Unlike sink.is_writable(), which may wait out the write
+          // timeout on a slow reader, the connection check doesn't block the shared watcher.
+          const CancellationToken cancel([&req]() { return req.is_connection_closed && req.is_connection_closed(); });
           try {
             const std::string fullResponse = completionClient.generateCompletion(
               messagesJson, orderedResults, temperature, maxTokens,
-              [&sink, packPayload](const std::string &chunk) {
+              [&sink, &cancel, packPayload](const std::string &chunk) {
 #ifdef _DEBUG2
                 LOG_MSG << chunk;
 #endif
                 std::string sse = packPayload(chunk);
                 bool success = sink.write(sse.data(), sse.size());
                 if (!success) {
-                  return; // Client disconnected
+                  cancel.cancel(); // Client disconnected, stop the upstream generation
                 }
-              });
+              }, &cancel);
+
+            if (cancel.isCancelled()) {
+              Impl::recordCancelled(imp->app_.tokenizer(apiConfig), maxTokens, fullResponse);
+              imp->slowLog_.record("POST", "/api/chat", 200, trace, true);
+              return false;
+            }
 
 #ifdef _DEBUG2
             testStreaming([&sink](const std::string &chunk) {
@@ -1037,7 +1315,7 @@ bool HttpServer::startServer()
               }
               });
 #endif
-            size_t resTokens = imp->app_.tokenizer().countTokensWithVocab(fullResponse);
+            size_t resTokens = imp->app_.tokenizer(apiConfig).countTokensWithVocab(fullResponse);
             onInfo(fmt::format("Response token count {}", resTokens));
 
             auto costReq = apiConfig.inputTokensPrice(usedTokens);
@@ -1047,6 +1325,7 @@ bool HttpServer::startServer()
               onInfo("Total cost incurred: 0");
             else
               onInfo(fmt::format("Approx. cost incurred: ${:.4f} (input: {:.4f}, output: {:.4f})", costTotal, costReq, costRes));
+            onInfo("Timing (ms): " + timingSummary(trace));
 
             // Add sources information
             nlohmann::json sourcesJson;
@@ -1074,6 +1353,7 @@ bool HttpServer::startServer()
             sink.write(error.data(), error.size());
             sink.done();
           }
+          imp->slowLog_.record("POST", "/api/chat", 200, trace);
           //LOG_MSG << "set_chunked_content_provider: callback DONE.";
           return true;
         }
@@ -1087,11 +1367,9 @@ bool HttpServer::startServer()
     }
     Impl::requestCounter_++;
     Impl::chatCounter_++;
-    recordDuration(start, Impl::avgChatTimeMs_);
     });
 
     server.Post("/api/fim", [this](const httplib::Request &req, httplib::Response &res) {
-      const auto start = std::chrono::steady_clock::now();
       try {
         LOG_MSG << "POST /api/fim";
         json request = json::parse(req.body);
@@ -1120,13 +1398,67 @@ bool HttpServer::startServer()
         const float contextSizeRatio = request.value("ctxratio", 0.5f);
         std::vector<std::string> stops = request.value("stop", std::vector<std::string>{});
 
-        const auto searchResults = processInputResults(imp->app_, apiConfig, prefix, {}, {filename}, contextSizeRatio, {}, nullptr);
+        // A newer request for the same session supersedes this one at any stage.
+        const auto ticket = imp->fimSessions_.begin(request.value("session", std::string{}));
+        auto respondSuperseded = [&res]() {
+          json response = { {"completion", ""}, {"superseded", true} };
+          res.set_content(response.dump(), "application/json");
+          Impl::fimSupersededCounter_++;
+          Impl::requestCounter_++;
+          };
+
+        // Typing along the last completion: serve the rest of it without asking the model.
+        const std::string cacheScope = apiConfig.id + '\n' + filename;
+        if (auto cached = imp->fimCache_.lookup(cacheScope, prefix, suffix)) {
+          json response = { {"completion", *cached}, {"cached", true} };
+          res.set_content(response.dump(), "application/json");
+          Impl::requestCounter_++;
+          return;
+        }
+
+        const size_t debounceMs = request.value("debounce_ms", imp->app_.settings().generationFimDebounceMs());
+        if (0 < debounceMs && ticket.debounce(debounceMs)) {
+          respondSuperseded();
+          return;
+        }
+
+        std::vector<SearchResult> context;
+        json retrievalMs = json::object();
+        const size_t retrievalBudgetMs = imp->app_.settings().generationFimRetrievalBudgetMs();
+        if (0 < retrievalBudgetMs) {
+          auto retrieved = imp->fimRetriever_.retrieve(apiConfig, prefix, suffix, filename, contextSizeRatio, retrievalBudgetMs);
+          for (const auto &st : retrieved.stages) {
+            retrievalMs[st.name] = st.skipped ? json(nullptr) : json(st.ms);
+          }
+          LOG_MSG << "[FIM] Retrieval stages (ms, null = skipped):" << retrievalMs.dump();
+          context = std::move(retrieved.results);
+        } else {
+          context = processInputResults(imp->app_, apiConfig, prefix, {}, {filename}, contextSizeRatio, {}, nullptr).first;
+        }
+        if (ticket.superseded()) {
+          respondSuperseded();
+          return;
+        }
 
         LOG_MSG << "Generating FIM with prefix length" << prefix.size() << "and suffix length" << suffix.size();
         CompletionClient completionClient(apiConfig, imp->app_.settings().generationTimeoutMs(), imp->app_);
-        std::string fullResponse = completionClient.generateFim(prefix, suffix, stops, temperature, maxTokens, searchResults.first);
-        LOG_MSG << "[FIM] Generated tokens:" << imp->app_.tokenizer().countTokensWithVocab(fullResponse);
+        const CancellationToken cancel([&req, &ticket]() {
+          return ticket.superseded() || (req.is_connection_closed && req.is_connection_closed());
+          });
+        std::string fullResponse = completionClient.generateFim(prefix, suffix, stops, temperature, maxTokens, context, &cancel);
+        if (cancel.isCancelled()) {
+          Impl::recordCancelled(imp->app_.tokenizer(apiConfig), maxTokens, fullResponse);
+          if (ticket.superseded()) {
+            respondSuperseded();
+          } else {
+            LOG_MSG << "[FIM] Client went away, generation aborted";
+          }
+          return;
+        }
+        LOG_MSG << "[FIM] Generated tokens:" << imp->app_.tokenizer(apiConfig).countTokensWithVocab(fullResponse);
+        imp->fimCache_.store(cacheScope, prefix, suffix, fullResponse);
         json response = { {"completion", fullResponse} };
+        if (!retrievalMs.empty()) response["retrieval_ms"] = retrievalMs;
         res.set_content(response.dump(), "application/json");
         Impl::requestCounter_++;
       } catch (const std::exception &e) {
@@ -1135,7 +1467,6 @@ bool HttpServer::startServer()
         res.set_content(error.dump(), "application/json");
         Impl::errorCounter_++;
       }
-      recordDuration(start, Impl::avgChatTimeMs_); // reuse chat timing metric
       });
 
   server.Get("/api/settings", [this](const httplib::Request &, httplib::Response &res) {
@@ -1216,6 +1547,46 @@ bool HttpServer::startServer()
 
     auto &app = imp->app_;
     auto stats = app.db().getStats();
+    const auto dispatch = app.embedder().stats();
+    const auto pool = app.httpPool().stats();
+    const auto fimCache = imp->fimCache_.stats();
+    const auto workers = imp->workers_ ? imp->workers_->stats() : WorkerPool::Stats{};
+    json performance = { {"endpoints", json::object()}, {"stages", json::object()} };
+    for (const auto &e : LatencyRegistry::entries()) {
+      const auto snap = e.histogram->snapshot();
+      performance[e.kind == LatencyRegistry::Kind::Endpoint ? "endpoints" : "stages"][e.name] = {
+        {"count", snap.count},
+        {"p50_ms", snap.percentileMs(0.50)},
+        {"p95_ms", snap.percentileMs(0.95)},
+        {"p99_ms", snap.percentileMs(0.99)}
+      };
+    }
+    json lanes = json::object();
+    for (const auto &l : imp->lanes_.stats()) {
+      lanes[l.name] = { {"limit", l.limit}, {"active", l.active}, {"admitted", l.admitted}, {"rejected", l.rejected} };
+    }
+    const size_t fimCacheLookups = fimCache.hits + fimCache.misses;
+    auto tokenCacheJson = [](const TokenCountCache::Stats &c) {
+      const size_t lookups = c.hits + c.misses;
+      return json{
+        {"entries", c.entries},
+        {"capacity", c.capacity},
+        {"hits", c.hits},
+        {"misses", c.misses},
+        {"evictions", c.evictions},
+        {"hit_rate", lookups ? double(c.hits) / lookups : 0.0}
+      };
+    };
+    json endpoints = json::array();
+    for (const auto &ep : dispatch.endpoints) {
+      endpoints.push_back({
+          {"url", ep.url},
+          {"healthy", ep.healthy},
+          {"outstanding", ep.outstanding},
+          {"requests", ep.requests},
+          {"errors", ep.errors}
+        });
+    }
 
     json metrics = {
         {"service", {
@@ -1236,12 +1607,49 @@ bool HttpServer::startServer()
             {"search", Impl::searchCounter_.load()},
             {"chat", Impl::chatCounter_.load()},
             {"embed", Impl::embedCounter_.load()},
-            {"errors", Impl::errorCounter_.load()}
+            {"errors", Impl::errorCounter_.load()},
+            {"cancelled", Impl::cancelledCounter_.load()},
+            {"tokens_saved", Impl::tokensSavedCounter_.load()},
+            {"fim_superseded", Impl::fimSupersededCounter_.load()}
+        }},
+        {"performance", performance},
+        {"embedding_dispatch", {
+            {"endpoints", endpoints},
+            {"batch_tokens", dispatch.batchTokens},
+            {"concurrency", dispatch.concurrency},
+            {"in_flight", dispatch.inFlight},
+            {"requests", dispatch.requests},
+            {"errors", dispatch.errors},
+            {"retries", dispatch.retries},
+            {"avg_latency_ms", dispatch.avgLatencyMs},
+            {"query_batches", dispatch.queryBatches},
+            {"query_texts", dispatch.queryTexts}
         }},
-        {"performance", {
-            {"avg_search_ms", Impl::avgSearchTimeMs_.load()},
-            {"avg_embedding_ms", Impl::avgEmbedTimeMs_.load()},
-            {"avg_chat_ms", Impl::avgChatTimeMs_.load()}
+        {"fim_cache", {
+            {"entries", fimCache.entries},
+            {"hits", fimCache.hits},
+            {"misses", fimCache.misses},
+            {"hit_rate", fimCacheLookups ? double(fimCache.hits) / fimCacheLookups : 0.0}
+        }},
+        {"token_caches", {
+            {"words", tokenCacheJson(app.tokenizer().cacheStats())},
+            {"units", tokenCacheJson(app.chunker().cacheStats())}
+        }},
+        {"http_workers", {
+            {"workers", workers.workers},
+            {"busy", workers.busy},
+            {"streaming", workers.detached},
+            {"queued", workers.queued},
+            {"queue_rejected", workers.rejected},
+            {"avg_queue_wait_ms", workers.started ? workers.totalWaitMs / workers.started : 0.0},
+            {"lanes", lanes}
+        }},
+        {"http_pool", {
+            {"hosts", pool.hosts},
+            {"idle", pool.idle},
+            {"leased", pool.leased},
+            {"created", pool.created},
+            {"reused", pool.reused}
         }},
         {"system", {
             {"last_update", app.lastUpdateTimestamp()},
@@ -1278,18 +1686,190 @@ bool HttpServer::startServer()
     prometheus << "# TYPE embedder_error_requests_total counter\n";
     prometheus << "embedder_error_requests_total " << Impl::errorCounter_ << "\n\n";
 
-    // Performance metrics (moving averages)
-    prometheus << "# HELP embedder_avg_search_time_ms Average search time in milliseconds\n";
-    prometheus << "# TYPE embedder_avg_search_time_ms gauge\n";
-    prometheus << "embedder_avg_search_time_ms " << Impl::avgSearchTimeMs_.load() << "\n\n";
+    prometheus << "# HELP embedder_cancelled_requests_total Generations aborted because the client disconnected or a newer request superseded them\n";
+    prometheus << "# TYPE embedder_cancelled_requests_total counter\n";
+    prometheus << "embedder_cancelled_requests_total " << Impl::cancelledCounter_ << "\n\n";
+
+    prometheus << "# HELP embedder_tokens_saved_total Completion tokens not generated thanks to cancellation (upper bound)\n";
+    prometheus << "# TYPE embedder_tokens_saved_total counter\n";
+    prometheus << "embedder_tokens_saved_total " << Impl::tokensSavedCounter_ << "\n\n";
+
+    prometheus << "# HELP embedder_fim_superseded_total FIM requests dropped in favour of a newer one from the same session\n";
+    prometheus << "# TYPE embedder_fim_superseded_total counter\n";
+    prometheus << "embedder_fim_superseded_total " << Impl::fimSupersededCounter_ << "\n\n";
+
+    // Latency histograms, buckets at powers of two microseconds
+    auto writeHistogram = [&prometheus](const char *metric, const char *label, const std::string &name, const LatencyHistogram::Snapshot &snap) {
+      uint64_t cumulative = 0;
+      for (size_t i = 0; i < LatencyHistogram::BUCKETS; ++i) {
+        cumulative += snap.counts[i];
+        const uint64_t upper = LatencyHistogram::bucketUpperMicros(i);
+        // Every 4th bucket ends on a power of two; 128us .. ~36min is plenty of resolution here.
+        if ((upper & (upper - 1)) != 0 || upper < 128 || (uint64_t(1) << 31) < upper) continue;
+        prometheus << metric << "_bucket{" << label << "=\"" << name << "\",le=\"" << upper / 1e6 << "\"} " << cumulative << "\n";
+      }
+      prometheus << metric << "_bucket{" << label << "=\"" << name << "\",le=\"+Inf\"} " << snap.count << "\n";
+      prometheus << metric << "_sum{" << label << "=\"" << name << "\"} " << snap.sumMs / 1000.0 << "\n";
+      prometheus << metric << "_count{" << label << "=\"" << name << "\"} " << snap.count << "\n";
+      };
+    const auto latencies = LatencyRegistry::entries();
+    prometheus << "# HELP embedder_http_request_duration_seconds Request latency per endpoint\n";
+    prometheus << "# TYPE embedder_http_request_duration_seconds histogram\n";
+    for (const auto &e : latencies) {
+      if (e.kind == LatencyRegistry::Kind::Endpoint) {
+        writeHistogram("embedder_http_request_duration_seconds", "endpoint", e.name, e.histogram->snapshot());
+      }
+    }
+    prometheus << "\n";
+
+    prometheus << "# HELP embedder_stage_duration_seconds Latency per internal pipeline stage\n";
+    prometheus << "# TYPE embedder_stage_duration_seconds histogram\n";
+    for (const auto &e : latencies) {
+      if (e.kind == LatencyRegistry::Kind::Stage) {
+        writeHistogram("embedder_stage_duration_seconds", "stage", e.name, e.histogram->snapshot());
+      }
+    }
+    prometheus << "\n";
+
+    // Embedding dispatcher state
+    const auto dispatch = imp->app_.embedder().stats();
+    prometheus << "# HELP embedder_embedding_batch_tokens Current token budget per embedding batch\n";
+    prometheus << "# TYPE embedder_embedding_batch_tokens gauge\n";
+    prometheus << "embedder_embedding_batch_tokens " << dispatch.batchTokens << "\n\n";
+
+    prometheus << "# HELP embedder_embedding_concurrency Current embedding concurrency window\n";
+    prometheus << "# TYPE embedder_embedding_concurrency gauge\n";
+    prometheus << "embedder_embedding_concurrency " << dispatch.concurrency << "\n\n";
+
+    prometheus << "# HELP embedder_embedding_in_flight Embedding requests in flight\n";
+    prometheus << "# TYPE embedder_embedding_in_flight gauge\n";
+    prometheus << "embedder_embedding_in_flight " << dispatch.inFlight << "\n\n";
+
+    prometheus << "# HELP embedder_embedding_batches_total Embedding batches sent upstream\n";
+    prometheus << "# TYPE embedder_embedding_batches_total counter\n";
+    prometheus << "embedder_embedding_batches_total " << dispatch.requests << "\n\n";
+
+    prometheus << "# HELP embedder_embedding_errors_total Failed embedding batches\n";
+    prometheus << "# TYPE embedder_embedding_errors_total counter\n";
+    prometheus << "embedder_embedding_errors_total " << dispatch.errors << "\n\n";
+
+    prometheus << "# HELP embedder_embedding_retries_total Retried embedding batches\n";
+    prometheus << "# TYPE embedder_embedding_retries_total counter\n";
+    prometheus << "embedder_embedding_retries_total " << dispatch.retries << "\n\n";
+
+    prometheus << "# HELP embedder_embedding_query_batches_total Coalesced query embedding batches\n";
+    prometheus << "# TYPE embedder_embedding_query_batches_total counter\n";
+    prometheus << "embedder_embedding_query_batches_total " << dispatch.queryBatches << "\n\n";
+
+    prometheus << "# HELP embedder_embedding_query_texts_total Query texts sent through the batcher\n";
+    prometheus << "# TYPE embedder_embedding_query_texts_total counter\n";
+    prometheus << "embedder_embedding_query_texts_total " << dispatch.queryTexts << "\n\n";
+
+    prometheus << "# HELP embedder_embedding_endpoint_up Whether the embedding endpoint is in rotation\n";
+    prometheus << "# TYPE embedder_embedding_endpoint_up gauge\n";
+    for (const auto &ep : dispatch.endpoints) {
+      prometheus << "embedder_embedding_endpoint_up{url=\"" << ep.url << "\"} " << (ep.healthy ? 1 : 0) << "\n";
+    }
+    prometheus << "\n";
+
+    prometheus << "# HELP embedder_embedding_endpoint_outstanding Outstanding requests per embedding endpoint\n";
+    prometheus << "# TYPE embedder_embedding_endpoint_outstanding gauge\n";
+    for (const auto &ep : dispatch.endpoints) {
+      prometheus << "embedder_embedding_endpoint_outstanding{url=\"" << ep.url << "\"} " << ep.outstanding << "\n";
+    }
+    prometheus << "\n";
+
+    prometheus << "# HELP embedder_embedding_endpoint_errors_total Failed requests per embedding endpoint\n";
+    prometheus << "# TYPE embedder_embedding_endpoint_errors_total counter\n";
+    for (const auto &ep : dispatch.endpoints) {
+      prometheus << "embedder_embedding_endpoint_errors_total{url=\"" << ep.url << "\"} " << ep.errors << "\n";
+    }
+    prometheus << "\n";
+
+    const auto workers = imp->workers_ ? imp->workers_->stats() : WorkerPool::Stats{};
+    prometheus << "# HELP embedder_http_workers_busy HTTP worker threads serving a request\n";
+    prometheus << "# TYPE embedder_http_workers_busy gauge\n";
+    prometheus << "embedder_http_workers_busy " << workers.busy << "\n\n";
+
+    prometheus << "# HELP embedder_http_streams_active Chat streams relayed outside the worker pool\n";
+    prometheus << "# TYPE embedder_http_streams_active gauge\n";
+    prometheus << "embedder_http_streams_active " << workers.detached << "\n\n";
+
+    prometheus << "# HELP embedder_http_queue_depth Connections waiting for an HTTP worker\n";
+    prometheus << "# TYPE embedder_http_queue_depth gauge\n";
+    prometheus << "embedder_http_queue_depth " << workers.queued << "\n\n";
+
+    prometheus << "# HELP embedder_http_queue_rejected_total Connections shed with 429 because the queue was full\n";
+    prometheus << "# TYPE embedder_http_queue_rejected_total counter\n";
+    prometheus << "embedder_http_queue_rejected_total " << workers.rejected << "\n\n";
+
+    prometheus << "# HELP embedder_http_queue_wait_seconds_total Time connections spent queued for a worker\n";
+    prometheus << "# TYPE embedder_http_queue_wait_seconds_total counter\n";
+    prometheus << "embedder_http_queue_wait_seconds_total " << workers.totalWaitMs / 1000.0 << "\n\n";
+
+    prometheus << "# HELP embedder_http_queue_dequeued_total Connections taken off the queue by a worker\n";
+    prometheus << "# TYPE embedder_http_queue_dequeued_total counter\n";
+    prometheus << "embedder_http_queue_dequeued_total " << workers.started << "\n\n";
+
+    const auto lanes = imp->lanes_.stats();
+    prometheus << "# HELP embedder_http_lane_active Requests in progress per route lane\n";
+    prometheus << "# TYPE embedder_http_lane_active gauge\n";
+    for (const auto &l : lanes) {
+      prometheus << "embedder_http_lane_active{lane=\"" << l.name << "\"} " << l.active << "\n";
+    }
+    prometheus << "\n";
+
+    prometheus << "# HELP embedder_http_lane_rejected_total Requests answered with 429 per route lane\n";
+    prometheus << "# TYPE embedder_http_lane_rejected_total counter\n";
+    for (const auto &l : lanes) {
+      prometheus << "embedder_http_lane_rejected_total{lane=\"" << l.name << "\"} " << l.rejected << "\n";
+    }
+    prometheus << "\n";
+
+    const auto fimCache = imp->fimCache_.stats();
+    prometheus << "# HELP embedder_fim_cache_hits_total FIM requests answered from the prefix-extension cache\n";
+    prometheus << "# TYPE embedder_fim_cache_hits_total counter\n";
+    prometheus << "embedder_fim_cache_hits_total " << fimCache.hits << "\n\n";
 
-    prometheus << "# HELP embedder_avg_chat_time_ms Average chat time in milliseconds\n";
-    prometheus << "# TYPE embedder_avg_chat_time_ms gauge\n";
-    prometheus << "embedder_avg_chat_time_ms " << Impl::avgChatTimeMs_.load() << "\n\n";
+    prometheus << "# HELP embedder_fim_cache_misses_total FIM cache lookups that needed a generation\n";
+    prometheus << "# TYPE embedder_fim_cache_misses_total counter\n";
+    prometheus << "embedder_fim_cache_misses_total " << fimCache.misses << "\n\n";
 
-    prometheus << "# HELP embedder_avg_embed_time_ms Average embedding time in milliseconds\n";
-    prometheus << "# TYPE embedder_avg_embed_time_ms gauge\n";
-    prometheus << "embedder_avg_embed_time_ms " << Impl::avgEmbedTimeMs_.load() << "\n\n";
+    prometheus << "# HELP embedder_fim_cache_entries Completions held by the FIM cache\n";
+    prometheus << "# TYPE embedder_fim_cache_entries gauge\n";
+    prometheus << "embedder_fim_cache_entries " << fimCache.entries << "\n\n";
+
+    const std::pair<const char *, TokenCountCache::Stats> tokenCaches[] = {
+      { "words", imp->app_.tokenizer().cacheStats() },
+      { "units", imp->app_.chunker().cacheStats() }
+    };
+    prometheus << "# HELP embedder_token_cache_entries Token counts held per cache\n";
+    prometheus << "# TYPE embedder_token_cache_entries gauge\n";
+    for (const auto &[name, c] : tokenCaches) {
+      prometheus << "embedder_token_cache_entries{cache=\"" << name << "\"} " << c.entries << "\n";
+    }
+    prometheus << "\n";
+
+    prometheus << "# HELP embedder_token_cache_hits_total Token count lookups answered from cache\n";
+    prometheus << "# TYPE embedder_token_cache_hits_total counter\n";
+    for (const auto &[name, c] : tokenCaches) {
+      prometheus << "embedder_token_cache_hits_total{cache=\"" << name << "\"} " << c.hits << "\n";
+    }
+    prometheus << "\n";
+
+    prometheus << "# HELP embedder_token_cache_misses_total Token count lookups that needed tokenizing\n";
+    prometheus << "# TYPE embedder_token_cache_misses_total counter\n";
+    for (const auto &[name, c] : tokenCaches) {
+      prometheus << "embedder_token_cache_misses_total{cache=\"" << name << "\"} " << c.misses << "\n";
+    }
+    prometheus << "\n";
+
+    prometheus << "# HELP embedder_token_cache_evictions_total Token counts evicted to stay within capacity\n";
+    prometheus << "# TYPE embedder_token_cache_evictions_total counter\n";
+    for (const auto &[name, c] : tokenCaches) {
+      prometheus << "embedder_token_cache_evictions_total{cache=\"" << name << "\"} " << c.evictions << "\n";
+    }
+    prometheus << "\n";
 
     // Database metrics
     try {
@@ -4,58 +4,194 @@
 #include "database.h"
 #include "settings.h"
 #include "tokenizer.h"
+#include "httppool.h"
+#include "jsonscan.h"
+#include "sse.h"
+#include "latency.h"
 #include <stdexcept>
 #include <cassert>
-#include <unordered_map>
 #include <filesystem>
 #include <cmath>  // for std::sqrt
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <httplib.h>
 #include <utils_log/logger.hpp>
 #include "3rdparty/fmt/core.h"
 
 
+namespace {
+
+  // Pulls embeddings out of a response body without building a json DOM. Understands
+  // llama-server's /embedding ([{"index":0,"embedding":[[...]]}, ...]) and the OpenAI-style
+  // /v1/embeddings ({"data":[{"index":0,"embedding":[...] or "<base64 float32>"}]}).
+  // Floats are written straight into the output vectors, sized after the first one seen.
+  // Indexes come from the server and are checked against the number of embeddings asked for.
+  class EmbeddingResponseScanner {
+  public:
+    EmbeddingResponseScanner(std::string_view s, size_t expected, std::vector<std::vector<float>> &out)
+      : c_(s), out_(out), seen_(expected, false) {
+      out_.resize(expected);
+    }
+
+    void scan() {
+      c_.skipWs();
+      if (c_.peek() == '[') {
+        scanItems();
+      } else if (c_.peek() == '{') {
+        c_.forEachKey([this](std::string_view key) {
+          if (key == "data") {
+            scanItems();
+          } else if (key == "error") {
+            throw std::runtime_error("Server returned error: " + std::string(c_.valueText()));
+          } else {
+            c_.skipValue();
+          }
+          });
+      } else {
+        throw std::runtime_error("Unexpected embedding response format");
+      }
+    }
+
+  private:
+    utils::JsonCursor c_;
+    std::vector<std::vector<float>> &out_;
+    std::vector<bool> seen_;
+    size_t ordinal_ = 0;
+    size_t dim_ = 0;
+
+    void scanItems() {
+      c_.forEachElement([this]() { scanItem(); });
+    }
+
+    void scanItem() {
+      size_t index = ordinal_++;
+      std::vector<float> embedding;
+      bool found = false;
+      c_.forEachKey([&](std::string_view key) {
+        if (key == "index") {
+          const auto s = c_.text();
+          auto [ptr, ec] = std::from_chars(s.data() + c_.pos(), s.data() + s.size(), index);
+          if (ec != std::errc()) c_.fail();
+          c_.setPos(ptr - s.data());
+        } else if (key == "embedding") {
+          readEmbedding(embedding);
+          found = true;
+        } else {
+          c_.skipValue();
+        }
+        });
+      if (!found) {
+        throw std::runtime_error("Missing or invalid 'embedding' field in response");
+      }
+      if (seen_.size() <= index || seen_[index]) {
+        throw std::runtime_error("Unexpected embedding response format");
+      }
+      seen_[index] = true;
+      out_[index] = std::move(embedding);
+    }
+
+    void readEmbedding(std::vector<float> &v) {
+      c_.skipWs();
+      if (c_.peek() == '"') {
+        decodeBase64Floats(c_.string(), v);
+        return;
+      }
+      const size_t start = c_.pos();
+      c_.expect('[');
+      c_.skipWs();
+      const bool nested = c_.peek() == '[';
+      c_.setPos(start);
+      if (nested) {
+        // llama-server nests the pooled vector; only the first row is of interest.
+        bool first = true;
+        c_.forEachElement([&]() {
+          if (first) readFloats(v);
+          else c_.skipValue();
+          first = false;
+          });
+      } else {
+        readFloats(v);
+      }
+      if (v.empty()) {
+        throw std::runtime_error("Invalid embedding structure");
+      }
+      dim_ = v.size();
+    }
+
+    void readFloats(std::vector<float> &v) {
+      v.clear();
+      v.reserve(dim_ ? dim_ : 1024);
+      const auto s = c_.text();
+      c_.forEachElement([&]() {
+        float f = 0;
+        auto [ptr, ec] = std::from_chars(s.data() + c_.pos(), s.data() + s.size(), f);
+        if (ec != std::errc()) {
+          throw std::runtime_error("Non-numeric value in embedding data");
+        }
+        c_.setPos(ptr - s.data());
+        v.push_back(f);
+        });
+    }
+
+    // Decodes little-endian float32 bytes straight into the vector storage.
+    static void decodeBase64Floats(std::string_view b64, std::vector<float> &v) {
+      static const auto table = []() {
+        std::array<uint8_t, 256> t{};
+        t.fill(0xFF);
+        const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        for (uint8_t i = 0; i < 64; ++i) t[static_cast<uint8_t>(alphabet[i])] = i;
+        return t;
+        }();
+      std::string unescaped;
+      if (b64.find('\\') != std::string_view::npos) {
+        // Json may escape '/' as "\/".
+        for (char c : b64) if (c != '\\') unescaped.push_back(c);
+        b64 = unescaped;
+      }
+      while (!b64.empty() && b64.back() == '=') b64.remove_suffix(1);
+      const size_t nBytes = b64.size() * 3 / 4;
+      if (nBytes % sizeof(float) != 0) {
+        throw std::runtime_error("Invalid base64 embedding length");
+      }
+      v.resize(nBytes / sizeof(float));
+      auto *dst = reinterpret_cast<uint8_t *>(v.data());
+      uint32_t acc = 0;
+      int bits = 0;
+      size_t o = 0;
+      for (char c : b64) {
+        const uint8_t d = table[static_cast<uint8_t>(c)];
+        if (d == 0xFF) {
+          throw std::runtime_error("Invalid base64 embedding data");
+        }
+        acc = (acc << 6) | d;
+        bits += 6;
+        if (8 <= bits) {
+          bits -= 8;
+          dst[o++] = static_cast<uint8_t>(acc >> bits);
+        }
+      }
+    }
+  };
+
+} // anonymous namespace
+
+
 struct InferenceClient::Impl {
   ApiConfig apiCfg_;
   size_t timeoutMs_ = 1000;
-  std::unordered_map<std::string, std::unique_ptr<httplib::Client>> urlToClient_;
-  std::pair<httplib::Client *, std::string> httpClientForUrl(const std::string &url);
+  HttpClientPool *pool_ = nullptr;
 };
 
-std::pair<httplib::Client *, std::string> InferenceClient::Impl::httpClientForUrl(const std::string &url)
-{
-  size_t protocolEnd = url.find("://");
-  if (protocolEnd == std::string::npos) {
-    throw std::runtime_error("Invalid server URL format");
-  }
-  size_t hostStart = protocolEnd + 3;
-  size_t pathStart = url.find("/", hostStart);
-  if (pathStart == std::string::npos) {
-    pathStart = url.size();
-  }
-  auto schemaHostPort = url.substr(0, pathStart);
-  auto path = url.substr(pathStart);
-  auto it = urlToClient_.find(schemaHostPort);
-  if (it != urlToClient_.end()) {
-    return { it->second.get(), path };
-  } else {
-    try {
-      auto client = std::make_unique<httplib::Client>(schemaHostPort);
-      client->set_connection_timeout(0, timeoutMs_ * 1000);
-      client->set_read_timeout(timeoutMs_ / 1000, (timeoutMs_ % 1000) * 1000);
-      auto ptr = client.get();
-      urlToClient_.emplace(schemaHostPort, std::move(client));
-      return { ptr, path };
-    } catch (const std::exception &e) {
-      LOG_MSG << "Error initializing http client for" << schemaHostPort << ":" << e.what();
-      return { nullptr, "" };
-    }
-  }
-}
-
-InferenceClient::InferenceClient(const ApiConfig &cfg, size_t timeout) : imp(new Impl)
+InferenceClient::InferenceClient(const ApiConfig &cfg, size_t timeout, HttpClientPool &pool) : imp(new Impl)
 {
   imp->apiCfg_ = cfg;
   imp->timeoutMs_ = timeout;
+  imp->pool_ = &pool;
 }
 
 InferenceClient::~InferenceClient()
@@ -75,8 +211,8 @@ size_t InferenceClient::timeoutMs() const
 //---------------------------------------------------------------------------
 
 
-EmbeddingClient::EmbeddingClient(const ApiConfig &cfg, size_t timeout)
-  : InferenceClient(cfg, timeout)
+EmbeddingClient::EmbeddingClient(const ApiConfig &cfg, size_t timeout, HttpClientPool &pool)
+  : InferenceClient(cfg, timeout, pool)
 {
 }
 
@@ -84,13 +220,23 @@ void EmbeddingClient::generateEmbeddings(const std::vector<std::string> &texts,
 {
   embeddingsList.reserve(texts.size());
   try {
-    const auto [httpClient, path] = imp->httpClientForUrl(cfg().apiUrl);
+    auto httpClient = imp->pool_->acquire(cfg().apiUrl, imp->timeoutMs_);
     if (!httpClient) {
       throw std::runtime_error("Failed to initialize http client");
     }
+    const std::string &path = httpClient.path();
 
+    // OpenAI-style endpoints take "input" and can return base64 float32 payloads,
+    // which are much cheaper to decode than decimal text.
+    const bool openAiStyle = path.ends_with("/embeddings");
     nlohmann::json requestBody;
-    requestBody["content"] = prepareContent(texts, et);
+    if (openAiStyle) {
+      requestBody["model"] = cfg().model;
+      requestBody["input"] = prepareContent(texts, et);
+      requestBody["encoding_format"] = cfg().encodingFormat.empty() ? "base64" : cfg().encodingFormat;
+    } else {
+      requestBody["content"] = prepareContent(texts, et);
+    }
     std::string bodyStr = requestBody.dump();
 
     httplib::Headers headers = {
@@ -100,41 +246,13 @@ void EmbeddingClient::generateEmbeddings(const std::vector<std::string> &texts,
     };
     auto res = httpClient->Post(path.c_str(), headers, bodyStr, "application/json");
     if (!res) {
+      httpClient.discard();
       throw std::runtime_error("Failed to connect to embedding server");
     }
     if (res->status != 200) {
       throw std::runtime_error("Server returned error: " + std::to_string(res->status) + " - " + res->body);
     }
-    nlohmann::json response = nlohmann::json::parse(res->body);
-    if (!response.is_array() || response.size() != texts.size()) {
-      throw std::runtime_error("Unexpected embedding response format");
-    }
-    for (size_t j = 0; j < texts.size(); j ++) {
-      assert(j < response.size());
-      if (response.size() <= j) {
-        LOG_MSG << "Not enough entries in the embedding response (asked for" << texts.size() << "but got" << response.size() << "). Skipped";
-        break;
-      }
-      const auto &item = response[j];
-      if (!item.contains("embedding") || !item["embedding"].is_array()) {
-        throw std::runtime_error("Missing or invalid 'embedding' field in response");
-      }
-      const auto &embeddingArray = item["embedding"];
-      if (embeddingArray.empty() || !embeddingArray[0].is_array()) {
-        throw std::runtime_error("Invalid embedding structure");
-      }
-      const auto &embeddingData = embeddingArray[0];
-      std::vector<float> embedding;
-      embedding.reserve(1024);
-      for (const auto &value : embeddingData) {
-        if (value.is_number()) {
-          embedding.push_back(value.get<float>());
-        } else {
-          throw std::runtime_error("Non-numeric value in embedding data");
-        }
-      }
-      embeddingsList.push_back(embedding);
-    }
+    parseEmbeddings(res->body, texts.size(), embeddingsList);
     //float l2Norm = calculateL2Norm(embedding);
     //std::cout << "[l2norm] " << l2Norm << std::endl;
   } catch (const nlohmann::json::exception &e) {
@@ -145,6 +263,18 @@ void EmbeddingClient::generateEmbeddings(const std::vector<std::string> &texts,
   }
 }
 
+void EmbeddingClient::parseEmbeddings(std::string_view body, size_t expected, std::vector<std::vector<float>> &embeddingsList)
+{
+  std::vector<std::vector<float>> parsed;
+  EmbeddingResponseScanner(body, expected, parsed).scan();
+  for (const auto &e : parsed) {
+    if (e.empty()) {
+      throw std::runtime_error("Unexpected embedding response format");
+    }
+  }
+  std::move(parsed.begin(), parsed.end(), std::back_inserter(embeddingsList));
+}
+
 void EmbeddingClient::generateEmbeddings(const std::string &text, std::vector<float> &embeddings, EmbeddingClient::EncodeType et) const
 {
   std::vector<std::vector<float>> embs;
@@ -230,71 +360,210 @@ namespace {
   )" };
 #endif
 
+  // Handles one SSE event payload of a chat/completions stream. Chunks go through the
+  // DOM-free fast path; anything else falls back to a full parse so odd payloads still work.
+  void onSSEChunk(std::string_view payload, std::string &fullResponse, const std::function<void(const std::string &)> &onStream) {
+    std::string content;
+    if (!SseParser::extractDeltaContent(payload, content)) {
+      try {
+        nlohmann::json chunkJson = nlohmann::json::parse(payload);
+        if (chunkJson.contains("choices") && !chunkJson["choices"].empty()) {
+          const auto &choice = chunkJson["choices"][0];
+          if (choice.contains("delta") && choice["delta"].contains("content")) {
+            // Either choice["delta"]["content"] or choice["delta"]["reasoning_content"]
+            if (!choice["delta"]["content"].is_null())
+              content = choice["delta"]["content"];
+            else if (choice["delta"].contains("reasoning_content") && !choice["delta"]["reasoning_content"].is_null())
+              content = choice["delta"]["reasoning_content"];
+          }
+        }
+      } catch (const std::exception &e) {
+        LOG_MSG << "Error parsing chunk" << e.what() << "in" << std::string(payload);
+        return;
+      }
+    }
+    if (content.empty()) return;
+    fullResponse += content;
+    if (onStream) {
+      onStream(content);
+    }
+  }
+
   std::string processSSEData(const char *data, size_t len, std::function<void(const std::string &)> onStream) {
     std::string fullResponse;
-    std::string buffer;
-    buffer.append(data, len);
-    size_t pos;
-    while ((pos = buffer.find("\n\n")) != std::string::npos) {
-      std::string event = buffer.substr(0, pos); // one SSE event
-      buffer.erase(0, pos + 2);
-      if (event.find("data: ", 0) == 0) {
-        std::string jsonStr = event.substr(6);
-        if (jsonStr == "[DONE]") {
-          break;
+    SseParser parser(len + 1);
+    parser.feed(data, len, [&](std::string_view payload) {
+      onSSEChunk(payload, fullResponse, onStream);
+      return true;
+      });
+    if (parser.pending().find("Unauthorized") != std::string_view::npos) {
+      if (onStream) onStream(std::string(parser.pending()));
+    }
+    return fullResponse;
+  }
+
+  // Polls a cancellation token while a request is blocked waiting for the upstream (e.g. during
+  // prompt processing, before any byte arrives) and shuts the client's socket down once it fires.
+  // Client::stop() is the one call httplib allows from another thread. All watches share one
+  // polling thread, started on first use and idle while no request is watched. Tokens are probed
+  // outside the lock, so their probes must not block.
+  class CancelWatch {
+  public:
+    CancelWatch(const CancellationToken *token, httplib::Client *client)
+      : token_(token), client_(client)
+    {
+      if (token_) watcher().add(this);
+    }
+    ~CancelWatch() {
+      if (token_) watcher().remove(this);
+    }
+
+  private:
+    class Watcher {
+    public:
+      ~Watcher() {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          finished_ = true;
         }
-        try {
-          nlohmann::json chunkJson = nlohmann::json::parse(jsonStr);
-          if (chunkJson.contains("choices") && !chunkJson["choices"].empty()) {
-            const auto &choice = chunkJson["choices"][0];
-            if (choice.contains("delta") && choice["delta"].contains("content")) {
-              // Either choice["delta"]["content"] or choice["delta"]["reasoning_content"]
-              std::string content;
-              if (!choice["delta"]["content"].is_null())
-                content = choice["delta"]["content"];
-              else if (choice["delta"].contains("reasoning_content") && !choice["delta"]["reasoning_content"].is_null())
-                content = choice["delta"]["reasoning_content"];
-              fullResponse += content;
-              if (onStream) {
-                onStream(content);
-              }
+        cv_.notify_one();
+        if (thread_.joinable()) thread_.join();
+      }
+
+      void add(CancelWatch *watch) {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          watches_.push_back(watch);
+          if (!thread_.joinable()) thread_ = std::thread([this]() { run(); });
+        }
+        cv_.notify_one();
+      }
+
+      // Holding the mutex here also keeps the client alive while run() stops it. Only a probe of
+      // this very watch is waited for; its token dies with the request.
+      void remove(CancelWatch *watch) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        std::erase(watches_, watch);
+        probed_.wait(lock, [this, watch]() { return probing_ != watch; });
+      }
+
+    private:
+      static constexpr int POLL_MS = 20;
+      std::thread thread_;
+      std::mutex mutex_;
+      std::condition_variable cv_;
+      std::condition_variable probed_;
+      std::vector<CancelWatch *> watches_;
+      const CancelWatch *probing_ = nullptr;
+      bool finished_ = false;
+
+      bool watched(const CancelWatch *watch) const {
+        return std::find(watches_.begin(), watches_.end(), watch) != watches_.end();
+      }
+
+      void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!finished_) {
+          if (watches_.empty()) {
+            cv_.wait(lock, [this]() { return finished_ || !watches_.empty(); });
+            continue;
+          }
+          const auto pending = watches_;
+          for (auto *watch : pending) {
+            if (finished_) return;
+            if (watch->stopped_ || !watched(watch)) continue;
+            probing_ = watch;
+            lock.unlock();
+            const bool cancelled = watch->token_->isCancelled();
+            lock.lock();
+            probing_ = nullptr;
+            probed_.notify_all();
+            if (cancelled && watched(watch)) {
+              watch->client_->stop();
+              watch->stopped_ = true;
             }
           }
-        } catch (const std::exception &e) {
-          LOG_MSG << "Error parsing chunk" << e.what() << " in" << jsonStr;
+          cv_.wait_for(lock, std::chrono::milliseconds(POLL_MS));
         }
       }
+    };
+
+    static Watcher &watcher() {
+      static Watcher instance;
+      return instance;
     }
-    if (buffer.find("Unauthorized") != std::string::npos) {
-      if (onStream) onStream(buffer);
-    }
-    return fullResponse;
-  }
+
+    const CancellationToken *token_;
+    httplib::Client *client_;
+    bool stopped_ = false;
+  };
 
 } // anonymous namespace
 
 CompletionClient::CompletionClient(const ApiConfig &cfg, size_t timeout, const App &a)
-  : InferenceClient(cfg, timeout)
+  : InferenceClient(cfg, timeout, a.httpPool())
   , app_(a)
 {
 }
 
+std::vector<Attachment> fitAttachments(const SimpleTokenizer &tok, std::vector<Attachment> attachments, size_t maxTokens,
+  size_t &usedTokens, const std::function<void(std::string_view)> &onInfo)
+{
+  static auto &latency = LatencyRegistry::stage("tokenize");
+  ScopedLatency timer(latency, "tokenize");
+  auto info = [&onInfo](const std::string &s) { if (onInfo) onInfo(s); };
+  std::vector<Attachment> picked;
+  std::erase_if(attachments, [](const Attachment &a) { return a.content.empty(); });
+  for (size_t j = 0; j < attachments.size(); j ++) {
+    auto &att{ attachments[j] };
+    size_t tokens = tok.countTokensWithVocab(att.content);
+    if (tokens < maxTokens * 0.2 && usedTokens + tokens < maxTokens) {
+      usedTokens += tokens;
+      info(fmt::format("Adding attachment {}", att.filename));
+      att.tokens = tokens;
+      picked.push_back(std::move(att));
+      attachments.erase(attachments.begin() + j);
+      j --;
+    }
+  }
+  for (const auto &att : attachments) {
+    if (maxTokens <= usedTokens) break;
+    // Scans only as far as the remaining budget reaches.
+    size_t tokens = 0;
+    const size_t len = tok.prefixWithinTokens(att.content, maxTokens - usedTokens, &tokens);
+    if (len == 0) continue; // not even its first token fits, a later one may
+    info(fmt::format("Adding attachment {}", att.filename));
+    usedTokens += tokens;
+    const bool truncated = len < att.content.length();
+    if (truncated) {
+      auto percent = int((len / double(att.content.length())) * 100);
+      LOG_MSG << fmt::format("Warning: Attachment too large, truncated to {}% of {}", percent, att.filename);
+      info(fmt::format("{} truncated to {}% ", att.filename, percent));
+    }
+    picked.push_back({ att.filename, att.content.substr(0, len), tokens });
+    if (truncated) break;
+  }
+  return picked;
+}
+
 std::string CompletionClient::generateCompletion(
   const nlohmann::json &messagesJson,
   const std::vector<SearchResult> &searchRes,
   float temperature,
   size_t maxTokens,
-  std::function<void(const std::string &)> onStream) const
+  std::function<void(const std::string &)> onStream,
+  const CancellationToken *cancel) const
 {
 #ifndef CPPHTTPLIB_OPENSSL_SUPPORT
-  if (schemaHostPort().starts_with("https://")) {
+  if (cfg().apiUrl.starts_with("https://")) {
     throw std::runtime_error("HTTPS not supported in this build");
   }
 #endif
-  const auto [httpClient, path] = imp->httpClientForUrl(cfg().apiUrl);
+  auto httpClient = imp->pool_->acquire(cfg().apiUrl, imp->timeoutMs_);
   if (!httpClient) {
     throw std::runtime_error("Failed to initialize http client");
   }
+  const std::string &path = httpClient.path();
 
   /*
   * Json Request body format.
@@ -312,7 +581,11 @@ std::string CompletionClient::generateCompletion(
     onStream("[meta]Working on the response");
   }
 
-  std::string context = buildContext(searchRes);
+  std::string context;
+  {
+    TraceSpan span("prompt_build");
+    context = buildContext(searchRes);
+  }
 
   std::string prompt = _queryTemplate;
   size_t pos = prompt.find("__CONTEXT__");
@@ -345,55 +618,37 @@ std::string CompletionClient::generateCompletion(
 
   std::string fullResponse;
   httplib::Result res;
+  CancelWatch watch(cancel, httpClient.get());
+  static auto &ttftLatency = LatencyRegistry::stage("generation_ttft");
+  static auto &generationLatency = LatencyRegistry::stage("generation_total");
+  ScopedLatency generation(generationLatency, "generation_total");
+  const auto requestStart = std::chrono::steady_clock::now();
 
   if (cfg().stream) {
     headers.insert({ "Accept", "text/event-stream" });
 
-    std::string buffer; // holds leftover partial data
-
+    SseParser parser;
     res = httpClient->Post(
       path.c_str(),
       headers,
       requestBody.dump(),
       "application/json",
-      [&fullResponse, &onStream, &buffer](const char *data, size_t len) {
-        // llama-server sends SSE format: "data: {...}\n\n"
-        buffer.append(data, len);
-        size_t pos;
-        while ((pos = buffer.find("\n\n")) != std::string::npos) {
-          std::string event = buffer.substr(0, pos); // one SSE event
-          buffer.erase(0, pos + 2);
-          if (event.find("data: ", 0) == 0) {
-            std::string jsonStr = event.substr(6);
-            if (jsonStr == "[DONE]") {
-              break;
-            }
-            try {
-              nlohmann::json chunkJson = nlohmann::json::parse(jsonStr);
-              if (chunkJson.contains("choices") && !chunkJson["choices"].empty()) {
-                const auto &choice = chunkJson["choices"][0];
-                if (choice.contains("delta") && choice["delta"].contains("content")) {
-                  // Either choice["delta"]["content"] or choice["delta"]["reasoning_content"]
-                  std::string content;
-                  if (!choice["delta"]["content"].is_null())
-                    content = choice["delta"]["content"];
-                  else if (choice["delta"].contains("reasoning_content") && !choice["delta"]["reasoning_content"].is_null())
-                    content = choice["delta"]["reasoning_content"];
-                  fullResponse += content;
-                  if (onStream) {
-                    onStream(content);
-                  }
-                }
-              }
-            } catch (const std::exception &e) {
-              LOG_MSG << "Error parsing chunk" << e.what() << "in" << jsonStr;
-            }
+      [&fullResponse, &onStream, &parser, &requestStart, cancel](const char *data, size_t len) {
+        parser.feed(data, len, [&](std::string_view payload) {
+          const bool first = fullResponse.empty();
+          onSSEChunk(payload, fullResponse, onStream);
+          if (first && !fullResponse.empty()) {
+            const auto now = std::chrono::steady_clock::now();
+            ttftLatency.record(now - requestStart);
+            if (auto *trace = RequestTrace::current()) trace->add("generation_ttft", requestStart, now);
           }
+          return !(cancel && cancel->isCancelled());
+          });
+        if (parser.pending().find("Unauthorized") != std::string_view::npos) {
+          if (onStream) onStream(std::string(parser.pending()));
         }
-        if (buffer.find("Unauthorized") != std::string::npos) {
-          if (onStream) onStream(buffer);
-        }
-        return true; // Continue receiving
+        // Returning false aborts the upstream request.
+        return !(cancel && cancel->isCancelled());
       }
     );
 
@@ -421,7 +676,13 @@ std::string CompletionClient::generateCompletion(
     }
   }
 
+  if (cancel && cancel->isCancelled()) {
+    httpClient.discard();
+    return fullResponse;
+  }
+
   if (!res) {
+    httpClient.discard();
     throw std::runtime_error("Failed to connect to completion server");
   }
 
@@ -440,10 +701,11 @@ std::string CompletionClient::generateFim(
   const std::vector<std::string> &stops,
   float temperature, 
   size_t maxTokens,
-  const std::vector<SearchResult> &searchRes) const
+  const std::vector<SearchResult> &searchRes,
+  const CancellationToken *cancel) const
 {
 #ifndef CPPHTTPLIB_OPENSSL_SUPPORT
-  if (schemaHostPort().starts_with("https://")) {
+  if (cfg().apiUrl.starts_with("https://")) {
     throw std::runtime_error("HTTPS not supported in this build");
   }
 #endif
@@ -457,12 +719,17 @@ std::string CompletionClient::generateFim(
 
   fimStopTokens.insert(fimStopTokens.end(), stops.begin(), stops.end());
 
-  const auto [httpClient, path] = imp->httpClientForUrl(apiUrl);
+  auto httpClient = imp->pool_->acquire(apiUrl, imp->timeoutMs_);
   if (!httpClient) {
     throw std::runtime_error("Failed to initialize http client");
   }
+  const std::string &path = httpClient.path();
 
-  std::string context = buildContext(searchRes, true, cfg.fim.fileDivider);
+  std::string context;
+  {
+    TraceSpan span("prompt_build");
+    context = buildContext(searchRes, true, cfg.fim.fileDivider);
+  }
 
   nlohmann::json requestBody;
   requestBody["model"] = cfg.model;
@@ -508,18 +775,34 @@ std::string CompletionClient::generateFim(
   };
 
   std::string fullResponse;
+  std::string body;
   httplib::Result res;
 
-  res = httpClient->Post(
-    path.c_str(),
-    headers,
-    requestBody.dump(),
-    "application/json"
-  );
+  {
+    static auto &latency = LatencyRegistry::stage("fim_generation");
+    ScopedLatency timer(latency, "fim_generation");
+    CancelWatch watch(cancel, httpClient.get());
+    // Receive the body ourselves so the request can be aborted mid-transfer.
+    res = httpClient->Post(
+      path.c_str(),
+      headers,
+      requestBody.dump(),
+      "application/json",
+      [&body, cancel](const char *data, size_t len) {
+        body.append(data, len);
+        return !(cancel && cancel->isCancelled());
+      }
+    );
+  }
+
+  if (cancel && cancel->isCancelled()) {
+    httpClient.discard();
+    return {};
+  }
 
   if (res && res->status == 200) {
     try {
-      nlohmann::json jsonRes = nlohmann::json::parse(res->body);
+      nlohmann::json jsonRes = nlohmann::json::parse(body);
       //LOG_MSG << "FIM Response:" << res->body;
       if (!jsonRes["choices"].empty()) {
         const auto &choice = jsonRes["choices"][0];
@@ -532,7 +815,7 @@ std::string CompletionClient::generateFim(
     } catch (...) {
       try {
         // fallback, assuming the response is SSE stream
-        fullResponse = processSSEData(res->body.c_str(), res->body.length(), nullptr);
+        fullResponse = processSSEData(body.c_str(), body.length(), nullptr);
       } catch (const std::exception &ex) {
         LOG_MSG << "Error processing response:" << ex.what();
       }
@@ -549,11 +832,12 @@ std::string CompletionClient::generateFim(
   }
 
   if (!res) {
+    httpClient.discard();
     throw std::runtime_error("Failed to connect to completion server");
   }
 
   if (res->status != 200) {
-    std::string msg = fmt::format("Server returned error: {} - {}", res->status, res->body);
+    std::string msg = fmt::format("Server returned error: {} - {}", res->status, body);
     throw std::runtime_error(msg);
   }
   return fullResponse;
@@ -563,7 +847,8 @@ std::string CompletionClient::buildContext(const std::vector<SearchResult> &sear
 {
   const auto labelFmt = app_.settings().generationPrependLabelFormat();
   const auto maxContextTokens = cfg().contextLength;
-  size_t nofTokens = app_.tokenizer().countTokensWithVocab(_queryTemplate);
+  const auto &tok = app_.tokenizer(cfg());
+  size_t nofTokens = tok.countTokensWithVocab(_queryTemplate);
   std::string context;
   for (const auto &r : searchRes) {
     std::string filename = std::filesystem::path(r.sourceId).filename().string();
@@ -572,8 +857,16 @@ std::string CompletionClient::buildContext(const std::vector<SearchResult> &sear
     // avoid double-labeling
     bool alreadyLabeled = (r.content.rfind(label, 0) == 0);
 
-    size_t contentTokens = app_.tokenizer().countTokensWithVocab(r.content);
-    size_t labelTokens = alreadyLabeled ? 0 : app_.tokenizer().countTokensWithVocab(label);
+    // Results carry the count taken when they were indexed or gathered; it is used when taken by tok.
+    const auto *countedBy = r.countedBy ? r.countedBy : &app_.tokenizer();
+    const bool storedCount = r.tokenCount != std::string::npos && countedBy == &tok;
+    size_t contentTokens = r.tokenCount;
+    if (!storedCount) {
+      static auto &latency = LatencyRegistry::stage("tokenize");
+      ScopedLatency timer(latency, "tokenize");
+      contentTokens = tok.countTokensWithVocab(r.content);
+    }
+    size_t labelTokens = alreadyLabeled ? 0 : tok.countTokensWithVocab(label);
 
     if (maxContextTokens < nofTokens + labelTokens + contentTokens) {
       size_t remaining = (nofTokens < maxContextTokens) ? (maxContextTokens - nofTokens) : 0;
@@ -584,19 +877,13 @@ std::string CompletionClient::buildContext(const std::vector<SearchResult> &sear
       size_t remainingContentTokens = remaining - labelTokens;
       if (remainingContentTokens == 0) break;
 
-      // approximate characters for remainingContentTokens
-      size_t approxCharCount = r.content.length();
-      if (0 < contentTokens) {
-        approxCharCount = r.content.length() * remainingContentTokens / contentTokens;
-      }
-
-      std::string excerpt = r.content.substr(0, approxCharCount);
+      std::string excerpt = r.content.substr(0, tok.prefixWithinTokens(r.content, remainingContentTokens));
 
       std::string labeledExcerpt = alreadyLabeled ? excerpt : (label + excerpt);
       if (commentOut) 
         labeledExcerpt = utils::addLineComments(labeledExcerpt, filename);
       context += fileDivider + labeledExcerpt + "\n\n";
-      nofTokens += app_.tokenizer().countTokensWithVocab(labeledExcerpt);
+      nofTokens += tok.countTokensWithVocab(labeledExcerpt);
       break;
     }
     // full add
@@ -0,0 +1,177 @@
+#include "latency.h"
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+
+namespace {
+
+  // Each thread sticks to one shard, so concurrent recorders rarely touch the same cache line.
+  size_t currentShard() {
+    thread_local const size_t shard = std::hash<std::thread::id>{}(std::this_thread::get_id()) % LatencyHistogram::SHARDS;
+    return shard;
+  }
+
+  struct Registry {
+    std::mutex mutex;
+    std::map<std::pair<LatencyRegistry::Kind, std::string>, std::unique_ptr<LatencyHistogram>> histograms;
+
+    LatencyHistogram &get(LatencyRegistry::Kind kind, const std::string &name) {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto &h = histograms[{ kind, name }];
+      if (!h) h = std::make_unique<LatencyHistogram>();
+      return *h;
+    }
+  };
+
+  Registry &registry() {
+    static Registry r;
+    return r;
+  }
+
+  thread_local RequestTrace *currentTrace = nullptr;
+
+} // anonymous namespace
+
+
+size_t LatencyHistogram::bucketOf(uint64_t micros)
+{
+  if (micros < 8) return static_cast<size_t>(micros);
+  size_t e = 63;
+  while (!(micros >> e)) --e;
+  const size_t sub = (micros >> (e - 2)) & 3;
+  return (std::min)(8 + (e - 3) * 4 + sub, BUCKETS - 1);
+}
+
+uint64_t LatencyHistogram::bucketUpperMicros(size_t bucket)
+{
+  if (bucket < 8) return bucket + 1;
+  const size_t e = 3 + (bucket - 8) / 4;
+  const size_t sub = (bucket - 8) % 4;
+  return uint64_t(4 + sub + 1) << (e - 2);
+}
+
+void LatencyHistogram::record(double ms)
+{
+  const uint64_t micros = ms <= 0 ? 0 : static_cast<uint64_t>(ms * 1000.0);
+  auto &shard = shards_[currentShard()];
+  shard.counts[bucketOf(micros)].fetch_add(1, std::memory_order_relaxed);
+  shard.sumMicros.fetch_add(micros, std::memory_order_relaxed);
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const
+{
+  Snapshot s;
+  uint64_t sumMicros = 0;
+  for (const auto &shard : shards_) {
+    for (size_t i = 0; i < BUCKETS; ++i) {
+      s.counts[i] += shard.counts[i].load(std::memory_order_relaxed);
+    }
+    sumMicros += shard.sumMicros.load(std::memory_order_relaxed);
+  }
+  for (auto c : s.counts) s.count += c;
+  s.sumMs = sumMicros / 1000.0;
+  return s;
+}
+
+double LatencyHistogram::Snapshot::percentileMs(double q) const
+{
+  if (count == 0) return 0;
+  const double rank = std::clamp(q, 0.0, 1.0) * count;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < BUCKETS; ++i) {
+    if (counts[i] == 0) continue;
+    if (rank <= seen + counts[i]) {
+      const double lo = i == 0 ? 0.0 : double(bucketUpperMicros(i - 1));
+      const double hi = double(bucketUpperMicros(i));
+      const double frac = (rank - seen) / counts[i];
+      return (lo + (hi - lo) * frac) / 1000.0;
+    }
+    seen += counts[i];
+  }
+  return bucketUpperMicros(BUCKETS - 1) / 1000.0;
+}
+
+
+LatencyHistogram &LatencyRegistry::endpoint(const std::string &name)
+{
+  return registry().get(Kind::Endpoint, name);
+}
+
+LatencyHistogram &LatencyRegistry::stage(const std::string &name)
+{
+  return registry().get(Kind::Stage, name);
+}
+
+std::vector<LatencyRegistry::Entry> LatencyRegistry::entries()
+{
+  auto &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  std::vector<Entry> res;
+  for (const auto &[key, h] : r.histograms) {
+    res.push_back({ key.first, key.second, h.get() });
+  }
+  return res;
+}
+
+
+void RequestTrace::reset(Clock::time_point start)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  start_ = start;
+  spans_.clear();
+}
+
+void RequestTrace::add(std::string_view name, Clock::time_point start, Clock::time_point end)
+{
+  const double startMs = std::chrono::duration<double, std::milli>(start - start_).count();
+  const double durationMs = std::chrono::duration<double, std::milli>(end - start).count();
+  std::lock_guard<std::mutex> lock(mutex_);
+  // A request has a handful of distinct stages, a linear scan beats any map here.
+  auto it = std::find_if(spans_.begin(), spans_.end(), [name](const Span &s) { return s.name == name; });
+  if (it == spans_.end()) {
+    spans_.push_back({ std::string(name), startMs, durationMs, 1 });
+  } else {
+    it->durationMs += durationMs;
+    it->count++;
+  }
+}
+
+double RequestTrace::elapsedMs() const
+{
+  return std::chrono::duration<double, std::milli>(Clock::now() - start_).count();
+}
+
+std::vector<RequestTrace::Span> RequestTrace::spans() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return spans_;
+}
+
+std::string RequestTrace::serverTiming() const
+{
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "%.1f", elapsedMs());
+  std::string res = std::string("total;dur=") + buf;
+  for (const auto &s : spans()) {
+    std::snprintf(buf, sizeof(buf), "%.1f", s.durationMs);
+    res += ", " + s.name + ";dur=" + buf;
+  }
+  return res;
+}
+
+RequestTrace *RequestTrace::current()
+{
+  return currentTrace;
+}
+
+RequestTrace *RequestTrace::setCurrent(RequestTrace *trace)
+{
+  auto *prev = currentTrace;
+  currentTrace = trace;
+  return prev;
+}
@@ -2,7 +2,7 @@
 #include <utils_log/logger.hpp>
 
 #ifdef _DEBUG
-extern void runUnitTests();
+extern int runUnitTests();
 #endif
 
 //#define TEST_CHUNKING
@@ -65,7 +65,7 @@ int main(int argc, char *argv[]) {
 #endif
 
 #ifdef _DEBUG
-  runUnitTests();
+  if (runUnitTests() != 0) return 1;
 #endif
 
   return App::run(argc, argv);
@@ -22,6 +22,12 @@ namespace {
     cfg.name = item.value("name", "");
     cfg.apiUrl = item.value("api_url", item.value("apiUrl", ""));
     cfg.apiKey = expandEnvVar(item.value("api_key", item.value("apiKey", "")));
+    if (item.contains("replica_urls") && item["replica_urls"].is_array()) {
+      for (const auto &u : item["replica_urls"]) {
+        if (u.is_string())
+          cfg.replicaUrls.push_back(u.get<std::string>());
+      }
+    }
     cfg.model = item.value("model", "");
     cfg.maxTokensName = item.value("max_tokens_name", section.value("default_max_tokens_name", "max_tokens"));
 
@@ -41,11 +47,13 @@ namespace {
     }
     
     cfg.documentFormat = item.value("document_format", "");
+    cfg.encodingFormat = item.value("encoding_format", "");
     cfg.queryFormat = item.value("query_format", "");
     cfg.temperatureSupport = item.value("temperature_support", true);
     cfg.enabled = item.value("enabled", true);
     cfg.stream = item.value("stream", true);
     cfg.contextLength = item.value("context_length", section.value("max_context_tokens", 32000));
+    cfg.tokenizerPath = item.value("tokenizer_path", "");
     if (item.contains("pricing_tpm")) {
       auto pricing = item["pricing_tpm"];
       if (pricing.is_object()) {
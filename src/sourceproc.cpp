@@ -1,5 +1,6 @@
 #include "sourceproc.h"
 #include "settings.h"
+#include "latency.h"
 #include <iostream>
 #include <fstream>
 #include <exception>
@@ -43,6 +44,8 @@ std::vector<SourceProcessor::Data> SourceProcessor::collectSources(bool readCont
 SourceProcessor::Data SourceProcessor::fetchSource(const std::string &uri) const
 {
   LOG_START;
+  static auto &latency = LatencyRegistry::stage("source_fetch");
+  ScopedLatency timer(latency, "source_fetch");
   std::vector<SourceProcessor::Data> res;
   bool isUrl = (uri.find("://") != std::string::npos);
   if (isUrl) {
@@ -0,0 +1,143 @@
+#include "sse.h"
+#include "jsonscan.h"
+#include <algorithm>
+#include <cstring>
+
+
+SseParser::SseParser(size_t initialCapacity)
+{
+  buf_.resize((std::max)(initialCapacity, size_t(64)));
+}
+
+void SseParser::append(const char *data, size_t len)
+{
+  if (buf_.size() < end_ + len) {
+    // Reclaim the consumed head before growing.
+    if (0 < eventStart_) {
+      const size_t shift = eventStart_;
+      std::memmove(buf_.data(), buf_.data() + shift, end_ - shift);
+      end_ -= shift;
+      lineStart_ -= shift;
+      if (hasData_ && !multiData_) dataStart_ -= shift;
+      eventStart_ = 0;
+    }
+    if (buf_.size() < end_ + len) {
+      buf_.resize((std::max)(buf_.size() * 2, end_ + len));
+    }
+  }
+  std::memcpy(buf_.data() + end_, data, len);
+  end_ += len;
+}
+
+bool SseParser::feed(const char *data, size_t len, const EventHandler &onEvent)
+{
+  if (done_) return false;
+  append(data, len);
+  // Everything before the new bytes was already scanned for line ends.
+  size_t scan = end_ - len;
+
+  while (scan < end_) {
+    const char *base = buf_.data();
+    const void *nl = std::memchr(base + scan, '\n', end_ - scan);
+    if (!nl) break;
+    const size_t lineEnd = static_cast<const char *>(nl) - base;
+    std::string_view line(base + lineStart_, lineEnd - lineStart_);
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    const size_t lineOffset = lineStart_;
+    lineStart_ = scan = lineEnd + 1;
+
+    if (line.empty()) {
+      // Blank line terminates the event.
+      bool more = true;
+      if (hasData_) {
+        std::string_view payload = multiData_ ? std::string_view(multi_) : std::string_view(base + dataStart_, dataLen_);
+        if (payload == "[DONE]") {
+          done_ = true;
+          more = false;
+        } else {
+          more = onEvent(payload);
+        }
+      }
+      hasData_ = multiData_ = false;
+      multi_.clear();
+      eventStart_ = lineStart_;
+      if (!more) {
+        done_ = true;
+        return false;
+      }
+      continue;
+    }
+    if (!line.starts_with("data:")) {
+      continue; // comments, event:, id:, retry:
+    }
+    size_t off = 5;
+    if (off < line.size() && line[off] == ' ') ++off;
+    const std::string_view value = line.substr(off);
+    if (!hasData_) {
+      hasData_ = true;
+      dataStart_ = lineOffset + off;
+      dataLen_ = value.size();
+    } else {
+      if (!multiData_) {
+        multi_.assign(base + dataStart_, dataLen_);
+        multiData_ = true;
+      }
+      multi_.push_back('\n');
+      multi_.append(value);
+    }
+  }
+  return true;
+}
+
+std::string_view SseParser::pending() const
+{
+  return std::string_view(buf_.data() + eventStart_, end_ - eventStart_);
+}
+
+bool SseParser::extractDeltaContent(std::string_view payload, std::string &out)
+{
+  utils::JsonCursor c(payload);
+  std::string_view content, reasoning, text;
+  bool hasContent = false, hasReasoning = false, hasText = false, isChunk = false;
+  try {
+    c.forEachKey([&](std::string_view key) {
+      if (key != "choices") {
+        c.skipValue();
+        return;
+      }
+      isChunk = true;
+      bool first = true;
+      c.forEachElement([&]() {
+        if (!first) {
+          c.skipValue();
+          return;
+        }
+        first = false;
+        c.forEachKey([&](std::string_view ck) {
+          if (ck == "text") {
+            if (!c.null()) { text = c.string(); hasText = true; }
+          } else if (ck == "delta") {
+            c.forEachKey([&](std::string_view dk) {
+              if (dk == "content") {
+                if (!c.null()) { content = c.string(); hasContent = true; }
+              } else if (dk == "reasoning_content") {
+                if (!c.null()) { reasoning = c.string(); hasReasoning = true; }
+              } else {
+                c.skipValue();
+              }
+              });
+          } else {
+            c.skipValue();
+          }
+          });
+        });
+      });
+  } catch (const std::exception &) {
+    return false;
+  }
+  if (!isChunk) return false;
+  if (hasContent) utils::appendUnescaped(content, out);
+  else if (hasReasoning) utils::appendUnescaped(reasoning, out);
+  else if (hasText) utils::appendUnescaped(text, out);
+  return true;
+}
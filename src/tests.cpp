@@ -1,7 +1,25 @@
 #include "cutils.h"
+#include "inference.h"
+#include "sse.h"
+#include "fimcache.h"
+#include "tokencache.h"
+#include "workerpool.h"
+#include "latency.h"
+#include "wordpiece.h"
+#include "tokenizer.h"
+#include "chunker.h"
+#include "json_shim.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace {
@@ -28,10 +46,545 @@ namespace {
     return ok;
   }
 
+  bool test_parseEmbeddings(const char *name, std::string_view body, const std::vector<std::vector<float>> &expected) {
+    std::vector<std::vector<float>> out;
+    std::string error;
+    try {
+      EmbeddingClient::parseEmbeddings(body, expected.size(), out);
+    } catch (const std::exception &e) {
+      error = e.what();
+    }
+    bool ok = error.empty() && out == expected;
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << name << "\n";
+    if (!ok) {
+      std::cout << "  input   : " << body << "\n";
+      if (!error.empty()) std::cout << "  error   : " << error << "\n";
+    }
+    return ok;
+  }
+
+  // A malformed response has to be rejected, not half parsed.
+  bool test_parseEmbeddingsRejects(const char *name, std::string_view body, size_t expected) {
+    std::vector<std::vector<float>> out;
+    bool ok = false;
+    try {
+      EmbeddingClient::parseEmbeddings(body, expected, out);
+    } catch (const std::exception &) {
+      ok = out.empty();
+    }
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << name << "\n";
+    return ok;
+  }
+
+  // Feeds the stream in every chunk size from 1 to its length, so events straddle reads at each offset.
+  bool test_sseStream() {
+    const std::string stream =
+      "data: {\"choices\":[{\"delta\":{\"content\":\"He\\nl\\u00e9\"}}]}\n\n"
+      ": keep-alive\n\n"
+      "data: {\"choices\":[{\"delta\":{\"content\":null,\"reasoning_content\":\"R\"}}]}\r\n\r\n"
+      "data: [DONE]\n\n"
+      "data: {\"choices\":[{\"delta\":{\"content\":\"late\"}}]}\n\n";
+    const std::string expected = "He\nl\xC3\xA9R";
+    for (size_t step = 1; step <= stream.size(); ++step) {
+      SseParser parser(64);
+      std::string out;
+      for (size_t i = 0; i < stream.size(); i += step) {
+        parser.feed(stream.data() + i, (std::min)(step, stream.size() - i), [&](std::string_view payload) {
+          return SseParser::extractDeltaContent(payload, out);
+          });
+      }
+      if (out != expected || !parser.done()) {
+        std::cout << "[FAIL] sse_stream (chunk size " << step << ")\n";
+        std::cout << "  got     : " << out << "\n";
+        return false;
+      }
+    }
+    std::cout << "[PASS] sse_stream\n";
+    return true;
+  }
+
+  bool test_fimCache() {
+    FimCache cache(2);
+    const std::string prefix(100, 'p');
+    cache.store("api\na.cpp", prefix + "int ", ";\n}", "x = 42");
+    bool ok = cache.lookup("api\na.cpp", prefix + "int x =", ";\n}") == std::optional<std::string>(" 42")
+      && cache.lookup("api\na.cpp", prefix + "int ", ";\n}") == std::optional<std::string>("x = 42")
+      && !cache.lookup("api\na.cpp", prefix + "int y", ";\n}")     // diverged from the completion
+      && !cache.lookup("api\na.cpp", prefix + "int x = 42", ";\n}") // nothing left to complete
+      && !cache.lookup("api\na.cpp", prefix + "int x", "}")         // different suffix
+      && !cache.lookup("api\nb.cpp", prefix + "int x", ";\n}");     // different file
+    cache.store("api\na.cpp", "b", "", "1");
+    cache.store("api\na.cpp", "c", "", "2");
+    ok = ok && !cache.lookup("api\na.cpp", prefix + "int x", ";\n}") // evicted
+      && cache.stats().entries == 2 && cache.stats().hits == 2;
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "fim_cache\n";
+    return ok;
+  }
+
+  bool test_tokenCountCache() {
+    TokenCountCache cache(32); // 2 entries per shard
+    auto length = [](std::string_view s) { return s.size(); };
+    bool ok = true;
+    // Concurrent fills stay within capacity and always return the computed value.
+    std::vector<std::future<bool>> workers;
+    for (int t = 0; t < 4; ++t) {
+      workers.push_back(std::async(std::launch::async, [&cache, &length, t]() {
+        bool good = true;
+        for (size_t i = 0; i < 2000; ++i) {
+          const std::string key = std::string(i % 40 + 1, 'a' + static_cast<char>(t)); // 160 keys for 32 entries
+          good = good && cache.get(key, length) == key.size();
+        }
+        return good;
+        }));
+    }
+    for (auto &w : workers) ok = ok && w.get();
+    const auto st = cache.stats();
+    ok = ok && st.capacity == 32 && st.entries <= 32 && 0 < st.evictions && 0 < st.hits;
+
+    // A short key repeated by this thread is answered by its front, whatever the shards evicted
+    // since; long keys only go to the shards.
+    size_t n = 0;
+    cache.insert("word", 7);
+    for (int i = 0; i < 100; ++i) cache.insert(std::string(64, 'f') + std::to_string(i), 1);
+    ok = ok && cache.find("word", n) && n == 7;
+
+    // Caches used side by side each keep their own front: alternating between two of them (ids 4
+    // apart, which once shared a front slot) still answers every short key from the fronts.
+    {
+      std::vector<std::unique_ptr<TokenCountCache>> caches;
+      for (int i = 0; i < 5; ++i) caches.push_back(std::make_unique<TokenCountCache>(16));
+      auto &a = *caches.front();
+      auto &b = *caches.back();
+      a.insert("word", 1);
+      b.insert("word", 2);
+      for (int i = 0; i < 100; ++i) {
+        const auto longKey = std::string(64, 'g') + std::to_string(i);
+        a.insert(longKey, 1);
+        b.insert(longKey, 1);
+      }
+      size_t hits = 0;
+      for (int i = 0; i < 200; ++i) {
+        auto &c = i % 2 ? b : a;
+        hits += c.find("word", n) && n == (i % 2 ? 2u : 1u);
+      }
+      ok = ok && hits == 200;
+    }
+
+    TokenCountCache disabled(0);
+    ok = ok && disabled.get("abc", length) == 3 && !disabled.find("abc", n) && disabled.stats().entries == 0;
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "token_count_cache\n";
+    return ok;
+  }
+
+  // A single-worker pool must still run queued tasks while its only worker sits in a detached task.
+  bool test_workerPoolDetach() {
+    std::promise<void> second;
+    auto secondRan = second.get_future().share();
+    bool ok = false;
+    {
+      WorkerPool pool(1);
+      pool.enqueue([&]() {
+        WorkerPool::detachCurrent();
+        ok = secondRan.wait_for(std::chrono::seconds(2)) == std::future_status::ready;
+        });
+      pool.enqueue([&]() { second.set_value(); });
+    }
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "worker_pool_detach\n";
+    return ok;
+  }
+
+  // Streams detach from a 2-worker pool while the next request on their connection waits.
+  bool test_workerPoolStreamsBounded() {
+    constexpr size_t STREAMS = 6;
+    std::promise<void> streamsEnd, connectionsEnd;
+    auto streaming = streamsEnd.get_future().share();
+    auto connected = connectionsEnd.get_future().share();
+    auto waitFor = [](auto pred) {
+      for (int i = 0; i < 200 && !pred(); ++i) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      return pred();
+      };
+    bool ok = false;
+    {
+      WorkerPool pool(2);
+      for (size_t i = 0; i < STREAMS; ++i) {
+        pool.enqueue([&]() {
+          {
+            WorkerPool::DetachScope detached;
+            streaming.wait();
+          }
+          connected.wait();
+          });
+      }
+      // Two streams leave the pool, the replacements keep their slots and the rest queue.
+      ok = waitFor([&]() { const auto s = pool.stats(); return s.detached == 2 && s.busy == 2; });
+      auto s = pool.stats();
+      ok = ok && s.threads == 4 && s.queued == STREAMS - 4;
+      streamsEnd.set_value();
+      // Ended streams serve their connections as pool workers.
+      ok = ok && waitFor([&]() { const auto s = pool.stats(); return s.detached == 0 && s.busy == 4; });
+      s = pool.stats();
+      ok = ok && s.threads == 4 && s.workers == 4;
+      connectionsEnd.set_value();
+      ok = ok && waitFor([&]() {
+        const auto s = pool.stats();
+        return s.started == STREAMS && s.busy == 0 && s.detached == 0 && s.workers == 2 && s.threads == 2;
+        });
+    }
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "worker_pool_streams_bounded\n";
+    return ok;
+  }
+
+  // A chat lane wider than the pool: every admitted stream leaves the pool, so a short request
+  // still gets a worker, and one stream past the cap keeps its slot.
+  bool test_workerPoolDetachCap() {
+    constexpr size_t STREAMS = 5;
+    std::promise<void> streamsEnd, shortRan;
+    auto streaming = streamsEnd.get_future().share();
+    auto ran = shortRan.get_future();
+    std::atomic<size_t> refused{ 0 };
+    bool ok = false;
+    {
+      WorkerPool pool(2, 0, STREAMS);
+      for (size_t i = 0; i < STREAMS + 1; ++i) {
+        pool.enqueue([&]() {
+          WorkerPool::DetachScope detached;
+          if (!detached) refused++;
+          streaming.wait();
+          });
+      }
+      pool.enqueue([&]() { shortRan.set_value(); });
+      ok = ran.wait_for(std::chrono::seconds(2)) == std::future_status::ready;
+      for (int i = 0; i < 200 && refused == 0; ++i) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      const auto s = pool.stats();
+      ok = ok && s.detached == STREAMS && refused == 1 && s.threads <= 2 + STREAMS;
+      streamsEnd.set_value();
+    }
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "worker_pool_detach_cap\n";
+    return ok;
+  }
+
+  bool test_latencyHistogram() {
+    bool ok = true;
+    // Buckets tile the range without gaps and each value lands in the bucket bounding it.
+    for (uint64_t us = 0; us < 100'000 && ok; us += 1 + us / 7) {
+      const size_t b = LatencyHistogram::bucketOf(us);
+      const uint64_t lo = b == 0 ? 0 : LatencyHistogram::bucketUpperMicros(b - 1);
+      ok = lo <= us && us < LatencyHistogram::bucketUpperMicros(b);
+    }
+    LatencyHistogram h;
+    for (int i = 1; i <= 1000; ++i) h.record(double(i)); // 1..1000 ms
+    const auto snap = h.snapshot();
+    auto near = [](double v, double expected) { return expected * 0.75 <= v && v <= expected * 1.25; };
+    ok = ok && snap.count == 1000 && near(snap.percentileMs(0.5), 500) && near(snap.percentileMs(0.99), 990)
+      && near(snap.sumMs, 500500);
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "latency_histogram\n";
+    return ok;
+  }
+
+  bool test_requestTrace() {
+    RequestTrace trace;
+    {
+      RequestTrace::Scope scope(trace);
+      for (int i = 0; i < 3; ++i) TraceSpan span("source_fetch");
+      { TraceSpan span("tokenize"); }
+    }
+    { TraceSpan span("untraced"); } // no current trace
+    const auto spans = trace.spans();
+    const auto timing = trace.serverTiming();
+    bool ok = RequestTrace::current() == nullptr && spans.size() == 2
+      && spans[0].name == "source_fetch" && spans[0].count == 3 && spans[1].name == "tokenize"
+      && timing.starts_with("total;dur=") && timing.find(", source_fetch;dur=") != std::string::npos;
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "request_trace\n";
+    return ok;
+  }
+
+  bool test_wordPieceVocab() {
+    const std::vector<std::string> tokens = { "un", "una", "##aff", "##able", "##a", "##ble", "aff", "##", "x" };
+    const WordPieceVocab vocab(tokens);
+    // Reference: the substr + "##" + set lookup loop the trie replaces.
+    const std::set<std::string> set(tokens.begin(), tokens.end());
+    auto reference = [&set](const std::string &word) {
+      size_t pieces = 0;
+      for (size_t start = 0; start < word.size(); ++pieces) {
+        size_t bestEnd = start + 1;
+        for (size_t end = word.size(); start < end; --end) {
+          if (set.count((0 < start ? "##" : "") + word.substr(start, end - start))) {
+            bestEnd = end;
+            break;
+          }
+        }
+        start = bestEnd;
+      }
+      return pieces;
+      };
+    bool ok = vocab.size() == tokens.size() && vocab.longestMatch("unaffable", false) == 3
+      && vocab.longestMatch("affable", true) == 3 && vocab.longestMatch("zzz", false) == 0;
+    for (const char *w : { "unaffable", "unable", "affable", "xunable", "##aff", "q", "ununun", "" }) {
+      ok = ok && vocab.countPieces(w) == reference(w);
+    }
+
+    // A cache file is mapped back only while intact: an out of range root, edge or child index
+    // is rejected, so the caller rebuilds from the vocab.
+    const auto path = (std::filesystem::temp_directory_path() / "phenix_test_wordpiece.vocab").string();
+    const size_t header = 32, roots = 2 * 256 * sizeof(uint32_t);
+    auto corrupted = [&](size_t offset, uint32_t value) {
+      if (!vocab.save(path, 42)) return false;
+      std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+      f.seekp(offset);
+      f.write(reinterpret_cast<const char *>(&value), sizeof(value));
+      f.close();
+      return !WordPieceVocab::map(path, 42).has_value();
+      };
+    ok = ok && vocab.save(path, 42) && WordPieceVocab::map(path, 42).has_value() && WordPieceVocab::map(path, 43) == std::nullopt;
+    uint32_t nodeCount = 0;
+    {
+      std::ifstream f(path, std::ios::binary);
+      f.seekg(24);
+      f.read(reinterpret_cast<char *>(&nodeCount), sizeof(nodeCount));
+    }
+    ok = ok && corrupted(header + 'u' * sizeof(uint32_t), 0xFFFFFFFFu) // root child
+      && corrupted(header + roots + 2 * 8, 0x7FFFFFFFu) // first edge of node 2
+      && corrupted(header + roots + nodeCount * 8, nodeCount); // child of the first edge
+    std::filesystem::remove(path);
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "wordpiece_vocab\n";
+    return ok;
+  }
+
+  bool test_tokenScanner() {
+    // Expected counts come from the previous pad/istringstream/punctuation-split pipeline.
+    const SimpleTokenizer tok(""); // no vocab: length based estimate over the same pieces
+    const std::vector<std::pair<std::string, size_t>> cases = {
+      { "int main(int argc, char **argv) { return 0; }", 17 },
+      { "\tfoo_bar  baz\r\nqux,\x0b" "done", 7 },
+      { "\xe4\xb8\xad\xe6\x96\x87" "abc\xe6\xb1\x89\xe5\xad\x97 def", 6 }, // CJK characters are pieces of their own
+      { "longidentifier_with_many_parts1234567890 x", 14 },
+      { "        indented = value; // comment with a fairly long line of text here\n", 19 },
+    };
+    bool ok = true;
+    for (const auto &[text, expected] : cases) {
+      ok = ok && tok.estimateTokenCount(text) == expected && tok.estimateTokenCount(text, true) == expected + 2;
+    }
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "token_scanner\n";
+    return ok;
+  }
+
+  bool test_tokenPrefix() {
+    const SimpleTokenizer tok("");
+    const std::string text = "int main(int argc, char **argv) { return 0; }\n";
+    bool ok = true;
+    // Every prefix counts what it was measured at.
+    size_t prev = 0;
+    for (size_t budget = 0; budget <= 18; ++budget) {
+      size_t tokens = 0;
+      const size_t len = tok.prefixWithinTokens(text, budget, &tokens);
+      ok = ok && tokens <= budget && tok.estimateTokenCount(text.substr(0, len)) == tokens && prev <= len;
+      prev = len;
+    }
+    ok = ok && tok.prefixWithinTokens(text, 0) == 0 && tok.prefixWithinTokens(text, 2) == 8; // "int main"
+    ok = ok && tok.prefixWithinTokens(text, 13) == 33; // "return" counts 2, it doesn't fit
+    ok = ok && tok.prefixWithinTokens(text, 17) == text.size(); // trailing whitespace is kept
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "token_prefix\n";
+    return ok;
+  }
+
+  bool test_bpeTokenizer() {
+    // Byte-level model with a Llama 3 style pre-tokenizer; expected counts are from the
+    // Hugging Face tokenizers library on the same json.
+    const auto path = (std::filesystem::temp_directory_path() / "phenix_test_bpe.json").string();
+    {
+      const std::string sp = "\xc4\xa0"; // stands for ' '
+      nlohmann::json j;
+      j["model"] = { { "type", "BPE" }, { "vocab", nlohmann::json::object() },
+        { "merges", { "i n", "in t", "a i", sp + " m", sp + "m ai", sp + "mai n" } } };
+      uint32_t id = 0;
+      for (const std::string t : { "i", "n", "t", "m", "a", "in", "int", "ai", "(", ")", ";", "\xc4\x8a" /* '\n' */ }) {
+        j["model"]["vocab"][t] = id++;
+      }
+      for (const std::string t : { "", "m", "mai", "main" }) {
+        j["model"]["vocab"][sp + t] = id++;
+      }
+      nlohmann::json split = { { "type", "Split" } };
+      split["pattern"]["Regex"] = "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+";
+      j["pre_tokenizer"]["type"] = "Sequence";
+      j["pre_tokenizer"]["pretokenizers"] = nlohmann::json::array({ split, { { "type", "ByteLevel" } } });
+      std::ofstream(path, std::ios::binary) << j.dump();
+    }
+    const SimpleTokenizer fallback("");
+    TokenizerRegistry registry(fallback);
+    const auto &tok = registry.get(path);
+    bool ok = &tok != &fallback && tok.loaded();
+    ok = ok && tok.countTokensWithVocab("int main") == 4; // "int", " m", "a", "in"
+    ok = ok && tok.countTokensWithVocab("int  maintain();\n") == 11; // "int", " ", " m", "a", "int", "a", "in", "(", ")", ";", "\n"
+    size_t tokens = 0;
+    ok = ok && tok.prefixWithinTokens("int  maintain();\n", 5, &tokens) == 4 && tokens == 2; // "int" and the lone space
+    ok = ok && &registry.get(path) == &tok && &registry.get("") == &fallback && &registry.get(path + ".missing") == &fallback;
+    std::filesystem::remove(path);
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "bpe_tokenizer\n";
+    return ok;
+  }
+
+  bool test_fitAttachments() {
+    const SimpleTokenizer tok("");
+    std::string words;
+    for (int i = 0; i < 30; ++i) words += "word ";
+    const size_t wordsTokens = tok.countTokensWithVocab(words);
+    // An empty attachment in the middle is skipped, the ones after it still count.
+    size_t used = 5;
+    auto picked = fitAttachments(tok, { { "a.txt", words }, { "empty.txt", "" }, { "b.txt", words } }, 5 + 3 * wordsTokens, used);
+    bool ok = picked.size() == 2 && picked[0].filename == "a.txt" && picked[1].filename == "b.txt" &&
+      picked[1].content == words && used == 5 + 2 * wordsTokens;
+    // The last one that doesn't fit is truncated to what is left.
+    used = 0;
+    picked = fitAttachments(tok, { { "a.txt", words }, { "", "" }, { "b.txt", words } }, wordsTokens * 3 / 2, used);
+    ok = ok && picked.size() == 2 && picked[1].content.size() < words.size() && used == wordsTokens + picked[1].tokens &&
+      used <= wordsTokens * 3 / 2;
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "fit_attachments\n";
+    return ok;
+  }
+
+  bool test_detectContentType() {
+    // Expected types are what the regex based classifier returned for the same input.
+    using CT = Chunker::ContentType;
+    struct Sample {
+      const char *name;
+      std::string text;
+      const char *uri;
+      CT expected;
+    };
+    const std::vector<Sample> samples = {
+      { "cpp", "#include <vector>\n\nint main() {\n  std::vector<int> v;\n  for (int i = 0; i < 3; ++i) {\n    v.push_back(i);\n  }\n  return 0;\n}\n", "", CT::Code },
+      { "python", "import os\nfrom pathlib import Path\n\ndef walk(root):\n    for p in Path(root).iterdir():\n        if p.is_dir():\n            yield from walk(p)\n        else:\n            yield p\n", "", CT::Text },
+      { "javascript", "const add = (a, b) => {\n  return a + b;\n};\nexport async function load(url) {\n  const res = await fetch(url);\n  return res.json();\n}\n", "", CT::Code },
+      { "prose", "The indexer walks every configured source.\nEach file is split into chunks of a few hundred tokens.\nChunks are embedded and stored with their offsets.\nSearch returns the closest chunks to a question.\n", "", CT::Text },
+      { "markdown_fences", "# Build\n\nRun the script:\n\n```\n./build_rel.sh\n```\n\nThen start the server.\n", "", CT::Text },
+      { "short_brace", "{ \"a\": 1 }\n", "", CT::Code },
+      { "short_prose", "hello world\n", "", CT::Text },
+      { "crlf", "public class Foo\r\n{\r\n    private int x;\r\n    public Foo() { x = 1; }\r\n}\r\n", "", CT::Code },
+      { "binary", std::string("\x7f" "ELF\x02\x01\x01\0\0\0", 10), "", CT::Binary },
+      { "code_extension", "plain words only\nnothing else here\nand a third line\n", "notes.py", CT::Code },
+      { "text_extension", "int x = 1;\nint y = 2;\nint z = 3;\n", "notes.md", CT::Text },
+    };
+    bool ok = true;
+    for (const auto &s : samples) {
+      const auto got = Chunker::detectContentType(s.text, s.uri);
+      if (got != s.expected) {
+        std::cout << "  " << s.name << ": got " << Chunker::contentTypeToStr(got) << "\n";
+        ok = false;
+      }
+    }
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "detect_content_type\n";
+    return ok;
+  }
+
+  bool test_detectContentTypeLines() {
+    // Whether a single line counts as a code indicator, as the regex patterns decided it. A text of
+    // ten copies of the line is classified as code exactly when it does.
+    const std::vector<std::pair<const char *, bool>> lines = {
+      // comment-only lines
+      { "// TODO: the class Foo is gone", true },
+      { "   * continued doc comment", true },
+      { "/* block */", true },
+      { "/ not a comment", false },
+      // keywords inside string literals still count, the patterns don't know about quotes
+      { "say \"the class Foo is nice\" to them", true },
+      { "print('if (x) {')", true },
+      { "msg = \"public notice\"", true },
+      { "log(\"while (waiting)\")", true },
+      { "write \"classic struct\" here", false },
+      // a leading '#' is a preprocessor line only for #include and #import
+      { "#include <vector>", true },
+      { "  #import Foundation", true },
+      { "#includes are resolved first", true },
+      { "# Heading about include files", false },
+      { "## Using the API", false },
+      { "#!/bin/bash", false },
+      { "#define MAX 3", true }, // by "def", not as a directive
+      // keyword prefixes and brace lines
+      { "the default setting", true },
+      { "Function keys are handy", false },
+      { "using namespace std", true },
+      { "}", true },
+      { "} // end", false },
+    };
+    bool ok = true;
+    for (const auto &[line, isCode] : lines) {
+      std::string text;
+      for (int i = 0; i < 10; ++i) text += std::string(line) + "\n";
+      const auto got = Chunker::detectContentType(text, "");
+      if (got != (isCode ? Chunker::ContentType::Code : Chunker::ContentType::Text)) {
+        std::cout << "  \"" << line << "\": got " << Chunker::contentTypeToStr(got) << "\n";
+        ok = false;
+      }
+    }
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "detect_content_type_lines\n";
+    return ok;
+  }
+
+  bool test_normalizeWhitespaces() {
+    // Expected results are what the std::regex based normalization returned.
+    const std::vector<std::pair<std::string, std::string>> cases = {
+      { "", "" },
+      { " \t\r\n ", "" },
+      { "  a\t\tb  ", "a b" },
+      { "a\r\nb", "a \nb" },
+      { "a\n\n\nb", "a\nb" },
+      { "a \t\n \n\t b", "a \n b" },
+      { "a\n \nb\n\v\nc", "a\nb\nc" },
+      { "\va\f", " a " },
+      { "x \n y", "x \n y" },
+    };
+    bool ok = true;
+    for (const auto &[in, expected] : cases) {
+      std::string s = in;
+      utils::normalizeWhitespaces(s);
+      if (s != expected) {
+        std::cout << "  \"" << in << "\": got \"" << s << "\"\n";
+        ok = false;
+      }
+    }
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "normalize_whitespaces\n";
+    return ok;
+  }
+
+  bool test_chunkText() {
+    const SimpleTokenizer tok("");
+    bool ok = true;
+
+    // Text chunks hold the normalized text between their offsets and overlap their predecessor.
+    std::string prose;
+    for (int i = 0; i < 40; ++i) prose += "alpha, beta  gamma.\n\n";
+    const auto normalized = Chunker::normalizeWhitespaces(prose);
+    const auto textChunks = Chunker(tok, 1, 8, 0.5f).chunkText(prose, "doc", false);
+    ok = ok && 1 < textChunks.size() && textChunks.back().metadata.end == normalized.size();
+    for (size_t i = 0; ok && i < textChunks.size(); ++i) {
+      const auto &c = textChunks[i];
+      ok = c.chunkId == "doc_" + std::to_string(i) && c.metadata.unit == Chunk::Unit::Char && c.metadata.type == Chunk::ContentType::Text &&
+        c.metadata.tokenCount <= 8 && c.text == normalized.substr(c.metadata.start, c.metadata.end - c.metadata.start) &&
+        (i == 0 || c.metadata.start < textChunks[i - 1].metadata.end);
+    }
+
+    // A unit over the budget makes a chunk of its own instead of stalling the split.
+    const std::string word(300, 'x');
+    const auto wide = Chunker(tok, 1, 8, 0.5f).chunkText("a " + word + " b", "", false);
+    ok = ok && std::any_of(wide.begin(), wide.end(), [&word](const Chunk &c) { return c.text == word; });
+
+    // Code is cut at lines, too long lines are wrapped, every piece keeps a newline.
+    const std::string code = "int main() {\n  return run(" + std::string(200, 'y') + ", argc, argv);\n}";
+    const auto codeChunks = Chunker(tok, 1, 10, 0.f).chunkText(code, "main.cpp");
+    std::string joined;
+    for (const auto &c : codeChunks) {
+      ok = ok && c.metadata.unit == Chunk::Unit::Line && c.metadata.type == Chunk::ContentType::Code && c.text.ends_with('\n');
+      joined += c.text;
+    }
+    ok = ok && 3 <= codeChunks.size() && joined.starts_with("int main() {\n  return run(") && joined.ends_with(", argc, argv);\n}\n");
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "chunk_text\n";
+    return ok;
+  }
+
 } // anonymous namespace
 
 
-void runUnitTests() {
+int runUnitTests() {
   std::vector<TestCase> tests = {
     { "short_string_less_than_6", "abc", "abc" },
     { "not_starting_with_fence", "`` code ```", "`` code ```" },
@@ -65,4 +618,54 @@ void runUnitTests() {
   }
 
   std::cout << "\nSummary: " << passed << " / " << tests.size() << " passed.\n";
+  size_t total = tests.size();
+  size_t failed = tests.size() - passed;
+
+  const std::vector<bool> embeddingResults = {
+    test_parseEmbeddings("embedding_llama_server_nested",
+      R"([{"index":1,"embedding":[[0.5,-0.25]]},{"index":0,"embedding":[[1,2e-1]]}])",
+      { { 1.f, 0.2f }, { 0.5f, -0.25f } }),
+    test_parseEmbeddings("embedding_openai_float",
+      R"({"object":"list","data":[{"object":"embedding","index":0,"embedding":[0.25,0.5]}],"usage":{"prompt_tokens":2}})",
+      { { 0.25f, 0.5f } }),
+    test_parseEmbeddings("embedding_openai_base64",
+      R"({"data":[{"embedding":"AACAPwAAAEA=","index":0}]})",
+      { { 1.f, 2.f } }),
+    test_parseEmbeddingsRejects("embedding_index_out_of_range",
+      R"({"data":[{"index":4000000000,"embedding":[0.25,0.5]}]})", 1),
+    test_parseEmbeddingsRejects("embedding_index_duplicate",
+      R"({"data":[{"index":0,"embedding":[0.25]},{"index":0,"embedding":[0.5]}]})", 2),
+    test_parseEmbeddingsRejects("embedding_index_missing",
+      R"({"data":[{"index":1,"embedding":[0.25]}]})", 2),
+  };
+  passed = static_cast<int>(std::count(embeddingResults.begin(), embeddingResults.end(), true));
+  std::cout << "\nSummary: " << passed << " / " << embeddingResults.size() << " embedding parser tests passed.\n";
+  total += embeddingResults.size();
+  failed += embeddingResults.size() - passed;
+
+  // Every test prints its own result; failures are counted here and make the run fail.
+  auto check = [&total, &failed](bool ok) {
+    ++total;
+    if (!ok) ++failed;
+    };
+  check(test_sseStream());
+  check(test_fimCache());
+  check(test_workerPoolDetach());
+  check(test_workerPoolStreamsBounded());
+  check(test_workerPoolDetachCap());
+  check(test_latencyHistogram());
+  check(test_requestTrace());
+  check(test_wordPieceVocab());
+  check(test_tokenScanner());
+  check(test_tokenPrefix());
+  check(test_tokenCountCache());
+  check(test_bpeTokenizer());
+  check(test_fitAttachments());
+  check(test_detectContentType());
+  check(test_detectContentTypeLines());
+  check(test_normalizeWhitespaces());
+  check(test_chunkText());
+
+  std::cout << "\nUnit tests: " << total - failed << " / " << total << " passed" << (failed ? ", FAILED" : "") << ".\n";
+  return failed ? 1 : 0;
 }
\ No newline at end of file
@@ -0,0 +1,238 @@
+#include "tokencache.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+
+namespace {
+
+  constexpr size_t SHARDS = 16;
+  constexpr size_t FRONT_SLOTS = 512;
+  // Longer keys (lines, sentences) rarely repeat within a thread and would make the front costly to fill.
+  constexpr size_t FRONT_MAX_KEY = 48;
+  // Fronts a thread keeps at once, one per cache it uses: the tokenizers' and the chunker's.
+  constexpr size_t MAX_FRONTS = 8;
+  // Front hits are counted locally and added to the shared counters in batches.
+  constexpr size_t FRONT_HITS_BATCH = 256;
+
+  std::atomic<uint64_t> nextCacheId{ 1 };
+
+  // Ids of the caches alive, so a thread can tell which of its fronts were left by destroyed ones.
+  struct LiveCaches {
+    std::mutex mutex;
+    std::unordered_set<uint64_t> ids;
+    std::atomic<uint64_t> destroyed{ 0 };
+  };
+
+  LiveCaches &liveCaches() {
+    static LiveCaches live;
+    return live;
+  }
+
+  struct Front {
+    struct Slot {
+      size_t hash = 0;
+      size_t count = 0;
+      std::string key;
+      bool used = false;
+    };
+    uint64_t owner = 0; // 0 when free
+    size_t pendingHits = 0;
+    std::array<Slot, FRONT_SLOTS> slots;
+  };
+
+  struct ThreadFronts {
+    std::array<std::unique_ptr<Front>, MAX_FRONTS> fronts;
+    uint64_t destroyedSeen = 0;
+  };
+
+  thread_local ThreadFronts threadFronts;
+
+  // The front of cache id on this thread. A front is never taken from another live cache: when all
+  // are in use the cache goes without one on this thread and is served by its shards.
+  Front *frontFor(uint64_t id) {
+    auto &tf = threadFronts;
+    for (auto &f : tf.fronts) {
+      if (f && f->owner == id) return f.get();
+    }
+    auto claim = [&tf, id]() -> Front * {
+      for (auto &f : tf.fronts) {
+        if (f && f->owner != 0) continue;
+        if (f) {
+          for (auto &slot : f->slots) slot.used = false;
+          f->pendingHits = 0;
+        } else {
+          f = std::make_unique<Front>();
+        }
+        f->owner = id;
+        return f.get();
+      }
+      return nullptr;
+      };
+    if (auto *f = claim()) return f;
+    // Ids aren't reused, fronts of destroyed caches can be freed once noticed.
+    auto &live = liveCaches();
+    const uint64_t destroyed = live.destroyed.load();
+    if (destroyed == tf.destroyedSeen) return nullptr;
+    tf.destroyedSeen = destroyed;
+    {
+      std::lock_guard<std::mutex> lock(live.mutex);
+      for (auto &f : tf.fronts) {
+        if (f && !live.ids.contains(f->owner)) f->owner = 0;
+      }
+    }
+    return claim();
+  }
+
+} // anonymous namespace
+
+
+struct TokenCountCache::Impl {
+  struct Shard {
+    struct Slot {
+      std::string key;
+      size_t count = 0;
+      bool referenced = false;
+    };
+    std::mutex mutex;
+    std::deque<Slot> slots; // grows in place, so index can view the keys
+    std::unordered_map<std::string_view, uint32_t> index;
+    size_t hand = 0;
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+  };
+
+  uint64_t id_ = nextCacheId.fetch_add(1);
+  size_t capacity_ = 0;
+  size_t shardCapacity_ = 0;
+  std::array<Shard, SHARDS> shards_;
+
+  Impl() {
+    auto &live = liveCaches();
+    std::lock_guard<std::mutex> lock(live.mutex);
+    live.ids.insert(id_);
+  }
+  ~Impl() {
+    auto &live = liveCaches();
+    std::lock_guard<std::mutex> lock(live.mutex);
+    live.ids.erase(id_);
+    ++live.destroyed;
+  }
+
+  // The front indexes with the low bits, shards use higher ones.
+  Shard &shardOf(size_t hash) { return shards_[(hash >> 20) % SHARDS]; }
+};
+
+
+TokenCountCache::TokenCountCache(size_t capacity) : imp(new Impl)
+{
+  imp->shardCapacity_ = capacity ? (std::max)(capacity / SHARDS, size_t(1)) : 0;
+  imp->capacity_ = imp->shardCapacity_ * SHARDS;
+}
+
+TokenCountCache::~TokenCountCache() = default;
+
+bool TokenCountCache::find(std::string_view key, size_t &count)
+{
+  if (imp->capacity_ == 0) return false;
+  const size_t hash = std::hash<std::string_view>{}(key);
+  Front *front = key.size() <= FRONT_MAX_KEY ? frontFor(imp->id_) : nullptr;
+  if (front) {
+    const auto &slot = front->slots[hash % FRONT_SLOTS];
+    if (slot.used && slot.hash == hash && slot.key == key) {
+      count = slot.count;
+      if (++front->pendingHits == FRONT_HITS_BATCH) {
+        auto &shard = imp->shardOf(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.hits += front->pendingHits;
+        front->pendingHits = 0;
+      }
+      return true;
+    }
+  }
+
+  auto &shard = imp->shardOf(hash);
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (front) {
+      shard.hits += front->pendingHits;
+      front->pendingHits = 0;
+    }
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+      ++shard.misses;
+      return false;
+    }
+    auto &slot = shard.slots[it->second];
+    slot.referenced = true;
+    count = slot.count;
+    ++shard.hits;
+  }
+  if (front) {
+    auto &slot = front->slots[hash % FRONT_SLOTS];
+    slot.hash = hash;
+    slot.count = count;
+    slot.key.assign(key);
+    slot.used = true;
+  }
+  return true;
+}
+
+void TokenCountCache::insert(std::string_view key, size_t count)
+{
+  if (imp->capacity_ == 0) return;
+  const size_t hash = std::hash<std::string_view>{}(key);
+  if (Front *front = key.size() <= FRONT_MAX_KEY ? frontFor(imp->id_) : nullptr) {
+    auto &slot = front->slots[hash % FRONT_SLOTS];
+    slot.hash = hash;
+    slot.count = count;
+    slot.key.assign(key);
+    slot.used = true;
+  }
+
+  auto &shard = imp->shardOf(hash);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if (shard.index.contains(key)) return; // another thread got there first
+  uint32_t i = 0;
+  if (shard.slots.size() < imp->shardCapacity_) {
+    i = static_cast<uint32_t>(shard.slots.size());
+    shard.slots.emplace_back();
+  } else {
+    // CLOCK: clear reference bits until an entry that wasn't used since the last sweep comes up.
+    while (shard.slots[shard.hand].referenced) {
+      shard.slots[shard.hand].referenced = false;
+      shard.hand = (shard.hand + 1) % shard.slots.size();
+    }
+    i = static_cast<uint32_t>(shard.hand);
+    shard.hand = (shard.hand + 1) % shard.slots.size();
+    shard.index.erase(shard.slots[i].key);
+    ++shard.evictions;
+  }
+  auto &slot = shard.slots[i];
+  slot.key.assign(key);
+  slot.count = count;
+  slot.referenced = false;
+  shard.index.emplace(slot.key, i);
+}
+
+TokenCountCache::Stats TokenCountCache::stats() const
+{
+  Stats st;
+  st.capacity = imp->capacity_;
+  for (auto &s : imp->shards_) {
+    std::lock_guard<std::mutex> lock(s.mutex);
+    st.entries += s.index.size();
+    st.hits += s.hits;
+    st.misses += s.misses;
+    st.evictions += s.evictions;
+  }
+  return st;
+}
@@ -1,210 +1,342 @@
 #include "tokenizer.h"
+#include "bpe.h"
+#include "json_shim.h"
 #include <utils_log/logger.hpp>
-#include <vector>
 #include <string>
 #include <string_view>
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <fstream>
-#include <sstream>
+#include <iterator>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TOKENIZER_SSE2
+#endif
 
 using json = nlohmann::json;
 
 namespace {
 
-  bool isPunctuation(char c) {
-    return (c >= 33 && c <= 47) || (c >= 58 && c <= 64) || (c >= 91 && c <= 96) || (c >= 123 && c <= 126);
-  }
-
   bool isChineseChar(uint32_t c) {
     return (c >= 0x4E00 && c <= 0x9FFF) || (c >= 0x3400 && c <= 0x4DBF) || (c >= 0xF900 && c <= 0xFAFF);
   }
 
-  std::vector<uint32_t> utf8ToUtf32(std::string_view str) {
-    std::vector<uint32_t> result;
-    for (size_t i = 0; i < str.size();) {
-      uint32_t codepoint = 0;
-      unsigned char c = str[i];
-      if (c < 0x80) {
-        codepoint = c;
-        i += 1;
-      } else if ((c >> 5) == 0x06) {
-        codepoint = ((c & 0x1F) << 6) | (str[i + 1] & 0x3F);
-        i += 2;
-      } else if ((c >> 4) == 0x0E) {
-        codepoint = ((c & 0x0F) << 12) |
-          ((str[i + 1] & 0x3F) << 6) |
-          (str[i + 2] & 0x3F);
-        i += 3;
-      } else if ((c >> 3) == 0x1E) {
-        codepoint = ((c & 0x07) << 18) |
-          ((str[i + 1] & 0x3F) << 12) |
-          ((str[i + 2] & 0x3F) << 6) |
-          (str[i + 3] & 0x3F);
-        i += 4;
-      } else {
-        i += 1; // Skip invalid byte
-      }
-      if (codepoint != 0)
-        result.push_back(codepoint);
-    }
-    return result;
-  }
-
-  std::string uint32ToUtf8(uint32_t c) {
-    std::string res;
-    if (c < 0x80) {
-      res += static_cast<char>(c);
-    } else if (c < 0x800) {
-      res += static_cast<char>(0xC0 | (c >> 6));
-      res += static_cast<char>(0x80 | (c & 0x3F));
-    } else if (c < 0x10000) {
-      res += static_cast<char>(0xE0 | (c >> 12));
-      res += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
-      res += static_cast<char>(0x80 | (c & 0x3F));
-    } else {
-      res += static_cast<char>(0xF0 | (c >> 18));
-      res += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
-      res += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
-      res += static_cast<char>(0x80 | (c & 0x3F));
+  // Byte classes of the piece scanner. Alnum and Other bytes extend the current piece,
+  // Space ends it, Punct is a piece of its own, Lead3 may start a CJK character (which is
+  // a piece of its own too: U+3400..U+9FFF and U+F900..U+FAFF all encode as 3 bytes led by E3..E9 or EF).
+  enum ByteClass : uint8_t { Other, Alnum, Space, Punct, Lead3 };
+
+  constexpr std::array<uint8_t, 256> makeByteClasses() {
+    std::array<uint8_t, 256> t{};
+    for (int c = 0; c < 256; ++c) {
+      if (('0' <= c && c <= '9') || ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z')) t[c] = Alnum;
+      else if (c == ' ' || ('\t' <= c && c <= '\r')) t[c] = Space; // what istream >> splits on
+      else if ((33 <= c && c <= 47) || (58 <= c && c <= 64) || (91 <= c && c <= 96) || (123 <= c && c <= 126)) t[c] = Punct;
+      else if ((0xE3 <= c && c <= 0xE9) || c == 0xEF) t[c] = Lead3;
     }
-    return res;
+    return t;
   }
+  constexpr auto BYTE_CLASS = makeByteClasses();
 
-  std::string padChineseChars(std::string_view text) {
-    auto utf32Chars = utf8ToUtf32(text);
-    std::string result;
-    for (auto c : utf32Chars) {
-      if (isChineseChar(c)) {
-        result += " " + uint32ToUtf8(c) + " ";
-      } else {
-        result += uint32ToUtf8(c);
+  bool isCjkAt(std::string_view s, size_t i) {
+    if (s.size() < i + 3) return false;
+    const auto b0 = static_cast<unsigned char>(s[i]);
+    const auto b1 = static_cast<unsigned char>(s[i + 1]);
+    const auto b2 = static_cast<unsigned char>(s[i + 2]);
+    if ((b1 & 0xC0) != 0x80 || (b2 & 0xC0) != 0x80) return false;
+    return isChineseChar(((b0 & 0x0Fu) << 12) | ((b1 & 0x3Fu) << 6) | (b2 & 0x3Fu));
+  }
+
+#ifdef TOKENIZER_SSE2
+  // Classifies 16 bytes at once: bit i of nonAlnum is set when block[i] is not an ASCII letter
+  // or digit, bit i of space when it is whitespace. Bytes >= 0x80 compare as negative and
+  // fall outside every range.
+  void classifyBlock(const char *block, unsigned &nonAlnum, unsigned &space) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block));
+    auto inRange = [&v](char lo, char hi) {
+      return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+      };
+    const __m128i alnum = _mm_or_si128(inRange('0', '9'), _mm_or_si128(inRange('A', 'Z'), inRange('a', 'z')));
+    const __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), inRange('\t', '\r'));
+    nonAlnum = ~static_cast<unsigned>(_mm_movemask_epi8(alnum)) & 0xFFFF;
+    space = static_cast<unsigned>(_mm_movemask_epi8(ws));
+  }
+#endif
+
+  // Splits text into the pieces WordPiece runs on: whitespace separated words, further split
+  // at every ASCII punctuation character and around CJK characters. One pass, no copies;
+  // onPiece gets views into text and returns false to stop the scan. Letters and digits
+  // never end a piece, so only the other bytes are looked at: with SSE2 they are found
+  // 16 bytes at a time.
+  template <typename F>
+  void forEachPiece(std::string_view text, F &&onPiece) {
+    const size_t n = text.size();
+    size_t pieceStart = 0;
+    auto flush = [&](size_t end) {
+      return end <= pieceStart || onPiece(text.substr(pieceStart, end - pieceStart));
+      };
+    auto visit = [&](size_t i) {
+      switch (BYTE_CLASS[static_cast<unsigned char>(text[i])]) {
+      case Space:
+        if (!flush(i)) return false;
+        pieceStart = i + 1;
+        break;
+      case Punct:
+        if (!flush(i) || !onPiece(text.substr(i, 1))) return false;
+        pieceStart = i + 1;
+        break;
+      case Lead3:
+        // Its continuation bytes are Other and visited as no-ops.
+        if (isCjkAt(text, i)) {
+          if (!flush(i) || !onPiece(text.substr(i, 3))) return false;
+          pieceStart = i + 3;
+        }
+        break;
+      default:
+        break;
+      }
+      return true;
+      };
+    size_t i = 0;
+#ifdef TOKENIZER_SSE2
+    for (; i + 16 <= n; i += 16) {
+      unsigned special, space;
+      classifyBlock(text.data() + i, special, space);
+      while (special) {
+        const unsigned p = std::countr_zero(special);
+        if ((space >> p) & 1) {
+          // A whole run of whitespace (indentation mostly) is one step.
+          if (!flush(i + p)) return;
+          const unsigned end = p + std::countr_one(space >> p);
+          pieceStart = i + end;
+          special &= ~((1u << end) - 1);
+        } else {
+          if (!visit(i + p)) return;
+          special &= special - 1;
+        }
       }
     }
-    return result;
+#endif
+    for (; i < n; ++i) {
+      if (BYTE_CLASS[static_cast<unsigned char>(text[i])] != Alnum && !visit(i)) return;
+    }
+    flush(n);
   }
 
-  std::vector<std::string> splitSimple(const std::string &input) {
-    std::istringstream stream(input);
-    std::vector<std::string> words;
-    words.reserve(input.size() / 3);
-    std::string word;
-    while (stream >> word) {
-      words.push_back(word);
+  // Byte classes of the BPE pre-tokenizer. Bytes >= 0x80 are taken as letters: the scanner
+  // doesn't decode UTF-8, and most non-ASCII text in sources is words or CJK.
+  enum BpeClass : uint8_t { BLetter, BDigit, BSpace, BNewline, BOther };
+
+  constexpr std::array<uint8_t, 256> makeBpeClasses() {
+    std::array<uint8_t, 256> t{};
+    for (int c = 0; c < 256; ++c) {
+      if (('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || 0x80 <= c) t[c] = BLetter;
+      else if ('0' <= c && c <= '9') t[c] = BDigit;
+      else if (c == '\r' || c == '\n') t[c] = BNewline;
+      else if (c == ' ' || c == '\t' || c == '\v' || c == '\f') t[c] = BSpace;
+      else t[c] = BOther;
     }
-    return words;
+    return t;
   }
+  constexpr auto BPE_CLASS = makeBpeClasses();
 
-  void splitOnPunctSimple(const std::string &text, std::vector<std::string> &result) {
-    result.reserve(text.length() / 3);
-    std::string current;
-    for (char c : text) {
-      if (isPunctuation(c)) {
-        if (!current.empty()) {
-          result.push_back(current);
-          current.clear();
-        }
-        result.emplace_back(1, c);
+  // Splits text the way the pre-tokenizer regex of Llama 3 and Qwen 2 style byte-level BPE
+  // models does, hand-written so no regex engine is needed:
+  //   (?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+
+  // digitGroup is the {1,3} above, 0 for no limit. onPiece works as in forEachPiece.
+  template <typename F>
+  void forEachBpePiece(std::string_view text, size_t digitGroup, F &&onPiece) {
+    const size_t n = text.size();
+    auto cls = [&](size_t i) { return i < n ? BPE_CLASS[static_cast<unsigned char>(text[i])] : uint8_t(BOther); };
+    auto lower = [&](size_t i) { return i < n ? static_cast<char>(text[i] | 0x20) : '\0'; };
+    auto runOf = [&](size_t i, auto pred) {
+      while (i < n && pred(cls(i))) ++i;
+      return i;
+      };
+    auto isSpace = [](uint8_t c) { return c == BSpace || c == BNewline; };
+
+    size_t i = 0;
+    while (i < n) {
+      const uint8_t c = cls(i);
+      size_t end = i + 1;
+      if (text[i] == '\'' && (lower(i + 1) == 's' || lower(i + 1) == 't' || lower(i + 1) == 'm' || lower(i + 1) == 'd')) {
+        end = i + 2;
+      } else if (text[i] == '\'' && ((lower(i + 1) == 'r' && lower(i + 2) == 'e') || (lower(i + 1) == 'v' && lower(i + 2) == 'e') ||
+        (lower(i + 1) == 'l' && lower(i + 2) == 'l'))) {
+        end = i + 3;
+      } else if (c == BLetter) {
+        end = runOf(i, [](uint8_t k) { return k == BLetter; });
+      } else if (c != BNewline && c != BDigit && cls(i + 1) == BLetter) {
+        end = runOf(i + 1, [](uint8_t k) { return k == BLetter; });
+      } else if (c == BDigit) {
+        end = runOf(i, [](uint8_t k) { return k == BDigit; });
+        if (digitGroup) end = (std::min)(end, i + digitGroup);
+      } else if (c == BOther || (text[i] == ' ' && cls(i + 1) == BOther)) {
+        end = runOf(runOf(c == BOther ? i : i + 1, [](uint8_t k) { return k == BOther; }), [](uint8_t k) { return k == BNewline; });
       } else {
-        current += c;
+        end = runOf(i, isSpace);
+        size_t lastNewline = end;
+        while (i < lastNewline && cls(lastNewline - 1) != BNewline) --lastNewline;
+        if (i < lastNewline) end = lastNewline;
+        else if (end < n && i + 1 < end) --end; // the last space goes with what follows
+      }
+      if (!onPiece(text.substr(i, end - i))) return;
+      i = end;
+    }
+  }
+
+  // SentencePiece style models see spaces as part of the word after them: "  foo" is one
+  // piece, or " " and " foo" with splitEach.
+  template <typename F>
+  void forEachSpacePiece(std::string_view text, bool splitEach, F &&onPiece) {
+    size_t start = 0;
+    for (size_t i = 1; i < text.size(); ++i) {
+      if (text[i] == ' ' && (splitEach || text[i - 1] != ' ')) {
+        if (!onPiece(text.substr(start, i - start))) return;
+        start = i;
       }
     }
-    if (!current.empty()) {
-      result.emplace_back(current);
+    if (start < text.size()) onPiece(text.substr(start));
+  }
+
+  template <typename F>
+  void forEachModelPiece(const BpeModel *bpe, std::string_view text, F &&onPiece) {
+    if (!bpe) forEachPiece(text, std::forward<F>(onPiece));
+    else if (bpe->metaspace()) forEachSpacePiece(text, bpe->splitSpaces(), std::forward<F>(onPiece));
+    else forEachBpePiece(text, bpe->digitGroup(), std::forward<F>(onPiece));
+  }
+
+  size_t estimatePiece(std::string_view piece) {
+    if (piece.length() <= 4) return 1;
+    if (piece.length() <= 8) return 2;
+    return (piece.length() + 3) / 4;
+  }
+
+  // Distinct words seen by a long-running server; code vocabularies stay well below this.
+  constexpr size_t WORD_CACHE_ENTRIES = size_t(1) << 18;
+
+  uint64_t fnv1a64(std::string_view s) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (unsigned char c : s) {
+      hash ^= c;
+      hash *= 1099511628211ull;
     }
+    return hash;
   }
 
 } // anonymous namespace
 
 
 SimpleTokenizer::SimpleTokenizer(const std::string &configPath)
+  : cache_(WORD_CACHE_ENTRIES)
 {
-  std::ifstream file(configPath);
-  if (file.is_open()) {
-    json jsonObj;
-    file >> jsonObj;
-    if (jsonObj.contains("model") && jsonObj["model"].contains("vocab")) {
-      vocab_ = jsonObj["model"]["vocab"];
-      LOG_MSG << "Using vocab file" << configPath << "with" << vocab_.size() << "entries.";
-    }
-  } else {
+  std::ifstream file(configPath, std::ios::binary);
+  if (!file.is_open()) {
     LOG_MSG << "Unable to locate vocab file" << configPath << ". Skipped.";
+    return;
+  }
+  const std::string text{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+
+  // The compiled vocab is cached next to the json and reused as long as the json is unchanged.
+  const uint64_t hash = fnv1a64(text);
+  const std::string cachePath = configPath + ".vocab";
+  if (auto cached = WordPieceVocab::map(cachePath, hash)) {
+    vocab_ = std::move(*cached);
+    LOG_MSG << "Using vocab file" << configPath << "with" << vocab_.size() << "entries (precompiled).";
+    return;
+  }
+
+  json jsonObj = json::parse(text);
+  if (jsonObj.contains("model") && jsonObj["model"].value("type", "") == "BPE") {
+    bpe_ = std::make_unique<BpeModel>(jsonObj);
+    LOG_MSG << "Using BPE tokenizer" << configPath << "with" << bpe_->size() << "entries.";
+    return;
+  }
+  if (jsonObj.contains("model") && jsonObj["model"].contains("vocab")) {
+    vocab_ = WordPieceVocab(json_keys(jsonObj["model"]["vocab"]));
+    LOG_MSG << "Using vocab file" << configPath << "with" << vocab_.size() << "entries.";
+    if (!vocab_.save(cachePath, hash)) {
+      LOG_MSG << "Unable to write precompiled vocab" << cachePath;
+    }
   }
 }
 
+SimpleTokenizer::~SimpleTokenizer() = default;
+
 size_t SimpleTokenizer::estimateTokenCount(std::string_view text, bool addSpecialTokens) const
 {
-  std::string padded = padChineseChars(text);
-  std::vector<std::string> words = splitSimple(padded);
   size_t totalTokens = addSpecialTokens ? 2 : 0; // [CLS] + [SEP]
-  for (const auto &word : words) {
-    std::vector<std::string> punctSplit;
-    splitOnPunctSimple(word, punctSplit);
-    for (const auto &token : punctSplit) {
-      if (token.empty()) continue;
-      if (token.length() <= 4) {
-        totalTokens += 1;
-      } else if (token.length() <= 8) {
-        totalTokens += 2;
-      } else {
-        totalTokens += (token.length() + 3) / 4;
-      }
-    }
-  }
-
+  forEachPiece(text, [&totalTokens](std::string_view piece) {
+    totalTokens += estimatePiece(piece);
+    return true;
+    });
   return totalTokens;
 }
 
 size_t SimpleTokenizer::countTokensWithVocab(std::string_view text, bool addSpecialTokens) const
 {
-  if (vocab_.empty()) {
+  if (!loaded()) {
     return estimateTokenCount(text);
   }
-  std::string padded = padChineseChars(text);
-  std::vector<std::string> words = splitSimple(padded);
-  size_t totalTokens = addSpecialTokens ? 2 : 0; // [CLS] + [SEP]
-  for (const auto &word : words) {
-    std::vector<std::string> punctSplit;
-    splitOnPunctSimple(word, punctSplit);
-    for (const auto &token : punctSplit) {
-      if (token.empty()) continue;
-      totalTokens += simulateWordpiece(token, addSpecialTokens);
-    }
-  }
+  size_t totalTokens = addSpecialTokens && !bpe_ ? 2 : 0; // [CLS] + [SEP]
+  forEachModelPiece(bpe_.get(), text, [&](std::string_view piece) {
+    totalTokens += pieceTokens(piece, addSpecialTokens, piece.data() == text.data());
+    return true;
+    });
   return totalTokens;
 }
 
-size_t SimpleTokenizer::simulateWordpiece(const std::string &word, bool addSpecialTokens) const
+size_t SimpleTokenizer::prefixWithinTokens(std::string_view text, size_t maxTokens, size_t *tokens) const
+{
+  // Cuts fall on piece ends, so the prefix splits into exactly the pieces counted here.
+  size_t used = 0;
+  size_t end = 0;
+  bool complete = true;
+  forEachModelPiece(bpe_.get(), text, [&](std::string_view piece) {
+    const size_t n = pieceTokens(piece, false, piece.data() == text.data());
+    if (maxTokens < used + n) return complete = false;
+    used += n;
+    end = static_cast<size_t>(piece.data() - text.data()) + piece.size();
+    return true;
+    });
+  // When everything fits the trailing whitespace is kept too.
+  if (complete) end = text.size();
+  if (tokens) *tokens = used;
+  return end;
+}
+
+size_t SimpleTokenizer::pieceTokens(std::string_view piece, bool addSpecialTokens, bool first) const
+{
+  if (bpe_ && first) return bpe_->countFirstPiece(piece);
+  if (bpe_) return cache_.get(piece, [this](std::string_view p) { return bpe_->countPieces(p); });
+  if (!vocab_.empty()) return simulateWordpiece(piece, addSpecialTokens);
+  return estimatePiece(piece);
+}
+
+size_t SimpleTokenizer::simulateWordpiece(std::string_view word, bool addSpecialTokens) const
 {
   if (word.length() > maxInputCharsPerWord_) {
     return addSpecialTokens ? 1 : 0; // [UNK]
   }
-  
-  {
-    std::lock_guard<std::mutex> lock(mutex_);
-    if (auto it = cache_.find(word); it != cache_.end())
-      return it->second;    
-  }
-  
-  size_t tokens = 0;
-  size_t start = 0;
-  while (start < word.length()) {
-    size_t bestEnd = start + 1;
-    for (size_t end = word.length(); end > start; --end) {
-      std::string substr = word.substr(start, end - start);
-      if (start > 0) {
-        substr = "##" + substr;
-      }
-      if (vocab_.contains(substr)) {
-        bestEnd = end;
-        break;
-      }
-    }
-    tokens++;
-    start = bestEnd;
-  }
+  return cache_.get(word, [this](std::string_view w) { return vocab_.countPieces(w); });
+}
 
-  {
-    std::lock_guard<std::mutex> lock(mutex_);
-    cache_[word] = tokens;
+const SimpleTokenizer &TokenizerRegistry::get(const std::string &configPath)
+{
+  if (configPath.empty()) return fallback_;
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = tokenizers_.find(configPath);
+  if (it == tokenizers_.end()) {
+    std::unique_ptr<SimpleTokenizer> tokenizer;
+    try {
+      tokenizer = std::make_unique<SimpleTokenizer>(configPath);
+    } catch (const std::exception &e) {
+      LOG_MSG << "Unable to load tokenizer" << configPath << ":" << e.what();
+    }
+    if (tokenizer && !tokenizer->loaded()) tokenizer.reset();
+    it = tokenizers_.emplace(configPath, std::move(tokenizer)).first;
   }
-  return tokens;
+  return it->second ? *it->second : fallback_;
 }
@@ -0,0 +1,256 @@
+#include "wordpiece.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <system_error>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+  constexpr char MAGIC[8] = { 'P', 'X', 'W', 'P', 'V', 'O', 'C', '\0' };
+  constexpr uint32_t VERSION = 1;
+
+  // Blob layout: header, root tables uint32[2][256], nodes, children uint32[edges], labels uint8[edges].
+  // Host byte order; the file is a local cache, not an exchange format.
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entries;
+    uint64_t sourceHash;
+    uint32_t nodeCount;
+    uint32_t edgeCount;
+  };
+  static_assert(sizeof(Header) == 32);
+
+  constexpr size_t ROOT_TABLE_SIZE = 2 * 256 * sizeof(uint32_t);
+
+  size_t blobSizeFor(size_t nodeCount, size_t edgeCount, size_t nodeSize) {
+    return sizeof(Header) + ROOT_TABLE_SIZE + nodeCount * nodeSize + edgeCount * (sizeof(uint32_t) + sizeof(uint8_t));
+  }
+
+  // Read-only mapping of a whole file; the returned pointer unmaps when released.
+  std::shared_ptr<const char> mapFile(const std::string &path, size_t &size) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return nullptr;
+    LARGE_INTEGER li{};
+    HANDLE mapping = nullptr;
+    if (GetFileSizeEx(file, &li) && 0 < li.QuadPart) {
+      mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    }
+    CloseHandle(file);
+    if (!mapping) return nullptr;
+    const void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view) return nullptr;
+    size = static_cast<size_t>(li.QuadPart);
+    return std::shared_ptr<const char>(static_cast<const char *>(view), [](const char *p) { UnmapViewOfFile(p); });
+#else
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st{};
+    void *addr = MAP_FAILED;
+    if (::fstat(fd, &st) == 0 && 0 < st.st_size) {
+      addr = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (addr == MAP_FAILED) return nullptr;
+    const size_t len = static_cast<size_t>(st.st_size);
+    size = len;
+    return std::shared_ptr<const char>(static_cast<const char *>(addr), [len](const char *p) { ::munmap(const_cast<char *>(p), len); });
+#endif
+  }
+
+} // anonymous namespace
+
+
+WordPieceVocab::WordPieceVocab(const std::vector<std::string> &tokens)
+{
+  // Build a map-based trie first, then flatten it breadth-first so that the children
+  // of every node end up adjacent in children/labels.
+  std::vector<std::map<uint8_t, uint32_t>> kids(2);
+  std::vector<bool> terminal(2, false);
+  auto insert = [&](uint32_t root, std::string_view s) {
+    uint32_t n = root;
+    for (unsigned char c : s) {
+      auto it = kids[n].find(c);
+      if (it != kids[n].end()) {
+        n = it->second;
+        continue;
+      }
+      const auto next = static_cast<uint32_t>(kids.size());
+      kids[n].emplace(c, next);
+      kids.emplace_back();
+      terminal.push_back(false);
+      n = next;
+    }
+    terminal[n] = true;
+  };
+  for (const auto &t : tokens) {
+    if (t.empty()) continue;
+    // "##x" also matches literally at a word start, as a plain vocab lookup would.
+    insert(0, t);
+    if (2 < t.size() && t.starts_with("##")) insert(1, std::string_view(t).substr(2));
+  }
+
+  std::vector<uint32_t> order{ 0, 1 }; // temp ids in flat order
+  std::vector<Node> nodes;
+  std::vector<uint32_t> children;
+  std::vector<uint8_t> labels;
+  nodes.reserve(kids.size());
+  children.reserve(kids.size());
+  labels.reserve(kids.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    const uint32_t t = order[i];
+    Node node{};
+    node.firstEdge = static_cast<uint32_t>(labels.size());
+    node.edgeCount = static_cast<uint16_t>(kids[t].size());
+    // Roots never match by themselves, an entry has at least one byte.
+    node.terminal = 2 <= i && terminal[t];
+    for (const auto &[label, kid] : kids[t]) {
+      labels.push_back(label);
+      children.push_back(static_cast<uint32_t>(order.size()));
+      order.push_back(kid);
+    }
+    nodes.push_back(node);
+  }
+
+  std::vector<uint32_t> roots(2 * 256, 0);
+  for (uint32_t root = 0; root < 2; ++root) {
+    const auto &n = nodes[root];
+    for (uint32_t e = n.firstEdge; e < n.firstEdge + n.edgeCount; ++e) {
+      roots[root * 256 + labels[e]] = children[e];
+    }
+  }
+
+  Header h{};
+  std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+  h.version = VERSION;
+  h.entries = static_cast<uint32_t>(tokens.size());
+  h.nodeCount = static_cast<uint32_t>(nodes.size());
+  h.edgeCount = static_cast<uint32_t>(labels.size());
+
+  const size_t blobSize = blobSizeFor(nodes.size(), labels.size(), sizeof(Node));
+  std::shared_ptr<char> blob(new char[blobSize], std::default_delete<char[]>());
+  char *p = blob.get();
+  auto put = [&p](const void *src, size_t len) {
+    if (len) std::memcpy(p, src, len);
+    p += len;
+  };
+  put(&h, sizeof(h));
+  put(roots.data(), ROOT_TABLE_SIZE);
+  put(nodes.data(), nodes.size() * sizeof(Node));
+  put(children.data(), children.size() * sizeof(uint32_t));
+  put(labels.data(), labels.size());
+  attach(std::move(blob), blobSize, 0);
+}
+
+bool WordPieceVocab::attach(std::shared_ptr<const char> blob, size_t blobSize, uint64_t sourceHash)
+{
+  if (!blob || blobSize < sizeof(Header) + ROOT_TABLE_SIZE) return false;
+  Header h;
+  std::memcpy(&h, blob.get(), sizeof(h));
+  if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION || h.sourceHash != sourceHash
+    || h.nodeCount < 2 || blobSize != blobSizeFor(h.nodeCount, h.edgeCount, sizeof(Node))) {
+    return false;
+  }
+  const char *p = blob.get() + sizeof(Header);
+  const auto *rootChild = reinterpret_cast<const uint32_t *>(p);
+  p += ROOT_TABLE_SIZE;
+  const auto *nodes = reinterpret_cast<const Node *>(p);
+  p += h.nodeCount * sizeof(Node);
+  const auto *children = reinterpret_cast<const uint32_t *>(p);
+  p += h.edgeCount * sizeof(uint32_t);
+  // Lookups follow these indexes unchecked, so a corrupted file must not get past here.
+  if (std::any_of(rootChild, rootChild + 2 * 256, [&h](uint32_t n) { return h.nodeCount <= n; })
+    || std::any_of(nodes, nodes + h.nodeCount, [&h](const Node &n) { return h.edgeCount < uint64_t(n.firstEdge) + n.edgeCount; })
+    || std::any_of(children, children + h.edgeCount, [&h](uint32_t n) { return h.nodeCount <= n; })) {
+    return false;
+  }
+  rootChild_ = rootChild;
+  nodes_ = nodes;
+  children_ = children;
+  labels_ = reinterpret_cast<const uint8_t *>(p);
+  size_ = h.entries;
+  blob_ = std::move(blob);
+  blobSize_ = blobSize;
+  return true;
+}
+
+bool WordPieceVocab::save(const std::string &path, uint64_t sourceHash) const
+{
+  if (!blob_) return false;
+  Header h;
+  std::memcpy(&h, blob_.get(), sizeof(h));
+  h.sourceHash = sourceHash;
+  // Write aside and rename, so concurrent starts never map a half-written file.
+  const std::string tmp = path + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    if (!out) return false;
+    out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+    out.write(blob_.get() + sizeof(h), blobSize_ - sizeof(h));
+    if (!out) {
+      out.close();
+      std::error_code ec;
+      std::filesystem::remove(tmp, ec);
+      return false;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp, path, ec);
+  if (ec) std::filesystem::remove(tmp, ec);
+  return !ec;
+}
+
+std::optional<WordPieceVocab> WordPieceVocab::map(const std::string &path, uint64_t sourceHash)
+{
+  size_t size = 0;
+  auto blob = mapFile(path, size);
+  WordPieceVocab v;
+  if (!v.attach(std::move(blob), size, sourceHash)) return std::nullopt;
+  return v;
+}
+
+uint32_t WordPieceVocab::child(uint32_t node, uint8_t label) const
+{
+  const auto &n = nodes_[node];
+  const uint8_t *first = labels_ + n.firstEdge;
+  const uint8_t *last = first + n.edgeCount;
+  const uint8_t *it = std::lower_bound(first, last, label);
+  return it != last && *it == label ? children_[it - labels_] : 0;
+}
+
+size_t WordPieceVocab::longestMatch(std::string_view s, bool continuation) const
+{
+  if (!blob_ || s.empty()) return 0;
+  uint32_t n = rootChild_[(continuation ? 256 : 0) + static_cast<uint8_t>(s[0])];
+  size_t best = 0;
+  for (size_t i = 1; n != 0; ++i) {
+    if (nodes_[n].terminal) best = i;
+    if (i == s.size()) break;
+    n = child(n, static_cast<uint8_t>(s[i]));
+  }
+  return best;
+}
+
+size_t WordPieceVocab::countPieces(std::string_view word) const
+{
+  size_t pieces = 0;
+  for (size_t start = 0; start < word.size(); ++pieces) {
+    const size_t len = longestMatch(word.substr(start), 0 < start);
+    start += len ? len : 1;
+  }
+  return pieces;
+}
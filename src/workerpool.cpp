@@ -0,0 +1,169 @@
+#include "workerpool.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <utils_log/logger.hpp>
+
+
+struct WorkerPool::Impl {
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable exited_;
+  struct Task {
+    std::function<void()> fn;
+    std::chrono::steady_clock::time_point queuedAt;
+  };
+  std::deque<Task> queue_;
+  size_t size_ = 0;
+  size_t maxQueued_ = 0;
+  size_t maxDetached_ = 0;
+  size_t rejected_ = 0;
+  size_t started_ = 0;
+  double totalWaitMs_ = 0;
+  size_t workers_ = 0;  // threads counted against size_, above it after a reattach
+  size_t busy_ = 0;     // workers running a task
+  size_t detached_ = 0; // threads that left the pool and finish their task
+  size_t threads_ = 0;  // all live threads
+  bool shutdown_ = false;
+
+  // The pool and detach state of the calling thread.
+  static thread_local Impl *current_;
+  static thread_local bool detached_current_;
+
+  void spawn() {
+    ++workers_;
+    ++threads_;
+    std::thread([this]() { run(); }).detach();
+  }
+
+  void run() {
+    current_ = this;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this]() { return shutdown_ || !queue_.empty() || size_ < workers_; });
+      // Shutting down, or surplus since a detached thread rejoined.
+      if (queue_.empty()) break;
+      auto task = std::move(queue_.front().fn);
+      totalWaitMs_ += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - queue_.front().queuedAt).count();
+      ++started_;
+      queue_.pop_front();
+      ++busy_;
+      lock.unlock();
+      try {
+        task();
+      } catch (const std::exception &e) {
+        LOG_MSG << "Worker task failed:" << e.what();
+      } catch (...) {
+        LOG_MSG << "Worker task failed";
+      }
+      lock.lock();
+      if (detached_current_) {
+        // A replacement took this thread's place.
+        --detached_;
+        detached_current_ = false;
+        if (size_ <= workers_) {
+          --threads_;
+          exited_.notify_all();
+          return;
+        }
+        ++workers_;
+      } else {
+        --busy_;
+      }
+    }
+    --workers_;
+    --threads_;
+    exited_.notify_all();
+  }
+};
+
+thread_local WorkerPool::Impl *WorkerPool::Impl::current_ = nullptr;
+thread_local bool WorkerPool::Impl::detached_current_ = false;
+
+
+WorkerPool::WorkerPool(size_t workers, size_t maxQueued, size_t maxDetached) : imp(new Impl)
+{
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  imp->size_ = (std::max)(workers, size_t(1));
+  imp->maxQueued_ = maxQueued;
+  imp->maxDetached_ = maxDetached ? maxDetached : imp->size_;
+  for (size_t i = 0; i < imp->size_; ++i) {
+    imp->spawn();
+  }
+}
+
+WorkerPool::~WorkerPool()
+{
+  shutdown();
+}
+
+bool WorkerPool::enqueue(std::function<void()> task)
+{
+  {
+    std::lock_guard<std::mutex> lock(imp->mutex_);
+    if (imp->shutdown_) return false;
+    if (0 < imp->maxQueued_ && imp->maxQueued_ <= imp->queue_.size()) {
+      ++imp->rejected_;
+      return false;
+    }
+    imp->queue_.push_back({ std::move(task), std::chrono::steady_clock::now() });
+  }
+  imp->cv_.notify_one();
+  return true;
+}
+
+void WorkerPool::shutdown()
+{
+  std::unique_lock<std::mutex> lock(imp->mutex_);
+  imp->shutdown_ = true;
+  imp->cv_.notify_all();
+  imp->exited_.wait(lock, [this]() { return imp->threads_ == 0; });
+}
+
+WorkerPool::Stats WorkerPool::stats() const
+{
+  std::lock_guard<std::mutex> lock(imp->mutex_);
+  Stats s;
+  s.workers = imp->workers_;
+  s.busy = imp->busy_;
+  s.detached = imp->detached_;
+  s.threads = imp->threads_;
+  s.queued = imp->queue_.size();
+  s.rejected = imp->rejected_;
+  s.started = imp->started_;
+  s.totalWaitMs = imp->totalWaitMs_;
+  return s;
+}
+
+bool WorkerPool::detachCurrent()
+{
+  Impl *pool = Impl::current_;
+  if (!pool || Impl::detached_current_) return false;
+  std::lock_guard<std::mutex> lock(pool->mutex_);
+  if (pool->maxDetached_ <= pool->detached_) return false;
+  Impl::detached_current_ = true;
+  --pool->workers_;
+  --pool->busy_;
+  ++pool->detached_;
+  // Also while shutting down, the queued tasks still need a worker.
+  if (pool->workers_ < pool->size_) pool->spawn();
+  return true;
+}
+
+void WorkerPool::reattachCurrent()
+{
+  Impl *pool = Impl::current_;
+  if (!pool || !Impl::detached_current_) return;
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex_);
+    Impl::detached_current_ = false;
+    --pool->detached_;
+    ++pool->workers_;
+    ++pool->busy_;
+  }
+  // An idle worker makes way; a busy one does once its task ends.
+  pool->cv_.notify_one();
+}